@@ -0,0 +1,35 @@
+"# This file contains some default general-purpose definitions.\n"
+"\n"
+"nodent: \\N !(\\t/` )\n"
+"indent: \\N (` /\\t)\n"
+"dedent: $ !(nodent/indent)\n"
+"crlf: \\r\\n\n"
+"cr: \\r\n"
+"anglebraces: `< ..%(\\n/>`<anglebraces/>`\",'string) `>\n"
+"brackets: `[ ..%(\\n/>`[brackets/>`\",'string) `]\n"
+"braces: `{ ..%(\\n/>`{braces/>`\",'string) `}\n"
+"parens: `( ..%(\\n/>`(parens/>`\",'string) `)\n"
+"string: `\" ..%string-escape `\" / `' ..%string-escape `'\n"
+"string-escape: `\\ (`x 2 Hex / 1-3 `0-7 / `u 1-4 Hex / .)\n"
+"id: \\I *\\i\n"
+"var: \\I *\\i\n"
+"keyword: !\"\" # No keywords defined by default\n"
+"word: \\b +\\i\n"
+"HEX: `0-9,A-F\n"
+"Hex: `0-9,a-f,A-F\n"
+"hex: `0-9,a-f\n"
+"number: +`0-9 [`. *`0-9] / `. +`0-9\n"
+"int: +`0-9\n"
+"digit: `0-9\n"
+"Abc123: `a-z,A-Z,0-9\n"
+"ABC123: `A-Z,0-9\n"
+"abc123: `a-z,0-9\n"
+"Abc: `a-z,A-Z\n"
+"ABC: `A-Z\n"
+"abc: `a-z\n"
+"esc: \\e\n"
+"tab: \\t\n"
+"nl: \\n; lf: \\n\n"
+"comment: !''; # No default definition, can be overridden\n"
+"__: *(` /\\t/\\n/\\r/comment)\n"
+"_:\t*(` /\\t)\n"
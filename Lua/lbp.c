@@ -1,13 +1,22 @@
 /*
 * lbp.c - bp library for lua
 * API:
-*   bp.match(pat, str, [start_index]) -> nil or match_table
+*   bp.match(pat, str, [start_index]) -> nil or match_object
 *   bp.replace(pat, replacement, str, [start_index]) -> str with replacements, num_replacements
-*   for match_table in bp.matches(pat, str, [start_index]) do ... end
+*   for match_object in bp.matches(pat, str, [start_index]) do ... end
+*   for start, after in bp.spans(pat, str, [start_index]) do ... end
+*   bp.count(pat, str, [start_index]) -> num_matches
 *   bp.compile(pat) -> pattern object
 *       pat:match(str, [start_index])
 *       pat:replace(replacement, str, [start_index])
 *       for match in pat:matches(str, [start_index]) do ... end
+*       for start, after in pat:spans(str, [start_index]) do ... end
+*       pat:count(str, [start_index]) -> num_matches
+*       pat:document(str) -> document object
+*   bp.document(pat, str) -> document object
+*       for match in doc:matches() do ... end
+*       doc:edit(index, num_deleted, inserted_str) -> rematched_start, rematched_after
+*       doc:gettext() -> str
 */
 
 #include <fcntl.h>
@@ -27,10 +36,73 @@
 static const char *builtins_source = (
 #include "builtins.h"
 );
-static int MATCH_METATABLE = 0, PAT_METATABLE = 0;
+static int MATCH_METATABLE = 0, PAT_METATABLE = 0, DOC_METATABLE = 0;
 static bp_pat_t *builtins;
 
-static void push_match(lua_State *L, bp_match_t *m, const char *start);
+// A match (or a capture) in a match object. A match's captures are stored
+// right after it, each followed by its own captures.
+typedef struct {
+    // Where the match is in the text (as offsets)
+    size_t start, end;
+    // How many nodes the match and all of its captures take up
+    size_t size;
+    // The name of a named capture (or NULL) and the tag of a tagged match
+    // (or NULL), which point into the pattern
+    const char *name, *tag;
+    size_t namelen, taglen;
+    // Whether the match's text has replacements in it (so it isn't just a
+    // substring of the text)
+    bool replaced;
+} match_node_t;
+
+// The userdata for a match object, which only keeps offsets into the text.
+// Substrings and capture objects are made when they're first used. The
+// outermost match object holds the nodes for all of its captures, and its
+// user values are: 1) the text, 2) the pattern, 3) a cache of capture
+// objects, and 4) the text of nodes that have replacements. Capture objects
+// point to their nodes and have the outermost match as their second user
+// value.
+typedef struct {
+    const match_node_t *nodes;
+    match_node_t _nodes[];
+} match_obj_t;
+
+// The userdata for a compiled pattern object
+typedef struct {
+    bp_pat_t *pat;
+    bp_pat_arena_t *arena;
+} compiled_pat_t;
+
+// The state of a bp.matches() loop for a pattern without captures, which finds
+// matches in batches
+typedef struct {
+    bp_span_search_t search;
+    size_t nspans, next_span;
+    bp_span_t spans[64];
+} span_iter_t;
+
+// Where a match is in a document's text
+typedef struct {
+    size_t start, end;
+} doc_span_t;
+
+// The userdata for a document: some text and where a pattern's matches are
+// in it, which are kept up to date as the text is edited. Each document has
+// its own matcher, so matching errors are only raised once the document is
+// back in a consistent state.
+typedef struct {
+    bp_pat_t *pat;
+    bp_matcher_t *matcher;
+    char *text;
+    size_t len, capacity;
+    doc_span_t *spans;
+    size_t nspans, spans_capacity;
+    // When no match depends on text outside of the line it starts on, an
+    // edit only needs the lines it touched to be re-matched
+    bool line_local;
+    // Set when matching failed, so the whole text is re-matched next time
+    bool stale;
+} document_t;
 
 lua_State *cur_state = NULL;
 
@@ -60,8 +132,9 @@ static int Lcompile(lua_State *L)
         raise_parse_error(L, maybe_pat);
         return 0;
     }
-    bp_pat_t **pat_storage = (bp_pat_t**)lua_newuserdatauv(L, sizeof(bp_pat_t*), 1);
-    *pat_storage = maybe_pat.value.pat;
+    compiled_pat_t *compiled = (compiled_pat_t*)lua_newuserdatauv(L, sizeof(compiled_pat_t), 1);
+    compiled->pat = maybe_pat.value.pat;
+    compiled->arena = maybe_pat.arena;
     lua_pushvalue(L, 1);
     lua_setiuservalue(L, -2, 1);
     lua_pushlightuserdata(L, (void*)&PAT_METATABLE);
@@ -96,52 +169,114 @@ static bp_match_t *get_first_capture(bp_match_t *m)
     return NULL;
 }
 
-static void set_capture_fields(lua_State *L, bp_match_t *m, int *n, const char *start)
+static bool has_replacement(bp_match_t *m)
+{
+    if (m->pat->type == BP_REPLACE) return true;
+    for (int i = 0; m->children && m->children[i]; i++)
+        if (has_replacement(m->children[i])) return true;
+    return false;
+}
+
+static size_t add_match_nodes(match_node_t *nodes, bp_match_t **sources, bp_match_t *m, const char *text,
+                              const char *name, size_t namelen, bool replacements);
+
+// Add the nodes for the captures inside `m` (but not `m` itself), returning
+// how many nodes were added. If `nodes` is NULL, they're only counted.
+static size_t add_capture_nodes(match_node_t *nodes, bp_match_t **sources, bp_match_t *m, const char *text, bool replacements)
 {
     if (m->pat->type == BP_CAPTURE) {
         bp_match_t *cap = get_first_capture(m->children[0]);
         if (!cap) cap = m->children[0];
         auto capture = When(m->pat, BP_CAPTURE);
-        if (capture->namelen > 0) {
-            lua_pushlstring(L, capture->name, capture->namelen);
-            push_match(L, cap, start);
-            lua_settable(L, -3);
-        } else {
-            push_match(L, cap, start);
-            lua_seti(L, -2, (*n)++);
-        }
+        return add_match_nodes(nodes, sources, cap, text, capture->namelen > 0 ? capture->name : NULL, capture->namelen, replacements);
     } else if (m->pat->type == BP_TAGGED) {
-        push_match(L, m, start);
-        lua_seti(L, -2, (*n)++);
-    } else if (m->children) {
-        for (int i = 0; m->children[i]; i++)
-            set_capture_fields(L, m->children[i], n, start);
+        return add_match_nodes(nodes, sources, m, text, NULL, 0, replacements);
     }
+    size_t n = 0;
+    for (int i = 0; m->children && m->children[i]; i++)
+        n += add_capture_nodes(nodes ? &nodes[n] : NULL, sources ? &sources[n] : NULL, m->children[i], text, replacements);
+    return n;
 }
 
-static void push_match(lua_State *L, bp_match_t *m, const char *start)
+// Add the nodes for a match (stored under the given capture name, if any) and
+// its captures, returning how many nodes were added. If `nodes` is NULL,
+// they're only counted. `replacements` is whether the match tree has any
+// replacements in it, and if `sources` isn't NULL, it gets the match that
+// each node came from.
+static size_t add_match_nodes(match_node_t *nodes, bp_match_t **sources, bp_match_t *m, const char *text,
+                              const char *name, size_t namelen, bool replacements)
 {
-    lua_createtable(L, 1, 2);
+    size_t n = 1;
+    for (int i = 0; m->children && m->children[i]; i++)
+        n += add_capture_nodes(nodes ? &nodes[n] : NULL, sources ? &sources[n] : NULL, m->children[i], text, replacements);
+    if (nodes) {
+        nodes[0] = (match_node_t){
+            .start = (size_t)(m->start - text), .end = (size_t)(m->end - text), .size = n,
+            .name = name, .namelen = namelen,
+            .replaced = replacements && has_replacement(m),
+        };
+        if (m->pat->type == BP_TAGGED) {
+            nodes[0].tag = When(m->pat, BP_TAGGED)->name;
+            nodes[0].taglen = When(m->pat, BP_TAGGED)->namelen;
+        }
+    }
+    if (sources) sources[0] = m;
+    return n;
+}
+
+// Make a new match object with room for the given number of nodes. The text
+// (and the pattern, if the nodes have capture names or tags) should be at
+// the given stack indices.
+static match_obj_t *new_match_obj(lua_State *L, size_t nnodes, int text_index, int pat_index)
+{
+    text_index = lua_absindex(L, text_index);
+    pat_index = pat_index ? lua_absindex(L, pat_index) : 0;
+    match_obj_t *obj = (match_obj_t*)lua_newuserdatauv(L, sizeof(match_obj_t) + sizeof(match_node_t[nnodes]), 4);
+    obj->nodes = obj->_nodes;
     lua_pushlightuserdata(L, (void*)&MATCH_METATABLE);
     lua_gettable(L, LUA_REGISTRYINDEX);
     lua_setmetatable(L, -2);
-    push_matchstring(L, m);
-    lua_seti(L, -2, 0);
+    lua_pushvalue(L, text_index);
+    lua_setiuservalue(L, -2, 1);
+    if (pat_index) {
+        lua_pushvalue(L, pat_index);
+        lua_setiuservalue(L, -2, 2);
+    }
+    return obj;
+}
 
-    if (m->pat->type == BP_TAGGED) {
-        auto tagged = When(m->pat, BP_TAGGED);
-        lua_pushlstring(L, tagged->name, tagged->namelen);
-        lua_setfield(L, -2, "__tag");
+// Push a match object for `m`, which only stores where the match and its
+// captures are. The text and pattern should be at the given stack indices.
+static void push_match(lua_State *L, bp_match_t *m, const char *text, int text_index, int pat_index)
+{
+    bool replacements = has_replacement(m);
+    size_t nnodes = add_match_nodes(NULL, NULL, m, text, NULL, 0, false);
+    match_obj_t *obj = new_match_obj(L, nnodes, text_index, pat_index);
+    if (!replacements) {
+        add_match_nodes(obj->_nodes, NULL, m, text, NULL, 0, false);
+        return;
     }
 
-    int capture_num = 1;
-    for (int i = 0; m->children && m->children[i]; i++)
-        set_capture_fields(L, m->children[i], &capture_num, start);
+    // Text with replacements in it can't be taken from the original text, so
+    // it's worked out now, while the match tree is still around:
+    bp_match_t **sources = new(bp_match_t*[nnodes]);
+    add_match_nodes(obj->_nodes, sources, m, text, NULL, 0, true);
+    lua_createtable(L, 0, 1);
+    for (size_t i = 0; i < nnodes; i++) {
+        if (!obj->_nodes[i].replaced) continue;
+        push_matchstring(L, sources[i]);
+        lua_rawseti(L, -2, (lua_Integer)i);
+    }
+    lua_setiuservalue(L, -2, 4);
+    delete(&sources);
+}
 
-    lua_pushinteger(L, 1 + (int)(m->start - start));
-    lua_setfield(L, -2, "start");
-    lua_pushinteger(L, 1 + (int)(m->end - start));
-    lua_setfield(L, -2, "after");
+// Push a match object (without captures) for a match between `start` and
+// `end` in the given text, which should be at the given stack index
+static void push_span_match(lua_State *L, const char *text, int text_index, const char *start, const char *end)
+{
+    match_obj_t *obj = new_match_obj(L, 1, text_index, 0);
+    obj->_nodes[0] = (match_node_t){.start = (size_t)(start - text), .end = (size_t)(end - text), .size = 1};
 }
 
 static int Lmatch(lua_State *L)
@@ -151,14 +286,14 @@ static int Lmatch(lua_State *L)
             return 0;
         lua_replace(L, 1);
     }
-    bp_pat_t **at_pat = lua_touserdata(L, 1);
-    bp_pat_t *pat = at_pat ? *at_pat : NULL;
+    compiled_pat_t *compiled = lua_touserdata(L, 1);
+    bp_pat_t *pat = compiled ? compiled->pat : NULL;
     if (!pat) luaL_error(L, "Not a valid pattern");
 
     size_t textlen;
     const char *text = luaL_checklstring(L, 2, &textlen);
     lua_Integer index;
-    if (lua_istable(L, 3)) {
+    if (lua_type(L, 3) == LUA_TTABLE || lua_type(L, 3) == LUA_TUSERDATA) {
         lua_getfield(L, 3, "start");
         lua_getfield(L, 3, "after");
         index = luaL_optinteger(L, -1, 1);
@@ -175,7 +310,7 @@ static int Lmatch(lua_State *L)
     cur_state = L;
     bp_errhand_t old = bp_set_error_handler(match_error);
     if (next_match(&m, text+index-1, &text[textlen], pat, builtins, NULL, false)) {
-        push_match(L, m, text);
+        push_match(L, m, text, 2, 1);
         stop_matching(&m);
         ret = 1;
     }
@@ -190,8 +325,8 @@ static int Lreplace(lua_State *L)
             return 0;
         lua_replace(L, 1);
     }
-    bp_pat_t **at_pat = lua_touserdata(L, 1);
-    bp_pat_t *pat = at_pat ? *at_pat : NULL;
+    compiled_pat_t *compiled = lua_touserdata(L, 1);
+    bp_pat_t *pat = compiled ? compiled->pat : NULL;
     if (!pat) luaL_error(L, "Not a valid pattern");
 
     size_t replen, textlen;
@@ -228,7 +363,7 @@ static int Lreplace(lua_State *L)
     lua_pushinteger(L, replacements);
     fclose(out);
 
-    delete_pat(&rep_pat, false);
+    free_pat_arena(&maybe_replacement.arena);
 
     return 2;
 }
@@ -242,17 +377,86 @@ static int iter(lua_State *L)
     return Lmatch(L);
 }
 
+// Find the next match in a batched search, returning false if there are no
+// more
+static bool next_iter_span(lua_State *L, span_iter_t *it, bp_span_t *span)
+{
+    if (it->next_span >= it->nspans) {
+        cur_state = L;
+        bp_errhand_t old = bp_set_error_handler(match_error);
+        it->nspans = bp_next_spans(bp_default_matcher(), &it->search, it->spans, sizeof(it->spans)/sizeof(it->spans[0]));
+        it->next_span = 0;
+        bp_set_error_handler(old);
+        if (it->nspans == 0) return false;
+    }
+    *span = it->spans[it->next_span++];
+    return true;
+}
+
+static int span_iter(lua_State *L)
+{
+    span_iter_t *it = lua_touserdata(L, 1);
+    bp_span_t span;
+    if (!next_iter_span(L, it, &span)) return 0;
+    lua_getiuservalue(L, 1, 2);
+    push_span_match(L, it->search.start, -1, span.start, span.end);
+    return 1;
+}
+
+static int offsets_iter(lua_State *L)
+{
+    span_iter_t *it = lua_touserdata(L, 1);
+    bp_span_t span;
+    if (!next_iter_span(L, it, &span)) return 0;
+    lua_pushinteger(L, 1 + (lua_Integer)(span.start - it->search.start));
+    lua_pushinteger(L, 1 + (lua_Integer)(span.end - it->search.start));
+    return 2;
+}
+
+// Push an iterator function and its state for finding a pattern's matches in
+// batches. The pattern, text, and (optional) start index should be the first
+// three arguments.
+static int push_span_iter(lua_State *L, bp_pat_t *pat, lua_CFunction iter_fn)
+{
+    size_t textlen;
+    const char *text = luaL_checklstring(L, 2, &textlen);
+    lua_Integer index = luaL_optinteger(L, 3, 1);
+    lua_pushcfunction(L, iter_fn);
+    span_iter_t *it = (span_iter_t*)lua_newuserdatauv(L, sizeof(span_iter_t), 2);
+    // Keep the pattern and the text from being garbage collected:
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, -2, 1);
+    lua_pushvalue(L, 2);
+    lua_setiuservalue(L, -2, 2);
+    *it = (span_iter_t){
+        .search = {
+            .start = text, .end = &text[textlen], .pat = pat, .defs = builtins,
+            .pos = index <= (lua_Integer)textlen+1 ? text+index-1 : NULL,
+        },
+    };
+    return 2;
+}
+
 static int Lmatches(lua_State *L)
 {
     int nargs = lua_gettop(L);
-    lua_pushcfunction(L, iter); // iter
-    lua_createtable(L, 2, 0); // state: {pat, str}
     if (lua_isstring(L, 1)) {
         if (Lcompile(L) != 1)
             return 0;
-    } else {
-        lua_pushvalue(L, 1);
+        lua_replace(L, 1);
     }
+    compiled_pat_t *compiled = lua_touserdata(L, 1);
+    bp_pat_t *pat = compiled ? compiled->pat : NULL;
+    if (!pat) luaL_error(L, "Not a valid pattern");
+
+    // Match objects for patterns without captures only need to know where
+    // each match is, so those matches are found in batches:
+    if (!has_captures(pat, builtins))
+        return push_span_iter(L, pat, span_iter);
+
+    lua_pushcfunction(L, iter); // iter
+    lua_createtable(L, 2, 0); // state: {pat, str}
+    lua_pushvalue(L, 1);
     lua_seti(L, -2, 1);
     lua_pushvalue(L, 2);
     lua_seti(L, -2, 2);
@@ -262,12 +466,412 @@ static int Lmatches(lua_State *L)
     return 3;
 }
 
+static int Lspans(lua_State *L)
+{
+    if (lua_isstring(L, 1)) {
+        if (Lcompile(L) != 1)
+            return 0;
+        lua_replace(L, 1);
+    }
+    compiled_pat_t *compiled = lua_touserdata(L, 1);
+    bp_pat_t *pat = compiled ? compiled->pat : NULL;
+    if (!pat) luaL_error(L, "Not a valid pattern");
+    return push_span_iter(L, pat, offsets_iter);
+}
+
+static int Lcount(lua_State *L)
+{
+    if (lua_isstring(L, 1)) {
+        if (Lcompile(L) != 1)
+            return 0;
+        lua_replace(L, 1);
+    }
+    compiled_pat_t *compiled = lua_touserdata(L, 1);
+    bp_pat_t *pat = compiled ? compiled->pat : NULL;
+    if (!pat) luaL_error(L, "Not a valid pattern");
+
+    size_t textlen;
+    const char *text = luaL_checklstring(L, 2, &textlen);
+    lua_Integer index = luaL_optinteger(L, 3, 1);
+    size_t count = 0;
+    if (index <= (lua_Integer)textlen+1) {
+        cur_state = L;
+        bp_errhand_t old = bp_set_error_handler(match_error);
+        count = bp_count_matches(bp_default_matcher(), text+index-1, &text[textlen], pat, builtins, NULL, false);
+        bp_set_error_handler(old);
+    }
+    lua_pushinteger(L, (lua_Integer)count);
+    return 1;
+}
+
+// Find the matches in a document that start in [from, to) (or anywhere from
+// `from` on, if `to` is the end of the text) and append them to `found`.
+// Returns false if there was a matching error.
+static bool find_doc_spans(document_t *doc, size_t from, size_t to, doc_span_t **found, size_t *nfound, size_t *capacity)
+{
+    bp_span_search_t search = {
+        .start = doc->text, .pos = &doc->text[from], .end = &doc->text[doc->len],
+        .stop = to < doc->len ? &doc->text[to] : NULL,
+        .pat = doc->pat, .defs = builtins,
+    };
+    bp_span_t spans[64];
+    for (size_t n; (n = bp_next_spans(doc->matcher, &search, spans, sizeof(spans)/sizeof(spans[0]))) > 0; ) {
+        if (*nfound + n > *capacity) {
+            *capacity = *nfound + n > 2*(*capacity) ? *nfound + n : 2*(*capacity);
+            *found = grow(*found, *capacity);
+        }
+        for (size_t i = 0; i < n; i++)
+            (*found)[(*nfound)++] = (doc_span_t){
+                (size_t)(spans[i].start - doc->text), (size_t)(spans[i].end - doc->text),
+            };
+    }
+    return bp_matcher_error(doc->matcher) == NULL;
+}
+
+// Return the index of the first span in a document that starts at or after
+// the given offset
+static size_t first_doc_span_from(document_t *doc, size_t offset)
+{
+    size_t lo = 0, hi = doc->nspans;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (doc->spans[mid].start < offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Replace `deleted` bytes of a document's text at `offset` with the inserted
+// text, then update the matches: the ones before the edited lines are kept,
+// the ones after them are moved, and the edited lines are re-matched (or the
+// whole text is, if matches can depend on other lines). The part of the text
+// that was re-matched is returned in `*from` and `*to`. Returns false if
+// there was a matching error.
+static bool edit_document(document_t *doc, size_t offset, size_t deleted, const char *inserted, size_t inserted_len,
+                          size_t *from, size_t *to)
+{
+    size_t old_len = doc->len, len = old_len - deleted + inserted_len;
+    if (len + 1 > doc->capacity) {
+        doc->capacity = len + 1 > 2*doc->capacity ? len + 1 : 2*doc->capacity;
+        doc->text = grow(doc->text, doc->capacity);
+    }
+    memmove(&doc->text[offset + inserted_len], &doc->text[offset + deleted], old_len - offset - deleted);
+    memcpy(&doc->text[offset], inserted, inserted_len);
+    doc->len = len;
+    doc->text[len] = '\0';
+
+    // Re-match the edited lines, including a match that starts on the
+    // newline at the end of the last one (e.g. `$`):
+    *from = 0, *to = len;
+    if (doc->line_local && !doc->stale) {
+        *from = offset;
+        while (*from > 0 && doc->text[*from - 1] != '\n') --*from;
+        *to = offset + inserted_len;
+        while (*to < len && doc->text[*to] != '\n') ++*to;
+        if (*to < len) ++*to;
+    }
+    bool to_end = *to >= len;
+
+    doc_span_t *found = NULL;
+    size_t nfound = 0, capacity = 0;
+    if (!find_doc_spans(doc, *from, *to, &found, &nfound, &capacity)) {
+        if (found) delete(&found);
+        doc->stale = true;
+        return false;
+    }
+    doc->stale = false;
+
+    // The old matches that start in the re-matched part get replaced:
+    size_t first = first_doc_span_from(doc, *from);
+    size_t after = to_end ? doc->nspans : first_doc_span_from(doc, *to - inserted_len + deleted);
+    size_t nkept = doc->nspans - after;
+    if (first + nfound + nkept > doc->spans_capacity) {
+        doc->spans_capacity = first + nfound + nkept;
+        doc->spans = grow(doc->spans, doc->spans_capacity);
+    }
+    memmove(&doc->spans[first + nfound], &doc->spans[after], sizeof(doc_span_t[nkept]));
+    for (size_t i = first + nfound; i < first + nfound + nkept; i++) {
+        doc->spans[i].start = doc->spans[i].start - deleted + inserted_len;
+        doc->spans[i].end = doc->spans[i].end - deleted + inserted_len;
+    }
+    if (nfound > 0) memcpy(&doc->spans[first], found, sizeof(doc_span_t[nfound]));
+    doc->nspans = first + nfound + nkept;
+    if (found) delete(&found);
+    return true;
+}
+
+static int Ldocument(lua_State *L)
+{
+    if (lua_isstring(L, 1)) {
+        if (Lcompile(L) != 1)
+            return 0;
+        lua_replace(L, 1);
+    }
+    compiled_pat_t *compiled = lua_touserdata(L, 1);
+    bp_pat_t *pat = compiled ? compiled->pat : NULL;
+    if (!pat) luaL_error(L, "Not a valid pattern");
+    size_t textlen;
+    const char *text = luaL_checklstring(L, 2, &textlen);
+
+    document_t *doc = (document_t*)lua_newuserdatauv(L, sizeof(document_t), 2);
+    *doc = (document_t){.pat = pat, .matcher = bp_new_matcher(), .line_local = !depends_on_other_lines(pat, builtins)};
+    // Keep the pattern from being garbage collected:
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, -2, 1);
+    lua_pushlightuserdata(L, (void*)&DOC_METATABLE);
+    lua_gettable(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+
+    doc->capacity = textlen + 1;
+    doc->text = grow(doc->text, doc->capacity);
+    memcpy(doc->text, text, textlen);
+    doc->len = textlen;
+    doc->text[textlen] = '\0';
+    if (!find_doc_spans(doc, 0, textlen, &doc->spans, &doc->nspans, &doc->spans_capacity))
+        luaL_error(L, "%s", bp_matcher_error(doc->matcher));
+    return 1;
+}
+
+// Push a Lua string with a document's current text. Match objects refer to
+// this string, so the same one is used until the text is edited.
+static void push_doc_text(lua_State *L, int index, document_t *doc)
+{
+    if (lua_getiuservalue(L, index, 2) != LUA_TNIL) return;
+    lua_pop(L, 1);
+    lua_pushlstring(L, doc->text ? doc->text : "", doc->len);
+    lua_pushvalue(L, -1);
+    lua_setiuservalue(L, index, 2);
+}
+
+static int doc_iter(lua_State *L)
+{
+    document_t *doc = lua_touserdata(L, lua_upvalueindex(1));
+    lua_Integer i = lua_tointeger(L, lua_upvalueindex(2));
+    if (i >= (lua_Integer)doc->nspans) return 0;
+    lua_pushinteger(L, i + 1);
+    lua_replace(L, lua_upvalueindex(2));
+    push_doc_text(L, lua_upvalueindex(1), doc);
+    push_span_match(L, doc->text, -1, &doc->text[doc->spans[i].start], &doc->text[doc->spans[i].end]);
+    return 1;
+}
+
+static int Ldoc_matches(lua_State *L)
+{
+    document_t *doc = lua_touserdata(L, 1);
+    if (!doc) luaL_error(L, "Not a valid document");
+    // After a matching error, the matches have to be found again:
+    size_t from, to;
+    if (doc->stale && !edit_document(doc, 0, 0, "", 0, &from, &to))
+        luaL_error(L, "%s", bp_matcher_error(doc->matcher));
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, doc_iter, 2);
+    return 1;
+}
+
+static int Ldoc_edit(lua_State *L)
+{
+    document_t *doc = lua_touserdata(L, 1);
+    if (!doc) luaL_error(L, "Not a valid document");
+    lua_Integer index = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, 1 <= index && index <= (lua_Integer)doc->len + 1, 2, "index out of range");
+    lua_Integer deleted = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, 0 <= deleted && deleted <= (lua_Integer)doc->len + 1 - index, 3, "deletion out of range");
+    size_t inserted_len;
+    const char *inserted = luaL_optlstring(L, 4, "", &inserted_len);
+
+    // Matches from before the edit keep referring to the old text:
+    lua_pushnil(L);
+    lua_setiuservalue(L, 1, 2);
+    size_t from, to;
+    if (!edit_document(doc, (size_t)(index - 1), (size_t)deleted, inserted, inserted_len, &from, &to))
+        luaL_error(L, "%s", bp_matcher_error(doc->matcher));
+    lua_pushinteger(L, (lua_Integer)from + 1);
+    lua_pushinteger(L, (lua_Integer)to + 1);
+    return 2;
+}
+
+static int Ldoc_gettext(lua_State *L)
+{
+    document_t *doc = lua_touserdata(L, 1);
+    if (!doc) luaL_error(L, "Not a valid document");
+    push_doc_text(L, 1, doc);
+    return 1;
+}
+
+static int Ldoc_gc(lua_State *L)
+{
+    document_t *doc = lua_touserdata(L, 1);
+    if (doc->matcher) bp_destroy_matcher(&doc->matcher);
+    if (doc->text) delete(&doc->text);
+    if (doc->spans) delete(&doc->spans);
+    return 0;
+}
+
+// Push the outermost match object of the match object at the given index
+static match_obj_t *push_match_root(lua_State *L, int index, match_obj_t *obj)
+{
+    if (obj->nodes == obj->_nodes) lua_pushvalue(L, index);
+    else lua_getiuservalue(L, index, 2);
+    return lua_touserdata(L, -1);
+}
+
+// Push the text of the match object at the given index
+static void push_match_text(lua_State *L, int index, match_obj_t *obj)
+{
+    if (obj->nodes[0].replaced) {
+        match_obj_t *root = push_match_root(L, index, obj);
+        lua_getiuservalue(L, -1, 4);
+        lua_rawgeti(L, -1, (lua_Integer)(obj->nodes - root->nodes));
+        lua_replace(L, -3);
+        lua_pop(L, 1);
+    } else {
+        lua_getiuservalue(L, index, 1);
+        const char *text = lua_tostring(L, -1);
+        lua_pushlstring(L, &text[obj->nodes[0].start], obj->nodes[0].end - obj->nodes[0].start);
+        lua_remove(L, -2);
+    }
+}
+
+// Push the object for the capture whose node is `i` nodes after the match's
+// node, making it if it hasn't been used before
+static void push_capture(lua_State *L, int index, match_obj_t *obj, size_t i)
+{
+    index = lua_absindex(L, index);
+    if (lua_getiuservalue(L, index, 3) == LUA_TNIL) {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, 0);
+        lua_pushvalue(L, -1);
+        lua_setiuservalue(L, index, 3);
+    }
+    if (lua_rawgeti(L, -1, (lua_Integer)i) != LUA_TNIL) {
+        lua_remove(L, -2);
+        return;
+    }
+    lua_pop(L, 1);
+
+    match_obj_t *cap = (match_obj_t*)lua_newuserdatauv(L, sizeof(match_obj_t), 3);
+    cap->nodes = &obj->nodes[i];
+    lua_pushlightuserdata(L, (void*)&MATCH_METATABLE);
+    lua_gettable(L, LUA_REGISTRYINDEX);
+    lua_setmetatable(L, -2);
+    lua_getiuservalue(L, index, 1);
+    lua_setiuservalue(L, -2, 1);
+    push_match_root(L, index, obj);
+    lua_setiuservalue(L, -2, 2);
+
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, (lua_Integer)i);
+    lua_remove(L, -2);
+}
+
+// Return how many nodes after a match's node the capture for a key is (a
+// capture number or name), or 0 if the match has no such capture. If several
+// captures have the same name, the last one is used.
+static size_t find_capture(lua_State *L, match_obj_t *obj, int key_index)
+{
+    const match_node_t *nodes = obj->nodes;
+    size_t found = 0;
+    if (lua_isinteger(L, key_index)) {
+        lua_Integer n = lua_tointeger(L, key_index);
+        for (size_t i = 1; i < nodes[0].size && n > 0; i += nodes[i].size) {
+            if (!nodes[i].name && --n == 0)
+                found = i;
+        }
+    } else if (lua_type(L, key_index) == LUA_TSTRING) {
+        size_t len;
+        const char *name = lua_tolstring(L, key_index, &len);
+        for (size_t i = 1; i < nodes[0].size; i += nodes[i].size) {
+            if (nodes[i].name && nodes[i].namelen == len && strncmp(nodes[i].name, name, len) == 0)
+                found = i;
+        }
+    }
+    return found;
+}
+
+static int Lmatch_index(lua_State *L)
+{
+    match_obj_t *obj = lua_touserdata(L, 1);
+    const match_node_t *node = &obj->nodes[0];
+    if (lua_isinteger(L, 2) && lua_tointeger(L, 2) == 0) {
+        push_match_text(L, 1, obj);
+        return 1;
+    } else if (lua_type(L, 2) == LUA_TSTRING) {
+        const char *key = lua_tostring(L, 2);
+        if (streq(key, "start")) {
+            lua_pushinteger(L, 1 + (lua_Integer)node->start);
+            return 1;
+        } else if (streq(key, "after")) {
+            lua_pushinteger(L, 1 + (lua_Integer)node->end);
+            return 1;
+        } else if (streq(key, "__tag")) {
+            if (node->tag) lua_pushlstring(L, node->tag, node->taglen);
+            else lua_pushnil(L);
+            return 1;
+        }
+    }
+    size_t i = find_capture(L, obj, 2);
+    if (i > 0) push_capture(L, 1, obj, i);
+    else lua_pushnil(L);
+    return 1;
+}
+
+static int Lmatch_len(lua_State *L)
+{
+    match_obj_t *obj = lua_touserdata(L, 1);
+    lua_Integer n = 0;
+    for (size_t i = 1; i < obj->nodes[0].size; i += obj->nodes[i].size)
+        if (!obj->nodes[i].name) ++n;
+    lua_pushinteger(L, n);
+    return 1;
+}
+
 static int Lmatch_tostring(lua_State *L)
 {
-    lua_geti(L, 1, 0);
+    push_match_text(L, 1, lua_touserdata(L, 1));
     return 1;
 }
 
+static int pairs_next(lua_State *L)
+{
+    lua_settop(L, 2);
+    if (lua_next(L, 1)) return 2;
+    lua_pushnil(L);
+    return 1;
+}
+
+// Iterating over a match object's fields goes over a table with all of them
+static int Lmatch_pairs(lua_State *L)
+{
+    match_obj_t *obj = lua_touserdata(L, 1);
+    const match_node_t *nodes = obj->nodes;
+    lua_pushcfunction(L, pairs_next);
+    lua_createtable(L, 1, 3);
+    push_match_text(L, 1, obj);
+    lua_rawseti(L, -2, 0);
+    lua_Integer n = 1;
+    for (size_t i = 1; i < nodes[0].size; i += nodes[i].size) {
+        if (nodes[i].name) {
+            lua_pushlstring(L, nodes[i].name, nodes[i].namelen);
+            push_capture(L, 1, obj, i);
+            lua_rawset(L, -3);
+        } else {
+            push_capture(L, 1, obj, i);
+            lua_rawseti(L, -2, n++);
+        }
+    }
+    if (nodes[0].tag) {
+        lua_pushlstring(L, nodes[0].tag, nodes[0].taglen);
+        lua_setfield(L, -2, "__tag");
+    }
+    lua_pushinteger(L, 1 + (lua_Integer)nodes[0].start);
+    lua_setfield(L, -2, "start");
+    lua_pushinteger(L, 1 + (lua_Integer)nodes[0].end);
+    lua_setfield(L, -2, "after");
+    lua_pushnil(L);
+    return 3;
+}
+
 static int Lpat_source(lua_State *L)
 {
     lua_getiuservalue(L, 1, 1);
@@ -288,11 +892,9 @@ static int Lpat_tostring(lua_State *L)
 
 static int Lpat_gc(lua_State *L)
 {
-    (void)L;
-    bp_pat_t **at_pat = lua_touserdata(L, 1);
-    bp_pat_t *pat = *at_pat;
-    if (pat) delete_pat(at_pat, true);
-    (void)pat;
+    compiled_pat_t *compiled = lua_touserdata(L, 1);
+    compiled->pat = NULL;
+    if (compiled->arena) free_pat_arena(&compiled->arena);
     return 0;
 }
 
@@ -341,6 +943,9 @@ static int Lpat_div(lua_State *L)
 }
 
 static const luaL_Reg match_metamethods[] = {
+    {"__index", Lmatch_index},
+    {"__len", Lmatch_len},
+    {"__pairs", Lmatch_pairs},
     {"__tostring", Lmatch_tostring},
     {NULL, NULL}
 };
@@ -349,6 +954,9 @@ static const luaL_Reg pat_methods[] = {
     {"match", Lmatch},
     {"replace", Lreplace},
     {"matches", Lmatches},
+    {"spans", Lspans},
+    {"count", Lcount},
+    {"document", Ldocument},
     {"getsource", Lpat_source},
     {NULL, NULL}
 };
@@ -362,11 +970,27 @@ static const luaL_Reg pat_metamethods[] = {
     {NULL, NULL}
 };
 
+static const luaL_Reg doc_methods[] = {
+    {"matches", Ldoc_matches},
+    {"edit", Ldoc_edit},
+    {"gettext", Ldoc_gettext},
+    {NULL, NULL}
+};
+
+static const luaL_Reg doc_metamethods[] = {
+    {"__gc", Ldoc_gc},
+    {"__index", NULL}, // placeholder for doc_methods
+    {NULL, NULL}
+};
+
 static const luaL_Reg bp_methods[] = {
     {"match", Lmatch},
     {"replace", Lreplace},
     {"compile", Lcompile},
     {"matches", Lmatches},
+    {"spans", Lspans},
+    {"count", Lcount},
+    {"document", Ldocument},
     {NULL, NULL}
 };
 
@@ -389,6 +1013,12 @@ public LUALIB_API int luaopen_bp(lua_State *L)
     luaL_newlib(L, match_metamethods);
     lua_settable(L, LUA_REGISTRYINDEX);
 
+    lua_pushlightuserdata(L, (void*)&DOC_METATABLE);
+    luaL_newlib(L, doc_metamethods);
+    luaL_newlib(L, doc_methods);
+    lua_setfield(L, -2, "__index");
+    lua_settable(L, LUA_REGISTRYINDEX);
+
     luaL_newlib(L, bp_methods);
     return 1;
 }
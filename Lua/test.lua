@@ -1,7 +1,7 @@
 local bp = require 'bp'
 
 local function repr(obj)
-    if type(obj) == 'table' then
+    if type(obj) == 'table' or (type(obj) == 'userdata' and obj.start) then
         local ret = {}
         for k,v in pairs(obj) do table.insert(ret, ("%s=%s"):format(k, repr(v))) end
         return ("{%s}"):format(table.concat(ret,","))
@@ -56,6 +56,33 @@ for m in pat:matches("hello world") do
 end
 
 
+print("Testing spans and counts")
+for start, after in bp.spans("+`a-z", "one two  three") do print(start, after) end
+assert(bp.count("+`a-z", "one two  three") == 3)
+assert(bp.compile("`e"):count("one two three", 5) == 2)
+local m = bp.match("@a=+`a-z _ @+`0-9", "...xyz 42...")
+assert(m.a == m.a and tostring(m.a) == "xyz" and m.a.start == 4 and tostring(m[1]) == "42" and #m == 1)
+
+
+print("Testing documents")
+local doc = bp.document("+`a-z", "one two\nthree")
+for m in doc:matches() do print(m) end
+local first, after = doc:edit(5, 3, "2 zwei")
+print(doc:gettext(), first, after)
+local words = {}
+for m in doc:matches() do words[#words+1] = tostring(m) end
+assert(#words == 3 and words[3] == "three" and first == 1 and after == 12)
+
+-- A literal with a newline in it can match across the edited line's start:
+local multiline = bp.document('"b\nc"', "ab\nxc")
+local spans = {}
+for m in multiline:matches() do spans[#spans+1] = tostring(m) end
+assert(#spans == 0)
+local from = multiline:edit(4, 1, "")
+for m in multiline:matches() do spans[#spans+1] = tostring(m) end
+assert(#spans == 1 and spans[1] == "b\nc" and from == 1)
+
+
 local ok, err = pcall(function()
     bp.match("nonexistent", "xxx")
 end)
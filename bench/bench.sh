@@ -0,0 +1,43 @@
+#!/bin/sh
+# Run bp's benchmark suite and print one line of JSON per workload.
+# Example: make bench
+#   BENCH_SIZE=<bytes>  size of each generated corpus (default: 16MiB)
+#   BENCH_RUNS=<n>      number of timed runs per workload (default: 3)
+set -e
+cd "$(dirname "$0")/.."
+BP="$(pwd)/bp"
+SIZE="${BENCH_SIZE:-16777216}"
+RUNS="${BENCH_RUNS:-3}"
+CORPUS=bench/corpus
+
+mkdir -p "$CORPUS"
+for kind in code log; do
+    if [ ! -f "$CORPUS/$kind-$SIZE.txt" ]; then
+        bench/gencorpus "$kind" "$SIZE" > "$CORPUS/$kind-$SIZE.txt"
+    fi
+done
+
+# Use this tree's grammars rather than any installed ones
+HOME="$(mktemp -d)"
+trap 'rm -rf "$HOME"' EXIT
+mkdir -p "$HOME/.config"
+ln -s "$(pwd)/grammars" "$HOME/.config/bp"
+export HOME
+
+COMMIT="$(git rev-parse --short HEAD 2>/dev/null || echo unknown)"
+
+bench() {
+    name="$1"; kind="$2"; shift 2
+    file="$CORPUS/$kind-$SIZE.txt"
+    bytes="$(wc -c < "$file" | tr -d ' ')"
+    matches="$("$BP" --count "$@" "$file" || true)"
+    bench/measure -r "$RUNS" -a bench/count_allocs.so "$name" "$bytes" "${matches:-0}" "$BP" "$@" "$file" \
+        | sed "s/^{/{\"commit\": \"$COMMIT\", /"
+}
+
+bench literal        code '{"return"}'
+bench literal-icase  log  -i '{"error"}'
+bench char-class     code '{+`0-9}'
+bench grammar-rule   code -g c '{function-def}'
+bench left-recursion log  '{sum: sum "+" int / int; "total=" sum}'
+bench replace        log  '{int}' -r '[@0]'
@@ -0,0 +1,51 @@
+//
+// count_allocs.c - A library to preload (with LD_PRELOAD) to count how many
+// heap allocations a program makes. When the program exits, the count is
+// written to the file named by $ALLOC_COUNT_FILE.
+//
+// This relies on glibc's __libc_malloc() and friends to do the allocating.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+// The wrappers must be visible to override the C library's versions
+#define exported __attribute__((visibility("default")))
+
+static size_t allocations = 0;
+
+exported void *malloc(size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+exported void *calloc(size_t n, size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+exported void *realloc(void *p, size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(p, size);
+}
+
+__attribute__((destructor))
+static void report_allocations(void)
+{
+    const char *path = getenv("ALLOC_COUNT_FILE");
+    if (!path) return;
+    size_t count = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+    FILE *f = fopen(path, "w");
+    if (!f) return;
+    fprintf(f, "%zu\n", count);
+    fclose(f);
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -0,0 +1,108 @@
+//
+// gencorpus.c - Generate the text that the benchmarks search.
+//
+// The text is generated from a fixed seed with its own random number
+// generator, so the same size of corpus is identical on every machine and
+// from one version of bp to the next.
+//
+// Usage: gencorpus code|log <size in bytes>
+//
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+// xorshift64*, so the output doesn't depend on the C library's rand()
+static uint64_t next_random(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+#define PICK(arr) (arr[next_random() % (sizeof(arr)/sizeof(arr[0]))])
+
+static const char *types[] = {"int", "char *", "size_t", "bool", "double", "const char *", "uint32_t", "file_t *"};
+static const char *words[] = {
+    "count", "buffer", "index", "result", "node", "parent", "value", "length", "start", "end",
+    "offset", "cursor", "total", "entry", "table", "state", "flags", "error", "name", "item",
+};
+static const char *ops[] = {"+", "-", "*", "/", "<<", "&", "|", "%"};
+static const char *levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR", "error", "Error"};
+static const char *paths[] = {"/api/v1/users", "/api/v1/orders", "/static/app.js", "/login", "/api/v2/search", "/health"};
+
+static size_t gen_name(FILE *out)
+{
+    return (size_t)fprintf(out, "%s_%s", PICK(words), PICK(words));
+}
+
+static size_t gen_function(FILE *out)
+{
+    size_t n = 0;
+    n += (size_t)fprintf(out, "static %s ", PICK(types));
+    n += gen_name(out);
+    n += (size_t)fprintf(out, "(%s %s, %s %s)\n{\n", PICK(types), PICK(words), PICK(types), PICK(words));
+    int nlines = 2 + (int)(next_random() % 8);
+    for (int i = 0; i < nlines; i++) {
+        switch (next_random() % 5) {
+        case 0:
+            n += (size_t)fprintf(out, "    if (%s > %u) return %s[%s];\n", PICK(words), (unsigned)(next_random() % 1000), PICK(words), PICK(words));
+            break;
+        case 1:
+            n += (size_t)fprintf(out, "    // TODO: handle the %s when the %s is empty\n", PICK(words), PICK(words));
+            break;
+        case 2:
+            n += (size_t)fprintf(out, "    %s %s = ", PICK(types), PICK(words));
+            n += gen_name(out);
+            n += (size_t)fprintf(out, "(%s, %u);\n", PICK(words), (unsigned)(next_random() % 100));
+            break;
+        case 3:
+            n += (size_t)fprintf(out, "    for (int i = 0; i < %s; i++) %s += (%s %s %u);\n", PICK(words), PICK(words), PICK(words), PICK(ops),
+                    (unsigned)(next_random() % 64));
+            break;
+        default:
+            n += (size_t)fprintf(out, "    /* The %s and %s (\"%s\") are updated together */\n", PICK(words), PICK(words), PICK(words));
+            break;
+        }
+    }
+    n += (size_t)fprintf(out, "    return %s;\n}\n\n", PICK(words));
+    return n;
+}
+
+static size_t gen_log_line(FILE *out)
+{
+    size_t n = 0;
+    uint64_t r = next_random();
+    n += (size_t)fprintf(out, "2024-%02u-%02uT%02u:%02u:%02u [%s] ", (unsigned)(1 + r % 12), (unsigned)(1 + (r >> 8) % 28),
+            (unsigned)((r >> 16) % 24), (unsigned)((r >> 24) % 60), (unsigned)((r >> 32) % 60), PICK(levels));
+    if (next_random() % 4 == 0) {
+        // Arithmetic, which is used for the left recursion benchmark
+        n += (size_t)fprintf(out, "total=%u", (unsigned)(next_random() % 1000));
+        for (int terms = (int)(next_random() % 6); terms > 0; terms--)
+            n += (size_t)fprintf(out, "+%u", (unsigned)(next_random() % 1000));
+        n += (size_t)fprintf(out, "\n");
+    } else {
+        n += (size_t)fprintf(out, "request id=%u path=%s %s=%s took=%ums\n", (unsigned)(next_random() % 100000), PICK(paths),
+                PICK(words), PICK(words), (unsigned)(next_random() % 2000));
+    }
+    return n;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3 || !(strcmp(argv[1], "code") == 0 || strcmp(argv[1], "log") == 0))
+        errx(EXIT_FAILURE, "Usage: gencorpus code|log <size in bytes>");
+    size_t size = (size_t)strtoull(argv[2], NULL, 10);
+    bool code = strcmp(argv[1], "code") == 0;
+    for (size_t generated = 0; generated < size; )
+        generated += code ? gen_function(stdout) : gen_log_line(stdout);
+    return 0;
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -0,0 +1,108 @@
+//
+// measure.c - Time a command and report its throughput as a line of JSON.
+//
+// Usage: measure [-r runs] [-a alloc-counter.so] <name> <bytes> <matches> <command> [<args>...]
+//
+// The command is run several times with its output discarded, and the fastest
+// run is reported (along with the most memory used by any run). If an
+// allocation counting library is given, the command is run once more with it
+// preloaded to count heap allocations.
+//
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+//
+// Run a command with its output discarded and return how long it took,
+// filling in its resource usage.
+//
+static double run(char *argv[], struct rusage *usage)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t child = fork();
+    if (child < 0) err(EXIT_FAILURE, "Failed to fork");
+    if (child == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull < 0 || dup2(devnull, STDOUT_FILENO) < 0) _exit(EXIT_FAILURE);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    if (wait4(child, &status, 0, usage) != child) err(EXIT_FAILURE, "Failed to wait for %s", argv[0]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0 && WEXITSTATUS(status) != 1))
+        errx(EXIT_FAILURE, "Command failed: %s", argv[0]);
+    return (double)(end.tv_sec - start.tv_sec) + 1e-9*(double)(end.tv_nsec - start.tv_nsec);
+}
+
+//
+// Run a command with an allocation counting library preloaded and return the
+// number of allocations it made, or -1 if they couldn't be counted.
+//
+static long count_allocations(const char *counter, char *argv[])
+{
+    char path[] = "/tmp/bp-allocs.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) return -1;
+    close(fd);
+    setenv("LD_PRELOAD", counter, 1);
+    setenv("ALLOC_COUNT_FILE", path, 1);
+    struct rusage usage;
+    (void)run(argv, &usage);
+    unsetenv("LD_PRELOAD");
+    unsetenv("ALLOC_COUNT_FILE");
+
+    long count = -1;
+    FILE *f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%ld", &count) != 1) count = -1;
+        fclose(f);
+    }
+    unlink(path);
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    int runs = 3;
+    const char *counter = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "+r:a:")) != -1) {
+        if (opt == 'r') runs = atoi(optarg);
+        else if (opt == 'a') counter = optarg;
+        else return EXIT_FAILURE;
+    }
+    if (argc - optind < 4 || runs < 1)
+        errx(EXIT_FAILURE, "Usage: measure [-r runs] [-a alloc-counter.so] <name> <bytes> <matches> <command> [<args>...]");
+    const char *name = argv[optind];
+    double bytes = atof(argv[optind+1]), matches = atof(argv[optind+2]);
+    char **command = &argv[optind+3];
+
+    double best = -1;
+    long max_rss = 0;
+    for (int i = 0; i < runs; i++) {
+        struct rusage usage;
+        double seconds = run(command, &usage);
+        if (best < 0 || seconds < best) best = seconds;
+        if (usage.ru_maxrss > max_rss) max_rss = usage.ru_maxrss;
+    }
+    long allocs = (counter && access(counter, R_OK) == 0) ? count_allocations(counter, command) : -1;
+
+    printf("{\"name\": \"%s\", \"bytes\": %.0f, \"matches\": %.0f, \"seconds\": %.4f, "
+           "\"mb_per_s\": %.1f, \"matches_per_s\": %.0f, \"max_rss_kb\": %ld, \"allocs\": ",
+           name, bytes, matches, best, bytes / (1024*1024) / best, matches / best, max_rss);
+    if (allocs < 0) printf("null}\n");
+    else printf("%ld}\n", allocs);
+    return 0;
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
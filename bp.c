@@ -5,12 +5,14 @@
 //
 
 #include <ctype.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <glob.h>
 #include <limits.h>
+#include <poll.h>
 #include <printf.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -22,6 +24,8 @@
 #include <unistd.h>
 
 #include "files.h"
+#include "ignore.h"
+#include "json.h"
 #include "match.h"
 #include "pattern.h"
 #include "printmatch.h"
@@ -34,22 +38,33 @@
 static const char *description = BP_NAME" - a Parsing Expression Grammar command line tool";
 static const char *usage = (
     "Usage:\n"
-    "  "BP_NAME" [flags] <pattern> [<files>...]\n\n"
+    "  "BP_NAME" [flags] <pattern> [<files>...]\n"
+    "  "BP_NAME" [flags] --serve\n\n"
     "Flags:\n"
     " -A --context-after <n>           set number of lines of context to print after the match\n"
     " -B --context-before <n>          set number of lines of context to print before the match\n"
     " -C --context <context>           set number of lines of context to print before and after the match\n"
     " -G --git                         in a git repository, treat filenames as patterns for `git ls-files`\n"
     " -I --inplace                     modify a file in-place\n"
+    "    --no-ignore                   don't skip files listed in .gitignore or .ignore files when searching directories\n"
     " -c --case                        use case sensitivity\n"
     " -e --explain                     explain the matches\n"
     " -f --format fancy|plain|bare|file:line    set the output format\n"
     " -g --grammar <grammar-file>      use the specified file as a grammar\n"
     " -h --help                        print the usage and quit\n"
     " -i --ignore-case                 preform matching case-insensitively\n"
+    " -j --jobs <n>                    search files using <n> worker threads\n"
     " -l --list-files                  list filenames only\n"
+    "    --count                       print the number of matches in each file\n"
+    " -p --packrat                     cache all rule matches while searching a file (faster, but uses more memory)\n"
+    " -P --patterns-file <file>        search for each pattern defined in a file (name: pattern) at once, instead of <pattern>\n"
+    "    --profile                     print how much work each rule took to match when finished (implies -j1)\n"
+    "    --serve                       answer search requests (JSON lines) from stdin with results (JSON lines) on stdout\n"
     " -r --replace <replacement>       replace the input pattern with the given replacement\n"
     " -s --skip <skip-pattern>         skip over the given pattern when looking for matches\n"
+    " -S --stream                      print matches in piped in input as soon as they are found\n"
+    " -M --max-span <n>                with --stream, assume matches span fewer than <n> bytes (implies --stream)\n"
+    "    --max-steps <n>               give up (with exit status 2) if searching a file takes more than <n> matching steps\n"
     " -v --verbose                     print verbose debugging info\n"
     " -w --word <string-pat>           find words matching the given string pattern\n");
 
@@ -60,18 +75,67 @@ static const char *usage = (
 #define ALL_CONTEXT -2
 #define NO_CONTEXT -1
 
+// The maximum number of files that worker threads may get ahead of the output
+#define MAX_PENDING_JOBS 256
+
+// How many matches are found at a time when printing doesn't need match trees
+#define SPAN_BATCH_SIZE 256
+
+// With --jobs, files at least this big are searched by several threads at
+// once (when possible), each searching line-aligned pieces of about
+// PARALLEL_CHUNK_SIZE bytes
+#define PARALLEL_MIN_FILE_SIZE (4*1024*1024)
+#define PARALLEL_CHUNK_SIZE (1024*1024)
+// The maximum number of pieces that may be searched ahead of the output
+#define MAX_PENDING_CHUNKS 64
+
+// The size of the stdout buffer when it isn't a terminal, so large outputs
+// are written with fewer, bigger writes
+#define OUTPUT_BUFFER_SIZE (64*1024)
+
+// The amount of memory (per thread) that --packrat may use for its cache
+#define PACKRAT_MEMORY_LIMIT (256*1024*1024)
+
+// How much piped in input --stream reads at a time, and the default for how
+// many bytes a match (or lookbehind) may span
+#define STREAM_CHUNK_SIZE (64*1024)
+#define STREAM_MAX_SPAN (64*1024)
+
+// The exit status when a search runs out of --max-steps (as opposed to 1 for
+// no matches or other errors)
+#define EXIT_STEP_LIMIT 2
+
+// With --serve, how many compiled patterns and loaded files are kept between
+// requests (the least recently used ones are dropped first)
+#define SERVE_CACHED_PATTERNS 256
+#define SERVE_CACHED_FILES (16*1024)
+#define SERVE_CACHED_BYTES ((size_t)1024*1024*1024)
+
+// A pattern from a --patterns-file, which is searched for by name
+typedef struct {
+    const char *name;
+    size_t namelen;
+    bp_pat_t *pat;
+} named_pattern_t;
+
 // Flag-configurable options:
 static struct {
-    int context_before, context_after;
-    bool ignorecase, verbose, git_mode, print_filenames;
-    enum { MODE_NORMAL, MODE_LISTFILES, MODE_INPLACE, MODE_EXPLAIN } mode;
+    int context_before, context_after, jobs;
+    size_t max_span, max_steps;
+    bool ignorecase, verbose, git_mode, print_filenames, packrat, profile, stream, use_ignore_files, serve;
+    enum { MODE_NORMAL, MODE_LISTFILES, MODE_COUNT, MODE_INPLACE, MODE_EXPLAIN } mode;
     enum { FORMAT_AUTO, FORMAT_FANCY, FORMAT_PLAIN, FORMAT_BARE, FORMAT_FILE_LINE } format;
     bp_pat_t *skip;
+    named_pattern_t *patterns;
+    size_t npatterns;
 } options = {
     .context_before = USE_DEFAULT_CONTEXT,
     .context_after = USE_DEFAULT_CONTEXT,
+    .jobs = 1,
+    .max_span = STREAM_MAX_SPAN,
     .ignorecase = false,
     .print_filenames = true,
+    .use_ignore_files = true,
     .verbose = false,
     .mode = MODE_NORMAL,
     .format = FORMAT_AUTO,
@@ -85,9 +149,90 @@ const char *LINE_FORMATS[] = {
     [FORMAT_FILE_LINE] = "@:#0:",
 };
 
-// If a file is partly through being modified when the program exits, restore it from backup.
-static FILE *modifying_file = NULL;
-static file_t *backup_file;
+// The temporary file that in-place modifications are being written to, which
+// is removed if the program exits before it is renamed over the original file.
+static char *inplace_tmpfile = NULL;
+
+// A file to be searched by a worker thread, along with the output it produced
+typedef struct {
+    char *filename, *output;
+    size_t output_len;
+    int matches;
+    bool text_only, done;
+} job_t;
+
+// Pool of worker threads that search files in parallel. Output is buffered per
+// file and written by the main thread in the original order.
+static struct {
+    pthread_t *threads;
+    job_t *jobs;
+    size_t njobs, capacity, next_job, next_output;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t has_work, job_done;
+    bp_pat_t *pattern, *defs;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .has_work = PTHREAD_COND_INITIALIZER,
+    .job_done = PTHREAD_COND_INITIALIZER,
+};
+
+// A line-aligned piece of a file that's searched by its own thread, and the
+// matches that were found in it
+typedef struct {
+    const char *start, *stop;
+    bp_span_t *spans;
+    size_t nspans;
+    bool done;
+} chunk_t;
+
+// A search of a single file that's split between several threads
+typedef struct {
+    file_t *file;
+    bp_pat_t *pattern, *defs;
+    chunk_t *chunks;
+    size_t nchunks, next_chunk, next_output;
+    pthread_mutex_t lock;
+    pthread_cond_t has_work, chunk_done;
+} chunked_search_t;
+
+// A pattern compiled for a --serve request, which is reused by later requests
+// for the same pattern with the same grammars
+typedef struct {
+    char *text, *grammars;
+    size_t len;
+    bp_pat_t *pat, *defs;
+    bp_pat_arena_t *arena;
+    size_t last_used;
+} compiled_pattern_t;
+
+// The definitions for a set of grammars used by --serve requests (the
+// grammars' names, one per line)
+typedef struct {
+    char *grammars;
+    bp_pat_t *defs;
+} grammar_set_t;
+
+// The state kept between --serve requests, and the ID of the request being
+// answered (its JSON text), which is included in each of its results
+static struct {
+    file_cache_t *files;
+    compiled_pattern_t patterns[SERVE_CACHED_PATTERNS];
+    size_t npatterns, clock;
+    grammar_set_t *grammar_sets;
+    size_t ngrammar_sets;
+    const char *id;
+    size_t id_len;
+} serving;
+
+// Worker threads leave filename separators to the main thread, which knows
+// what has already been printed.
+static _Thread_local bool is_worker = false;
+static int printed_filenames = 0;
+// The --patterns-file pattern whose matches are being printed (if any), and
+// whether the current file's name has been printed for an earlier pattern
+static _Thread_local named_pattern_t *printing_pattern = NULL;
+static _Thread_local bool printed_filename = false;
 
 //
 // Helper function to reduce code duplication
@@ -187,21 +332,16 @@ static bool get_boolflag(char *argv[], const char *flag, char ***next)
 }
 
 //
-// Scan the first few dozen bytes of a file and return 1 if the contents all
-// look like printable text characters, otherwise return 0.
+// Scan the first few dozen bytes of a file's contents and return whether they
+// all look like printable text characters.
 //
-static int is_text_file(const char *filename)
+static bool is_text(const char *start, const char *end)
 {
-    int fd = open(filename, O_RDONLY);
-    if (fd < 0) return 0;
-    char buf[CHECK_FIRST_N_BYTES];
-    ssize_t len = read(fd, buf, sizeof(buf)/sizeof(char));
-    (void)close(fd);
-    if (len < 0) return 0;
-    for (ssize_t i = 0; i < len; i++)
-        if (isascii(buf[i]) && !(isprint(buf[i]) || isspace(buf[i])))
-            return 0;
-    return 1;
+    if (end - start > CHECK_FIRST_N_BYTES) end = start + CHECK_FIRST_N_BYTES;
+    for (const char *p = start; p < end; p++)
+        if (isascii(*p) && !(isprint(*p) || isspace(*p)))
+            return false;
+    return true;
 }
 
 //
@@ -227,16 +367,10 @@ static int explain_matches(file_t *f, bp_pat_t *pattern, bp_pat_t *defs)
 //
 static void cleanup(void)
 {
-    if (modifying_file && backup_file) {
-        rewind(modifying_file);
-        ftruncate(fileno(modifying_file), 0);
-        (void)fwrite(backup_file->start, 1,
-                     (size_t)(backup_file->end - backup_file->start),
-                     modifying_file);
-        fclose(modifying_file);
-        modifying_file = NULL;
+    if (inplace_tmpfile) {
+        (void)unlink(inplace_tmpfile);
+        inplace_tmpfile = NULL;
     }
-    if (backup_file) destroy_file(&backup_file);
 }
 
 //
@@ -248,21 +382,58 @@ static void sig_handler(int sig)
     if (kill(0, sig)) _exit(EXIT_FAILURE);
 }
 
+//
+// Return the width of the line number column for a file.
+//
+static int linenum_width(file_t *f)
+{
+    int width = 0;
+    for (size_t i = get_num_lines(f); i > 0; i /= 10) ++width;
+    return width;
+}
+
+//
+// Write a number right-aligned in a column of the given width. This is called
+// for every printed line, so it avoids the overhead of fprintf().
+//
+static int fprint_padded_number(FILE *out, size_t n, int width)
+{
+    char buf[32];
+    char *end = &buf[sizeof(buf)], *p = end;
+    do {
+        *(--p) = (char)('0' + n % 10);
+        n /= 10;
+    } while (n > 0);
+    while (end - p < width && p > buf) *(--p) = ' ';
+    return (int)fwrite(p, sizeof(char), (size_t)(end - p), out);
+}
+
 int fprint_linenum(FILE *out, file_t *f, int linenum, const char *normal_color)
 {
     int printed = 0;
     switch (options.format) {
-    case FORMAT_FANCY: case FORMAT_PLAIN: {
-        int space = 0;
-        for (int i = (int)f->nlines; i > 0; i /= 10) ++space;
-        if (options.format == FORMAT_FANCY)
-            printed += fprintf(out, "\033[0;2m%*d\033(0\x78\033(B%s", space, linenum, normal_color ? normal_color : "");
-        else
-            printed += fprintf(out, "%*d|", space, linenum);
+    case FORMAT_FANCY: {
+        static const char dim[] = "\033[0;2m", bar[] = "\033(0\x78\033(B";
+        printed += (int)fwrite(dim, sizeof(char), sizeof(dim)-1, out);
+        printed += fprint_padded_number(out, (size_t)linenum, linenum_width(f));
+        printed += (int)fwrite(bar, sizeof(char), sizeof(bar)-1, out);
+        if (normal_color) printed += (int)fwrite(normal_color, sizeof(char), strlen(normal_color), out);
+        break;
+    }
+    case FORMAT_PLAIN: {
+        printed += fprint_padded_number(out, (size_t)linenum, linenum_width(f));
+        printed += fputc('|', out);
         break;
     }
     case FORMAT_FILE_LINE: {
-        printed += fprintf(out, "%s:%d:", f->filename, linenum);
+        printed += (int)fwrite(f->filename, sizeof(char), strlen(f->filename), out);
+        printed += fputc(':', out);
+        printed += fprint_padded_number(out, (size_t)linenum, 0);
+        printed += fputc(':', out);
+        if (printing_pattern) {
+            printed += (int)fwrite(printing_pattern->name, sizeof(char), printing_pattern->namelen, out);
+            printed += fputc(':', out);
+        }
         break;
     }
     default: break;
@@ -270,15 +441,26 @@ int fprint_linenum(FILE *out, file_t *f, int linenum, const char *normal_color)
     return printed;
 }
 
-static file_t *printing_file = NULL;
-static int last_line_num = -1;
+static _Thread_local file_t *printing_file = NULL;
+static _Thread_local int last_line_num = -1;
 static int _fprint_between(FILE *out, const char *start, const char *end, const char *normal_color)
 {
+    if (options.format != FORMAT_FANCY && options.format != FORMAT_PLAIN && options.format != FORMAT_FILE_LINE) {
+        // Without line numbers, the whole span is copied at once, and the
+        // only thing to keep track of is whether the start of a line was
+        // printed:
+        if (last_line_num < 0 && (start == printing_file->start || start[-1] == '\n'
+                                  || (end - start > 1 && memchr(start, '\n', (size_t)(end - start - 1)))))
+            last_line_num = 0;
+        return end > start ? (int)fwrite(start, sizeof(char), (size_t)(end - start), out) : 0;
+    }
+
     int printed = 0;
+    int linenum = -1; // Only looked up once, then counted up line by line
     do {
         // Cheeky lookbehind to see if line number should be printed
         if (start == printing_file->start || start[-1] == '\n') {
-            int linenum = (int)get_line_number(printing_file, start);
+            if (linenum < 0) linenum = (int)get_line_number(printing_file, start);
             if (last_line_num != linenum) {
                 printed += fprint_linenum(out, printing_file, linenum, normal_color);
                 last_line_num = linenum;
@@ -288,6 +470,7 @@ static int _fprint_between(FILE *out, const char *start, const char *end, const
         if (line_end && line_end != end) {
             printed += fwrite(start, sizeof(char), (size_t)(line_end - start + 1), out);
             start = line_end + 1;
+            if (linenum >= 0) ++linenum;
         } else {
             if (end > start) printed += fwrite(start, sizeof(char), (size_t)(end - start), out);
             break;
@@ -296,26 +479,39 @@ static int _fprint_between(FILE *out, const char *start, const char *end, const
     return printed;
 }
 
+//
+// Return the start of the leading context that should be printed before a
+// match at `next`.
+//
+static const char *context_before(file_t *f, const char *next)
+{
+    if (options.context_before < 0) return next;
+    size_t line = get_line_number(f, next);
+    line = options.context_before >= (int)line ? 1 : line - (size_t)options.context_before;
+    return get_line(f, line);
+}
+
+//
+// Return the end of the trailing context that should be printed after a
+// match that ended at `prev`.
+//
+static const char *context_after(file_t *f, const char *prev)
+{
+    if (options.context_after < 0) return prev;
+    const char *after = get_line(f, get_line_number(f, prev) + (size_t)options.context_after + 1);
+    return after ? after : f->end;
+}
+
 static void fprint_context(FILE *out, file_t *f, const char *prev, const char *next)
 {
     if (options.context_before == ALL_CONTEXT || options.context_after == ALL_CONTEXT) {
         _fprint_between(out, prev ? prev : f->start, next ? next : f->end, "\033[m");
         return;
     }
-    const char *before_next = next;
-    if (next && options.context_before >= 0) {
-        size_t line_before_next = get_line_number(printing_file, next);
-        line_before_next = options.context_before >= (int)line_before_next ? 1 : line_before_next - (size_t)options.context_before;
-        before_next = get_line(printing_file, line_before_next);
-        if (prev && before_next < prev) before_next = prev;
-    }
-    const char *after_prev = prev;
-    if (prev && options.context_after >= 0) {
-        size_t line_after_prev = get_line_number(printing_file, prev) + (size_t)options.context_after + 1;
-        after_prev = line_after_prev > printing_file->nlines ?
-            printing_file->end : get_line(printing_file, line_after_prev > printing_file->nlines ? printing_file->nlines : line_after_prev);
-        if (next && after_prev > next) after_prev = next;
-    }
+    const char *before_next = next ? context_before(f, next) : NULL;
+    if (next && prev && before_next < prev) before_next = prev;
+    const char *after_prev = prev ? context_after(f, prev) : NULL;
+    if (prev && next && after_prev > next) after_prev = next;
     if (next && prev && after_prev >= before_next) {
         _fprint_between(out, prev, next, "\033[m");
     } else {
@@ -328,47 +524,272 @@ static void on_nl(FILE *out)
 {
     switch (options.format) {
     case FORMAT_FANCY: case FORMAT_PLAIN:
-        for (int i = (int)printing_file->nlines; i > 0; i /= 10) fputc('.', out);
-        fprintf(out, "%s", options.format == FORMAT_FANCY ? "\033[0;2m\033(0\x78\033(B\033[m" : "|");
+        static const char dots[] = "....................";
+        (void)fwrite(dots, sizeof(char), (size_t)linenum_width(printing_file), out);
+        fputs(options.format == FORMAT_FANCY ? "\033[0;2m\033(0\x78\033(B\033[m" : "|", out);
         break;
     default: break;
     }
 }
 
+//
+// Return the options for printing matches in the current output format.
+//
+static print_options_t get_print_options(void)
+{
+    print_options_t print_opts = {.fprint_between = _fprint_between, .on_nl = on_nl};
+    if (options.format == FORMAT_FANCY) {
+        print_opts.match_color = "\033[0;31;1m";
+        print_opts.replace_color = "\033[0;34;1m";
+        print_opts.normal_color = "\033[m";
+    }
+    return print_opts;
+}
+
+//
+// Print a match from a file (along with the filename and the name of the
+// --patterns-file pattern, if it's the first match, and the context since the
+// previous match).
+//
+__attribute__((nonnull(1,2,3,5)))
+static void print_match(FILE *out, file_t *f, bp_match_t *m, const char *prev, print_options_t *print_opts, bool first)
+{
+    if (first && options.print_filenames && !printed_filename) {
+        if (!is_worker && printed_filenames++ > 0) fputc('\n', out);
+        fprint_filename(out, f->filename);
+        printed_filename = printing_pattern != NULL;
+    }
+    // With the file:line format, each line is labeled with the pattern's name
+    // instead:
+    if (first && printing_pattern && options.format != FORMAT_FILE_LINE) {
+        if (options.format == FORMAT_FANCY)
+            fprintf(out, "\033[0;1;35m[%.*s]\033[m\n", (int)printing_pattern->namelen, printing_pattern->name);
+        else
+            fprintf(out, "[%.*s]\n", (int)printing_pattern->namelen, printing_pattern->name);
+    }
+    fprint_context(out, f, prev, m->start);
+    if (print_opts->normal_color) fputs(print_opts->normal_color, out);
+    fprint_match(out, f->start, m, print_opts);
+    if (print_opts->normal_color) fputs(print_opts->normal_color, out);
+}
+
+//
+// Exit with an error message when matching fails, using a distinct exit
+// status when the search ran out of steps.
+//
+static void exit_on_match_error(char **msg)
+{
+    bool out_of_steps = bp_matcher_error_code(bp_default_matcher()) == BP_STEP_LIMIT_ERROR;
+    errx(out_of_steps ? EXIT_STEP_LIMIT : EXIT_FAILURE, "%s", *msg);
+}
+
+//
+// Set up the current thread's default matcher with the options that apply to
+// every search and return it. Each thread has its own default matcher, so
+// this is done for each file.
+//
+static bp_matcher_t *get_matcher(void)
+{
+    bp_matcher_t *matcher = bp_default_matcher();
+    bp_matcher_set_packrat(matcher, options.packrat ? PACKRAT_MEMORY_LIMIT : 0);
+    bp_matcher_set_step_limit(matcher, options.max_steps);
+    // With --serve, errors are reported as results instead of exiting:
+    bp_matcher_set_error_handler(matcher, options.serve ? NULL : exit_on_match_error);
+    return matcher;
+}
+
+//
+// Return whether a file should be searched by several threads at once. This
+// only works when matches can't span multiple lines (or be affected by
+// skipping), because then each line-aligned piece of the file has the same
+// matches, no matter where the search of the piece before it left off. The
+// --max-steps budget is for a whole file, so it also rules this out.
+//
+static bool should_search_in_parallel(file_t *f, bp_pat_t *pattern, bp_pat_t *defs)
+{
+    return options.jobs > 1 && !is_worker && !options.skip && !options.max_steps && f->end - f->start >= PARALLEL_MIN_FILE_SIZE
+        && !can_match_newline(pattern, defs);
+}
+
+//
+// Helper thread: repeatedly take the next piece of the file and find all of
+// the matches that start in it.
+//
+static void *search_chunks(void *arg)
+{
+    chunked_search_t *s = arg;
+    bp_matcher_t *matcher = get_matcher();
+    bp_matcher_set_full_trees(matcher, false);
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (s->next_chunk < s->nchunks && s->next_chunk >= s->next_output + MAX_PENDING_CHUNKS)
+            pthread_cond_wait(&s->has_work, &s->lock);
+        if (s->next_chunk >= s->nchunks) break;
+        chunk_t *chunk = &s->chunks[s->next_chunk++];
+        pthread_mutex_unlock(&s->lock);
+
+        // The whole file is visible to the search, so lookarounds work
+        // normally, but only matches that start in this piece are found:
+        bp_span_search_t search = {
+            .start = s->file->start, .pos = chunk->start, .stop = chunk->stop, .end = s->file->end,
+            .pat = s->pattern, .defs = s->defs, .ignorecase = options.ignorecase,
+        };
+        bp_span_t *spans = NULL;
+        size_t nspans = 0, capacity = 0;
+        for (;;) {
+            if (nspans + SPAN_BATCH_SIZE > capacity)
+                spans = grow(spans, capacity = nspans + (capacity > SPAN_BATCH_SIZE ? capacity : SPAN_BATCH_SIZE));
+            size_t n = bp_next_spans(matcher, &search, &spans[nspans], SPAN_BATCH_SIZE);
+            if (n == 0) break;
+            nspans += n;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        chunk->spans = spans;
+        chunk->nspans = nspans;
+        chunk->done = true;
+        pthread_cond_broadcast(&s->chunk_done);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    // Each thread has its own match objects and patterns (e.g. backrefs):
+    free_all_matches();
+    free_all_pats();
+    return NULL;
+}
+
+//
+// Find all the matches in a file using --jobs threads, each searching
+// line-aligned pieces of the file, and pass the matches to `found` (in order)
+// as each piece is finished.
+//
+static void search_in_parallel(file_t *f, bp_pat_t *pattern, bp_pat_t *defs,
+                               void (*found)(bp_span_t *spans, size_t n, void *userdata), void *userdata)
+{
+    chunked_search_t s = {
+        .file = f, .pattern = pattern, .defs = defs,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .has_work = PTHREAD_COND_INITIALIZER,
+        .chunk_done = PTHREAD_COND_INITIALIZER,
+    };
+    size_t capacity = 0;
+    for (const char *p = f->start; p < f->end; ) {
+        const char *stop = f->end;
+        if (f->end - p > PARALLEL_CHUNK_SIZE) {
+            const char *nl = memchr(p + PARALLEL_CHUNK_SIZE, '\n', (size_t)(f->end - (p + PARALLEL_CHUNK_SIZE)));
+            if (nl) stop = nl + 1;
+        }
+        if (s.nchunks >= capacity)
+            s.chunks = grow(s.chunks, capacity = (capacity == 0 ? 64 : 2*capacity));
+        // The last piece is searched all the way to the end of the file:
+        s.chunks[s.nchunks++] = (chunk_t){.start = p, .stop = stop < f->end ? stop : NULL};
+        p = stop;
+    }
+
+    size_t nthreads = (size_t)options.jobs < s.nchunks ? (size_t)options.jobs : s.nchunks;
+    pthread_t *threads = new(pthread_t[nthreads]);
+    for (size_t i = 0; i < nthreads; i++)
+        if (pthread_create(&threads[i], NULL, search_chunks, &s) != 0)
+            errx(EXIT_FAILURE, "Failed to start worker thread");
+
+    pthread_mutex_lock(&s.lock);
+    while (s.next_output < s.nchunks) {
+        chunk_t *chunk = &s.chunks[s.next_output];
+        if (!chunk->done) {
+            pthread_cond_wait(&s.chunk_done, &s.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&s.lock);
+        if (chunk->nspans > 0) found(chunk->spans, chunk->nspans, userdata);
+        if (chunk->spans) delete(&chunk->spans);
+        pthread_mutex_lock(&s.lock);
+        ++s.next_output;
+        pthread_cond_broadcast(&s.has_work);
+    }
+    pthread_mutex_unlock(&s.lock);
+
+    for (size_t i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    delete(&threads);
+    delete(&s.chunks);
+    pthread_mutex_destroy(&s.lock);
+    pthread_cond_destroy(&s.has_work);
+    pthread_cond_destroy(&s.chunk_done);
+}
+
+static void count_spans(bp_span_t *spans, size_t n, void *userdata)
+{
+    (void)spans;
+    *(size_t*)userdata += n;
+}
+
+// The state for printing matches that are found in batches
+typedef struct {
+    FILE *out;
+    file_t *f;
+    bp_pat_t *pattern;
+    print_options_t *print_opts;
+    const char *prev;
+    int matches;
+} span_printer_t;
+
+//
+// Print a batch of matches (with their context).
+//
+static void print_spans(bp_span_t *spans, size_t n, void *userdata)
+{
+    span_printer_t *printer = userdata;
+    for (size_t i = 0; i < n; i++) {
+        bp_match_t m = {.start = spans[i].start, .end = spans[i].end, .pat = printer->pattern};
+        print_match(printer->out, printer->f, &m, printer->prev, printer->print_opts, ++printer->matches == 1);
+        printer->prev = m.end;
+    }
+}
+
 //
 // Print all the matches in a file.
 //
 static int print_matches(FILE *out, file_t *f, bp_pat_t *pattern, bp_pat_t *defs)
 {
-    static int printed_filenames = 0;
     int matches = 0;
     const char *prev = NULL;
 
     printing_file = f;
     last_line_num = -1;
 
-    print_options_t print_opts = {.fprint_between = _fprint_between, .on_nl = on_nl};
-    if (options.format == FORMAT_FANCY) {
-        print_opts.match_color = "\033[0;31;1m";
-        print_opts.replace_color = "\033[0;34;1m";
-        print_opts.normal_color = "\033[m";
-    }
-    for (bp_match_t *m = NULL; next_match(&m, f->start, f->end, pattern, defs, options.skip, options.ignorecase); ) {
-        if (++matches == 1 && options.print_filenames) {
-            if (printed_filenames++ > 0) printf("\n");
-            fprint_filename(out, f->filename);
+    print_options_t print_opts = get_print_options();
+    if (has_replacements(pattern, defs)) {
+        // Replacements are printed using the whole match tree:
+        for (bp_match_t *m = NULL; next_match(&m, f->start, f->end, pattern, defs, options.skip, options.ignorecase); ) {
+            print_match(out, f, m, prev, &print_opts, ++matches == 1);
+            prev = m->end;
+        }
+    } else {
+        // Otherwise, only where each match is matters, so matches are found
+        // in batches (possibly by several threads at once):
+        span_printer_t printer = {.out = out, .f = f, .pattern = pattern, .print_opts = &print_opts};
+        if (should_search_in_parallel(f, pattern, defs)) {
+            search_in_parallel(f, pattern, defs, print_spans, &printer);
+        } else {
+            bp_span_search_t search = {
+                .start = f->start, .pos = f->start, .end = f->end, .pat = pattern, .defs = defs,
+                .skip = options.skip, .ignorecase = options.ignorecase,
+            };
+            bp_span_t spans[SPAN_BATCH_SIZE];
+            for (size_t n; (n = bp_next_spans(bp_default_matcher(), &search, spans, SPAN_BATCH_SIZE)) > 0; ) {
+                print_spans(spans, n, &printer);
+                // Text before the last printed match won't be printed again:
+                release_file_text(f, printer.prev);
+            }
         }
-        fprint_context(out, f, prev, m->start);
-        if (print_opts.normal_color) fprintf(out, "%s", print_opts.normal_color);
-        fprint_match(out, f->start, m, &print_opts);
-        if (print_opts.normal_color) fprintf(out, "%s", print_opts.normal_color);
-        prev = m->end;
+        matches = printer.matches;
+        prev = printer.prev;
     }
     // Print trailing context if needed:
     if (matches > 0) {
         fprint_context(out, f, prev, NULL);
         if (last_line_num < 0) { // Hacky fix to ensure line number gets printed for `bp '{$$}'`
-            fprint_linenum(out, f, f->nlines, print_opts.normal_color);
+            fprint_linenum(out, f, (int)get_num_lines(f), print_opts.normal_color);
             fputc('\n', out);
         }
     }
@@ -378,93 +799,566 @@ static int print_matches(FILE *out, file_t *f, bp_pat_t *pattern, bp_pat_t *defs
     return matches;
 }
 
+//
+// Overwrite a file with its matches replaced, and return the number of
+// replacements made. The new contents are written to a temporary file in the
+// same directory, which is then renamed over the original, so the original is
+// never left partly written (and the original text stays mapped in memory
+// while the new contents are written).
+//
+__attribute__((nonnull))
+static int replace_inplace(file_t *f, bp_pat_t *pattern, bp_pat_t *defs)
+{
+    // Symbolic links are followed so the link itself isn't replaced:
+    char *path = realpath(f->filename, NULL);
+    struct stat st;
+    if (!path || stat(path, &st) != 0) {
+        fprintf(stderr, "Could not modify file: %s\n%s\n", f->filename, strerror(errno));
+        if (path) delete(&path);
+        return 0;
+    }
+
+    char *tmp_path = NULL;
+    require(asprintf(&tmp_path, "%s.bp-XXXXXX", path), "Could not allocate memory");
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        fprintf(stderr, "Could not create temporary file for: %s\n%s\n", f->filename, strerror(errno));
+        delete(&tmp_path);
+        delete(&path);
+        return 0;
+    }
+    inplace_tmpfile = tmp_path;
+    (void)fchmod(fd, st.st_mode & 07777);
+    (void)fchown(fd, st.st_uid, st.st_gid);
+
+    FILE *tmp_file = require(fdopen(fd, "w"), "Could not open temporary file");
+    int matches = print_matches(tmp_file, f, pattern, defs);
+    bool written = !ferror(tmp_file);
+    if (fclose(tmp_file) != 0) written = false;
+    if (!written || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Could not modify file: %s\n%s\n", f->filename, strerror(errno));
+        (void)unlink(tmp_path);
+        matches = 0;
+    }
+    inplace_tmpfile = NULL;
+    delete(&tmp_path);
+    delete(&path);
+    return matches;
+}
+
+//
+// Search a file for each of the --patterns-file patterns, printing (or
+// counting) each pattern's matches separately. `any_pattern` matches where
+// any of the patterns matches, and lets most files (which have no matches at
+// all) be ruled out with a single search that uses one literal prefilter for
+// all of the patterns.
+//
+__attribute__((nonnull))
+static int search_patterns(FILE *out, file_t *f, bp_pat_t *any_pattern, bp_pat_t *defs)
+{
+    bp_matcher_t *matcher = bp_default_matcher();
+    if (!bp_search_exists(matcher, f->start, f->end, any_pattern, defs, options.skip, options.ignorecase))
+        return 0;
+
+    int matches = 0;
+    printed_filename = false;
+    for (size_t i = 0; i < options.npatterns; i++) {
+        named_pattern_t *named = &options.patterns[i];
+        if (options.mode == MODE_COUNT) {
+            size_t count = bp_count_matches(matcher, f->start, f->end, named->pat, defs, options.skip, options.ignorecase);
+            if (count == 0) continue;
+            if (options.print_filenames)
+                fprintf(out, "%s:%.*s:%zu\n", f->filename, (int)named->namelen, named->name, count);
+            else
+                fprintf(out, "%.*s:%zu\n", (int)named->namelen, named->name, count);
+            matches += count > INT_MAX ? INT_MAX : (int)count;
+        } else {
+            printing_pattern = named;
+            matches += print_matches(out, f, named->pat, defs);
+            printing_pattern = NULL;
+        }
+    }
+    printed_filename = false;
+    return matches;
+}
+
+//
+// Start a --serve result line with the request's ID (and the filename, if
+// there is one). The rest of the result's fields each start with a comma.
+//
+static void fprint_result_start(FILE *out, const char *filename)
+{
+    fputs("{\"id\":", out);
+    if (serving.id) fwrite(serving.id, sizeof(char), serving.id_len, out);
+    else fputs("null", out);
+    if (filename) {
+        fputs(",\"file\":", out);
+        fprint_json_string(out, filename, strlen(filename));
+    }
+}
+
+//
+// Print a --serve result for an error (with the filename it happened in, if
+// any).
+//
+static void fprint_result_error(FILE *out, const char *filename, const char *msg)
+{
+    fprint_result_start(out, filename);
+    fputs(",\"error\":", out);
+    fprint_json_string(out, msg, strlen(msg));
+    fputs("}\n", out);
+}
+
+//
+// Print the results of searching a file for a --serve request: a line for each
+// match (with where it is and its text), or a line with the file's number of
+// matches for "count" requests, or the filename for "files" requests.
+//
+__attribute__((nonnull(1,2,3)))
+static int serve_file(FILE *out, file_t *f, bp_pat_t *pattern, bp_pat_t *defs)
+{
+    bp_matcher_t *matcher = bp_default_matcher();
+    int matches = 0;
+    if (options.mode == MODE_LISTFILES) {
+        if (bp_search_exists(matcher, f->start, f->end, pattern, defs, options.skip, options.ignorecase)) {
+            fprint_result_start(out, f->filename);
+            fputs("}\n", out);
+            matches = 1;
+        }
+    } else if (options.mode == MODE_COUNT) {
+        size_t count = bp_count_matches(matcher, f->start, f->end, pattern, defs, options.skip, options.ignorecase);
+        if (count > 0) {
+            fprint_result_start(out, f->filename);
+            fprintf(out, ",\"count\":%zu}\n", count);
+        }
+        matches = count > INT_MAX ? INT_MAX : (int)count;
+    } else {
+        bp_span_search_t search = {
+            .start = f->start, .pos = f->start, .end = f->end, .pat = pattern, .defs = defs,
+            .skip = options.skip, .ignorecase = options.ignorecase,
+        };
+        bp_span_t spans[SPAN_BATCH_SIZE];
+        for (size_t n; (n = bp_next_spans(matcher, &search, spans, SPAN_BATCH_SIZE)) > 0; ) {
+            for (size_t i = 0; i < n; i++) {
+                fprint_result_start(out, f->filename);
+                fprintf(out, ",\"line\":%zu,\"column\":%zu,\"start\":%zu,\"end\":%zu,\"text\":",
+                        get_line_number(f, spans[i].start), get_line_column(f, spans[i].start),
+                        (size_t)(spans[i].start - f->start), (size_t)(spans[i].end - f->start));
+                fprint_json_string(out, spans[i].start, (size_t)(spans[i].end - spans[i].start));
+                fputs("}\n", out);
+            }
+            matches += (int)n;
+        }
+    }
+    if (bp_matcher_error_code(matcher) != BP_NO_ERROR)
+        fprint_result_error(out, f->filename, bp_matcher_error(matcher) ? bp_matcher_error(matcher) : "Matching failed");
+    return matches;
+}
+
+//
+// Free a file that was searched, or give it back to the --serve file cache.
+//
+static void done_with_file(file_t **f, const char *filename)
+{
+    if (serving.files) return_file(serving.files, filename, f);
+    else destroy_file(f);
+}
+
 //
 // For a given filename, open the file and attempt to match the given pattern
-// against it, printing any results according to the flags.
+// against it, printing any results according to the flags. If `text_only` is
+// true, files that can't be read or don't look like text are quietly skipped.
 //
 __attribute__((nonnull))
-static int process_file(const char *filename, bp_pat_t *pattern, bp_pat_t *defs)
+static int process_file(FILE *out, const char *filename, bp_pat_t *pattern, bp_pat_t *defs, bool text_only)
 {
-    file_t *f = load_file(NULL, filename);
+    file_t *f = serving.files ? checkout_file(serving.files, filename) : load_file(NULL, filename);
     if (f == NULL) {
-        fprintf(stderr, "Could not open file: %s\n%s\n", filename, strerror(errno));
+        if (text_only) return 0;
+        if (options.serve) fprint_result_error(out, filename, strerror(errno));
+        else fprintf(stderr, "Could not open file: %s\n%s\n", filename, strerror(errno));
+        return 0;
+    }
+    // The text check uses the loaded file, so the file only gets opened once:
+    if (text_only && !is_text(f->start, f->end)) {
+        done_with_file(&f, filename);
         return 0;
     }
 
+    bp_matcher_t *matcher = get_matcher();
+    // Only explanations need every step of each match:
+    bp_matcher_set_full_trees(matcher, options.mode == MODE_EXPLAIN);
+    bp_packrat_stats_t prev_stats = bp_matcher_packrat_stats(matcher);
+
     int matches = 0;
-    if (options.mode == MODE_EXPLAIN) {
+    if (options.serve) {
+        matches += serve_file(out, f, pattern, defs);
+    } else if (options.mode == MODE_EXPLAIN) {
         matches += explain_matches(f, pattern, defs);
+    } else if (options.patterns && options.mode != MODE_LISTFILES) {
+        matches += search_patterns(out, f, pattern, defs);
     } else if (options.mode == MODE_LISTFILES) {
-        bp_match_t *m = NULL;
-        if (next_match(&m, f->start, f->end, pattern, defs, options.skip, options.ignorecase)) {
-            printf("%s\n", f->filename);
+        if (bp_search_exists(matcher, f->start, f->end, pattern, defs, options.skip, options.ignorecase)) {
+            fprintf(out, "%s\n", f->filename);
             matches += 1;
         }
-        stop_matching(&m);
+    } else if (options.mode == MODE_COUNT) {
+        size_t count = 0;
+        if (should_search_in_parallel(f, pattern, defs))
+            search_in_parallel(f, pattern, defs, count_spans, &count);
+        else
+            count = bp_count_matches(matcher, f->start, f->end, pattern, defs, options.skip, options.ignorecase);
+        if (!options.print_filenames)
+            fprintf(out, "%zu\n", count);
+        else if (count > 0)
+            fprintf(out, "%s:%zu\n", f->filename, count);
+        matches += count > INT_MAX ? INT_MAX : (int)count;
     } else if (options.mode == MODE_INPLACE) {
-        bp_match_t *m = NULL;
-        bool found = next_match(&m, f->start, f->end, pattern, defs, options.skip, options.ignorecase);
-        stop_matching(&m);
-        if (!found) return 0;
-
-        // Ensure the file is resident in memory:
-        if (f->mmapped) {
-            file_t *copy = spoof_file(NULL, f->filename, f->start, (ssize_t)(f->end - f->start));
-            destroy_file(&f);
-            f = copy;
-        }
-        FILE *out = fopen(filename, "w");
-        // Set these temporary values in case the program crashes while in the
-        // middle of inplace modifying a file. If that happens, these variables
-        // are used to restore the original file contents.
-        modifying_file = out; backup_file = f;
-        {
-            matches += print_matches(out, f, pattern, defs);
+        if (!bp_search_exists(matcher, f->start, f->end, pattern, defs, options.skip, options.ignorecase)) {
+            done_with_file(&f, filename);
+            return 0;
         }
-        modifying_file = NULL; backup_file = NULL;
-        fclose(out);
+
+        matches += replace_inplace(f, pattern, defs);
         if (matches > 0)
-            printf(getenv("NO_COLOR") ? "%s: %d replacement%s\n" : "\x1b[33;1m%s:\x1b[m %d replacement%s\n",
-                   filename, matches, matches == 1 ? "" : "s");
+            fprintf(out, getenv("NO_COLOR") ? "%s: %d replacement%s\n" : "\x1b[33;1m%s:\x1b[m %d replacement%s\n",
+                    filename, matches, matches == 1 ? "" : "s");
     } else {
-        matches += print_matches(stdout, f, pattern, defs);
+        matches += print_matches(out, f, pattern, defs);
+    }
+    fflush(out);
+
+    if (options.verbose && options.packrat) {
+        bp_packrat_stats_t stats = bp_matcher_packrat_stats(matcher);
+        fprintf(stderr, "%s: packrat cache: %zu hits, %zu misses, %zu evictions\n", filename[0] ? filename : "<stdin>",
+                stats.hits - prev_stats.hits, stats.misses - prev_stats.misses, stats.evictions - prev_stats.evictions);
     }
-    fflush(stdout);
 
     if (recycle_all_matches() != 0)
         fprintf(stderr, "\033[33;1mMemory leak: there should no longer be any matches in use at this point.\033[m\n");
-    destroy_file(&f);
+    done_with_file(&f, filename);
     (void)fflush(stdout);
     return matches;
 }
 
 //
-// Recursively process all non-dotfile files in the given directory.
+// Return whether there is input waiting to be read without blocking.
+//
+static bool input_ready(int fd)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    return poll(&pfd, 1, 0) > 0;
+}
+
+//
+// Search piped in input incrementally, printing each match as soon as it's
+// known to be final instead of waiting for the input to end. A match is final
+// once --max-span bytes have been read past its start (or the input ended),
+// and text that can no longer be part of any match or context is discarded.
+// Positions are tracked as offsets, since text moves when it's discarded.
+//
+static int process_stream(FILE *out, int fd, bp_pat_t *pattern, bp_pat_t *defs)
+{
+    file_t *f = spoof_file(NULL, "", "", 0);
+    bp_matcher_t *matcher = get_matcher();
+    bp_matcher_set_full_trees(matcher, false);
+
+    printing_file = f;
+    last_line_num = -1;
+    print_options_t print_opts = get_print_options();
+    bool all_context = options.context_before == ALL_CONTEXT || options.context_after == ALL_CONTEXT;
+
+    int matches = 0;
+    // `pos` is where to resume searching, `prev` is the end of the last
+    // match (or -1 once its trailing context has been printed), and `printed`
+    // is the end of the last trailing context printed.
+    size_t pos = 0, printed = 0;
+    ssize_t prev = -1;
+    for (bool eof = false; !eof; ) {
+        // Read until there's enough text to search or no more input is ready:
+        do {
+            if (read_stream(f, fd, STREAM_CHUNK_SIZE) <= 0) eof = true;
+        } while (!eof && (size_t)(f->end - f->start) - pos < 2*options.max_span && input_ready(fd));
+
+        // Only matches starting at or before `limit` are final:
+        const char *limit = eof ? f->end : ((size_t)(f->end - f->start) > options.max_span ? f->end - options.max_span : NULL);
+        if (limit && limit >= f->start + pos) {
+            bp_match_t *m = NULL;
+            bool found = bp_next_match_from(matcher, &m, f->start, f->start + pos, f->end, pattern, defs, options.skip, options.ignorecase);
+            for (; found && m->start <= limit; found = bp_next_match(matcher, &m, f->start, f->end, pattern, defs, options.skip, options.ignorecase)) {
+                ++matches;
+                if (prev >= 0) {
+                    fprint_context(out, f, f->start + prev, m->start);
+                } else {
+                    const char *before = all_context ? f->start : context_before(f, m->start);
+                    if (before < f->start + printed) before = f->start + printed;
+                    _fprint_between(out, before, m->start, "\033[m");
+                }
+                if (print_opts.normal_color) fputs(print_opts.normal_color, out);
+                fprint_match(out, f->start, m, &print_opts);
+                if (print_opts.normal_color) fputs(print_opts.normal_color, out);
+                prev = m->end - f->start;
+                pos = (size_t)(m->end - f->start) + (m->end == m->start);
+            }
+            bp_stop_matching(matcher, &m);
+            // Every position before `limit` that hasn't matched never will,
+            // so skip ahead to the start of the line containing `limit`:
+            const char *line_start = limit;
+            while (line_start > f->start + pos && line_start[-1] != '\n') --line_start;
+            if (line_start > f->start + pos) pos = (size_t)(line_start - f->start);
+        }
+        if (eof) break;
+
+        // Print trailing context once no later match can overlap with it:
+        if (all_context) {
+            const char *from = f->start + (prev >= 0 ? (size_t)prev : printed);
+            if (matches > 0 && f->start + pos > from) {
+                _fprint_between(out, from, f->start + pos, "\033[m");
+                printed = pos;
+                prev = -1;
+            }
+        } else if (prev >= 0) {
+            const char *after = context_after(f, f->start + prev);
+            if (after < f->end && after <= f->start + pos) {
+                _fprint_between(out, f->start + prev, after, "\033[m");
+                printed = (size_t)(after - f->start);
+                prev = -1;
+            }
+        }
+        fflush(out);
+
+        // Discard text that is no longer needed for lookbehind or context:
+        const char *keep = f->start + (pos > options.max_span ? pos - options.max_span : 0);
+        if (prev >= 0 && f->start + prev < keep) keep = f->start + prev;
+        const char *before = all_context ? f->start + printed : context_before(f, f->start + pos);
+        if (before < f->start + printed) before = f->start + printed;
+        if (before < keep) keep = before;
+        while (keep > f->start && keep[-1] != '\n') --keep;
+        // Only discard once it's worth the cost of moving the remaining text:
+        if (keep - f->start >= f->end - keep && keep - f->start >= STREAM_CHUNK_SIZE) {
+            size_t discarded = (size_t)(keep - f->start);
+            discard_stream_text(f, keep);
+            pos -= discarded;
+            printed = printed > discarded ? printed - discarded : 0;
+            if (prev >= 0) prev -= (ssize_t)discarded;
+        }
+    }
+
+    // Print trailing context if needed:
+    if (all_context) {
+        const char *from = f->start + (prev >= 0 ? (size_t)prev : printed);
+        if (matches > 0) _fprint_between(out, from, f->end, "\033[m");
+    } else if (prev >= 0) {
+        fprint_context(out, f, f->start + prev, NULL);
+    }
+    if (matches > 0 && last_line_num < 0) { // Hacky fix to ensure line number gets printed for `bp '{$$}'`
+        fprint_linenum(out, f, (int)get_num_lines(f), print_opts.normal_color);
+        fputc('\n', out);
+    }
+    fflush(out);
+
+    printing_file = NULL;
+    last_line_num = -1;
+    if (recycle_all_matches() != 0)
+        fprintf(stderr, "\033[33;1mMemory leak: there should no longer be any matches in use at this point.\033[m\n");
+    destroy_file(&f);
+    return matches;
+}
+
+//
+// Worker thread: repeatedly take a file from the queue, search it, and store
+// the output so the main thread can print it in order.
+//
+static void *work_on_jobs(void *arg)
+{
+    (void)arg;
+    is_worker = true;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (!(pool.next_job < pool.njobs && pool.next_job < pool.next_output + MAX_PENDING_JOBS) && !pool.closed)
+            pthread_cond_wait(&pool.has_work, &pool.lock);
+        if (pool.next_job >= pool.njobs) break;
+        size_t j = pool.next_job++;
+        const char *filename = pool.jobs[j].filename;
+        bool text_only = pool.jobs[j].text_only;
+        pthread_mutex_unlock(&pool.lock);
+
+        char *output = NULL;
+        size_t output_len = 0;
+        FILE *out = require(open_memstream(&output, &output_len), "Failed to create output buffer");
+        int matches = process_file(out, filename, pool.pattern, pool.defs, text_only);
+        fclose(out);
+
+        pthread_mutex_lock(&pool.lock);
+        pool.jobs[j].output = output;
+        pool.jobs[j].output_len = output_len;
+        pool.jobs[j].matches = matches;
+        pool.jobs[j].done = true;
+        pthread_cond_broadcast(&pool.job_done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    // Each thread has its own match objects and patterns (e.g. backrefs):
+    free_all_matches();
+    free_all_pats();
+    return NULL;
+}
+
+//
+// Print the output of finished jobs (in order) and return the number of
+// matches found in them. If `wait` is true, wait for every job to finish.
+// This must be called with the job queue lock held.
+//
+static int print_finished_jobs(bool wait)
+{
+    int matches = 0;
+    while (pool.next_output < pool.njobs) {
+        job_t *job = &pool.jobs[pool.next_output];
+        if (!job->done) {
+            if (!wait) break;
+            pthread_cond_wait(&pool.job_done, &pool.lock);
+            continue;
+        }
+        if (job->matches > 0 && options.mode == MODE_NORMAL && options.print_filenames && printed_filenames++ > 0)
+            fputc('\n', stdout);
+        if (job->output_len > 0)
+            (void)fwrite(job->output, sizeof(char), job->output_len, stdout);
+        if (job->output) delete(&job->output);
+        delete(&job->filename);
+        matches += job->matches;
+        ++pool.next_output;
+        pthread_cond_broadcast(&pool.has_work);
+    }
+    fflush(stdout);
+    return matches;
+}
+
+//
+// Search a file, either immediately or by queueing it up for the worker
+// threads if running with multiple jobs. Return the number of matches that
+// have been printed.
 //
 __attribute__((nonnull))
-static int process_dir(const char *dirname, bp_pat_t *pattern, bp_pat_t *defs)
+static int queue_file(const char *filename, bp_pat_t *pattern, bp_pat_t *defs, bool text_only)
+{
+    if (options.jobs <= 1)
+        return process_file(stdout, filename, pattern, defs, text_only);
+
+    if (!pool.threads) {
+        pool.pattern = pattern;
+        pool.defs = defs;
+        pool.threads = new(pthread_t[options.jobs]);
+        for (int i = 0; i < options.jobs; i++)
+            if (pthread_create(&pool.threads[i], NULL, work_on_jobs, NULL) != 0)
+                errx(EXIT_FAILURE, "Failed to start worker thread");
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.njobs >= pool.capacity)
+        pool.jobs = grow(pool.jobs, pool.capacity = (pool.capacity == 0 ? 64 : 2*pool.capacity));
+    pool.jobs[pool.njobs++] = (job_t){.filename = checked_strdup(filename), .text_only = text_only};
+    pthread_cond_signal(&pool.has_work);
+    int matches = print_finished_jobs(false);
+    pthread_mutex_unlock(&pool.lock);
+    return matches;
+}
+
+//
+// Wait for all queued files to be searched and print their output, leaving
+// the worker threads running for more files. Return the number of matches
+// printed.
+//
+static int wait_for_jobs(void)
 {
+    if (!pool.threads) return 0;
+    pthread_mutex_lock(&pool.lock);
+    int matches = print_finished_jobs(true);
+    pool.njobs = pool.next_job = pool.next_output = 0;
+    pthread_mutex_unlock(&pool.lock);
+    return matches;
+}
+
+//
+// Wait for all queued files to be searched, print their output, and shut down
+// the worker threads. Return the number of matches printed.
+//
+static int finish_jobs(void)
+{
+    if (!pool.threads) return 0;
+    pthread_mutex_lock(&pool.lock);
+    pool.closed = true;
+    pthread_cond_broadcast(&pool.has_work);
+    int matches = print_finished_jobs(true);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < options.jobs; i++)
+        pthread_join(pool.threads[i], NULL);
+    delete(&pool.threads);
+    if (pool.jobs) delete(&pool.jobs);
+    return matches;
+}
+
+// A directory entry, and whether it's a directory or regular file
+typedef struct {
+    char *name;
+    bool is_dir;
+} dir_entry_t;
+
+static int compare_entries(const void *a, const void *b)
+{
+    return strcoll(((const dir_entry_t*)a)->name, ((const dir_entry_t*)b)->name);
+}
+
+//
+// Recursively process all non-dotfile files in the given directory, skipping
+// any files ignored by `.gitignore` or `.ignore` files. Symbolic links and
+// special files are also skipped.
+//
+__attribute__((nonnull(1,3)))
+static int process_dir(const char *dirname, ignore_rules_t *parent_rules, bp_pat_t *pattern, bp_pat_t *defs)
+{
+    DIR *dir = opendir(dirname);
+    if (!dir) return 0;
+
+    // The entries are read all at once, so the directory is closed before
+    // recursing. Most filesystems report the file type along with each entry,
+    // so the files don't need to be stat()ed.
+    dir_entry_t *entries = NULL;
+    size_t nentries = 0, capacity = 0;
+    for (struct dirent *entry; (entry = readdir(dir)) != NULL; ) {
+        if (entry->d_name[0] == '.') continue;
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat statbuf;
+            if (fstatat(dirfd(dir), entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0) continue;
+            if (!S_ISDIR(statbuf.st_mode) && !S_ISREG(statbuf.st_mode)) continue;
+            is_dir = S_ISDIR(statbuf.st_mode);
+        } else if (entry->d_type != DT_DIR && entry->d_type != DT_REG) {
+            continue;
+        }
+        if (nentries >= capacity)
+            entries = grow(entries, capacity = (capacity == 0 ? 64 : 2*capacity));
+        entries[nentries++] = (dir_entry_t){.name = checked_strdup(entry->d_name), .is_dir = is_dir};
+    }
+    (void)closedir(dir);
+    if (nentries > 0) qsort(entries, nentries, sizeof(dir_entry_t), compare_entries);
+
+    ignore_rules_t *rules = options.use_ignore_files ? load_ignore_rules(parent_rules, dirname) : NULL;
     int matches = 0;
-    glob_t globbuf;
-    char globpath[PATH_MAX+1] = {'\0'};
-    if (snprintf(globpath, PATH_MAX, "%s/*", dirname) > (int)PATH_MAX)
-        errx(EXIT_FAILURE, "Filename is too long: %s/*", dirname);
-    int status = glob(globpath, 0, NULL, &globbuf);
-    if (status == GLOB_ABORTED || status == GLOB_NOSPACE)
-        errx(EXIT_FAILURE, "Failed to get directory contents: %s", dirname);
-    if (status != GLOB_NOMATCH) {
-        struct stat statbuf;
-        for (size_t i = 0; i < globbuf.gl_pathc; i++) {
-            if (lstat(globbuf.gl_pathv[i], &statbuf) != 0) continue;
-            if (S_ISLNK(statbuf.st_mode))
-                continue; // Skip symbolic links
-            else if (S_ISDIR(statbuf.st_mode))
-                matches += process_dir(globbuf.gl_pathv[i], pattern, defs);
-            else if (is_text_file(globbuf.gl_pathv[i]))
-                matches += process_file(globbuf.gl_pathv[i], pattern, defs);
+    for (size_t i = 0; i < nentries; i++) {
+        char path[PATH_MAX+1] = {'\0'};
+        if (snprintf(path, PATH_MAX, "%s/%s", dirname, entries[i].name) > (int)PATH_MAX)
+            errx(EXIT_FAILURE, "Filename is too long: %s/%s", dirname, entries[i].name);
+        if (rules && is_ignored(rules, path, entries[i].name, entries[i].is_dir)) {
+            // Skip ignored files
+        } else if (entries[i].is_dir) {
+            matches += process_dir(path, rules, pattern, defs);
+        } else {
+            matches += queue_file(path, pattern, defs, true);
         }
+        delete(&entries[i].name);
     }
-    globfree(&globbuf);
+    if (rules && rules != parent_rules) destroy_ignore_rules(&rules);
+    if (entries) delete(&entries);
     return matches;
 }
 
@@ -495,7 +1389,7 @@ static int process_git_files(bp_pat_t *pattern, bp_pat_t *defs, int argc, char *
     size_t path_size = 0;
     int found = 0;
     while (getdelim(&path, &path_size, '\0', fp) > 0)
-        found += process_file(path, pattern, defs);
+        found += queue_file(path, pattern, defs, false);
     if (path) delete(&path);
     require(fclose(fp), "Failed to close read end of pipe");
     int status;
@@ -505,6 +1399,43 @@ static int process_git_files(bp_pat_t *pattern, bp_pat_t *defs, int argc, char *
     return found;
 }
 
+//
+// Compare rule profiles so the rules that took the most time come first.
+//
+static int compare_profiles(const void *va, const void *vb)
+{
+    const bp_rule_profile_t *a = va, *b = vb;
+    if (a->seconds != b->seconds) return a->seconds < b->seconds ? 1 : -1;
+    return a->calls < b->calls ? 1 : (a->calls > b->calls ? -1 : 0);
+}
+
+//
+// Print a table of how much work went into matching each rule. The time for
+// each rule includes the time spent on the rules it uses.
+//
+static void print_profile(FILE *out, bp_matcher_t *matcher)
+{
+    size_t nslots;
+    const bp_rule_profile_t *slots = bp_matcher_profile(matcher, &nslots);
+    bp_rule_profile_t *rules = new(bp_rule_profile_t[nslots + 1]);
+    size_t nrules = 0;
+    int name_width = (int)strlen("rule");
+    for (size_t i = 0; i < nslots; i++) {
+        if (!slots[i].name) continue;
+        rules[nrules++] = slots[i];
+        if ((int)slots[i].namelen > name_width) name_width = (int)slots[i].namelen;
+    }
+    qsort(rules, nrules, sizeof(rules[0]), compare_profiles);
+
+    fprintf(out, "%-*s %12s %12s %12s %14s %12s\n", name_width, "rule", "calls", "failures", "cache hits", "bytes", "time (ms)");
+    for (size_t i = 0; i < nrules; i++) {
+        bp_rule_profile_t *r = &rules[i];
+        fprintf(out, "%-*.*s %12zu %12zu %12zu %14zu %12.3f\n", name_width, (int)r->namelen, r->name,
+                r->calls, r->failures, r->cache_hits, r->bytes, 1000.0*r->seconds);
+    }
+    delete(&rules);
+}
+
 //
 // Load the given grammar (semicolon-separated definitions)
 // and return the first rule defined.
@@ -514,6 +1445,35 @@ static bp_pat_t *load_grammar(bp_pat_t *defs, file_t *f)
     return chain_together(defs, assert_pat(f->start, f->end, bp_pattern(f->start, f->end)));
 }
 
+//
+// Load a grammar file, either from a path ending in ".bp" or by its name (from
+// ~/.config/bp or /etc/bp). Return NULL if it can't be found.
+//
+static file_t *load_grammar_file(file_t **loaded_files, const char *name)
+{
+    file_t *f = NULL;
+    if (strlen(name) > 3 && strncmp(&name[strlen(name)-3], ".bp", 3) == 0)
+        f = load_file(loaded_files, name);
+    if (f == NULL)
+        f = load_filef(loaded_files, "%s/.config/"BP_NAME"/%s.bp", getenv("HOME"), name);
+    if (f == NULL)
+        f = load_filef(loaded_files, "/etc/"BP_NAME"/%s.bp", name);
+    return f;
+}
+
+//
+// Return a message describing why a pattern failed to compile (which should
+// be freed by the caller).
+//
+static char *pattern_error(maybe_pat_t maybe_pat)
+{
+    char *msg = NULL;
+    require(asprintf(&msg, "%s: %.*s", maybe_pat.value.error.msg,
+                     (int)(maybe_pat.value.error.end - maybe_pat.value.error.start), maybe_pat.value.error.start),
+            "Could not allocate memory");
+    return msg;
+}
+
 //
 // Convert a context string to an integer
 //
@@ -536,6 +1496,251 @@ static bool any_uppercase(const char *str)
     return false;
 }
 
+//
+// Return the definitions for a --serve request's grammars (a JSON array of
+// grammar names or files) on top of `defs`. Each set of grammars is only
+// loaded the first time it's used. If a grammar can't be loaded, NULL is
+// returned and `error` is set to a message (which should be freed).
+//
+__attribute__((nonnull(2,3,4)))
+static grammar_set_t *get_grammar_set(bp_pat_t *defs, json_t *grammars, file_t **loaded_files, char **error)
+{
+    char *key = NULL;
+    size_t key_len = 0;
+    FILE *key_out = require(open_memstream(&key, &key_len), "Failed to create grammar list");
+    for (size_t i = 0; i < grammars->nitems; i++)
+        fprintf(key_out, "%s\n", grammars->items[i].string);
+    fclose(key_out);
+    for (size_t i = 0; i < serving.ngrammar_sets; i++) {
+        if (streq(serving.grammar_sets[i].grammars, key)) {
+            delete(&key);
+            return &serving.grammar_sets[i];
+        }
+    }
+
+    // Every grammar is loaded before any of them are kept, so a bad grammar
+    // doesn't leave the others loaded:
+    file_t **files = new(file_t*[grammars->nitems + 1]);
+    maybe_pat_t *parsed = new(maybe_pat_t[grammars->nitems + 1]);
+    size_t nloaded = 0;
+    for (; nloaded < grammars->nitems; nloaded++) {
+        const char *name = grammars->items[nloaded].string;
+        files[nloaded] = load_grammar_file(NULL, name);
+        if (!files[nloaded]) {
+            require(asprintf(error, "Couldn't find grammar: %s", name), "Could not allocate memory");
+            break;
+        }
+        parsed[nloaded] = bp_pattern(files[nloaded]->start, files[nloaded]->end);
+        if (!parsed[nloaded].success) {
+            char *msg = pattern_error(parsed[nloaded]);
+            require(asprintf(error, "Invalid grammar %s: %s", name, msg), "Could not allocate memory");
+            delete(&msg);
+            destroy_file(&files[nloaded]);
+            break;
+        }
+    }
+    grammar_set_t *set = NULL;
+    if (*error) {
+        for (size_t i = 0; i < nloaded; i++) {
+            free_pat_arena(&parsed[i].arena);
+            destroy_file(&files[i]);
+        }
+        delete(&key);
+    } else {
+        for (size_t i = 0; i < nloaded; i++) {
+            files[i]->next = *loaded_files;
+            *loaded_files = files[i];
+            defs = chain_together(defs, parsed[i].value.pat);
+        }
+        serving.grammar_sets = grow(serving.grammar_sets, serving.ngrammar_sets + 1);
+        set = &serving.grammar_sets[serving.ngrammar_sets++];
+        *set = (grammar_set_t){.grammars = key, .defs = defs};
+    }
+    delete(&files);
+    delete(&parsed);
+    return set;
+}
+
+//
+// Return the compiled pattern for a --serve request, compiling it if it isn't
+// cached (and dropping the least recently used pattern if the cache is full).
+// If the pattern doesn't compile, NULL is returned and `error` is set to a
+// message (which should be freed).
+//
+__attribute__((nonnull(1,3,5)))
+static compiled_pattern_t *get_compiled_pattern(const char *text, size_t len, const char *grammars, bp_pat_t *defs, char **error)
+{
+    ++serving.clock;
+    compiled_pattern_t *slot = NULL;
+    for (size_t i = 0; i < serving.npatterns; i++) {
+        compiled_pattern_t *c = &serving.patterns[i];
+        if (c->len == len && memcmp(c->text, text, len) == 0 && streq(c->grammars, grammars)) {
+            c->last_used = serving.clock;
+            return c;
+        }
+        if (!slot || c->last_used < slot->last_used) slot = c;
+    }
+
+    // The pattern keeps pointing into its source text, so it gets its own copy:
+    char *copy = new(char[len + 1]);
+    memcpy(copy, text, len);
+    maybe_pat_t maybe_pat = bp_stringpattern(copy, &copy[len]);
+    if (!maybe_pat.success) {
+        *error = pattern_error(maybe_pat);
+        delete(&copy);
+        return NULL;
+    }
+
+    if (serving.npatterns < SERVE_CACHED_PATTERNS) {
+        slot = &serving.patterns[serving.npatterns++];
+    } else {
+        free_pat_arena(&slot->arena);
+        delete(&slot->text);
+        delete(&slot->grammars);
+    }
+    *slot = (compiled_pattern_t){
+        .text = copy, .len = len, .grammars = checked_strdup(grammars),
+        .pat = maybe_pat.value.pat, .defs = defs, .arena = maybe_pat.arena, .last_used = serving.clock,
+    };
+    return slot;
+}
+
+//
+// Return whether a JSON value is missing or is an array of strings.
+//
+static bool is_string_list(json_t *json)
+{
+    if (!json) return true;
+    if (json->type != JSON_ARRAY) return false;
+    for (size_t i = 0; i < json->nitems; i++)
+        if (json->items[i].type != JSON_STRING) return false;
+    return true;
+}
+
+//
+// Return whether a JSON value is a whole number that's at least 1.
+//
+static bool is_positive_integer(json_t *json)
+{
+    if (json->type != JSON_NUMBER) return false;
+    for (const char *p = json->start; p < json->end; p++)
+        if (!isdigit(*p)) return false;
+    return strtoull(json->start, NULL, 10) >= 1;
+}
+
+//
+// Answer a --serve request by searching its files (using the worker threads)
+// and printing a result line for each match, followed by a line that says the
+// request is done (or a line with the error if the request can't be done).
+//
+__attribute__((nonnull))
+static void serve_request(json_t *request, bp_pat_t *defs, file_t **loaded_files)
+{
+    json_t *id = json_get(request, "id");
+    serving.id = id ? id->start : NULL;
+    serving.id_len = id ? (size_t)(id->end - id->start) : 0;
+
+    json_t *pattern = json_get(request, "pattern"), *grammars = json_get(request, "grammars"),
+           *files = json_get(request, "files"), *mode = json_get(request, "mode"),
+           *ignorecase = json_get(request, "ignorecase"), *max_steps = json_get(request, "max_steps");
+    const char *invalid = NULL;
+    if (request->type != JSON_OBJECT)
+        invalid = "Requests should be JSON objects";
+    else if (!pattern || pattern->type != JSON_STRING)
+        invalid = "Requests need a \"pattern\" string";
+    else if (!is_string_list(grammars))
+        invalid = "\"grammars\" should be a list of grammar names or files";
+    else if (!is_string_list(files))
+        invalid = "\"files\" should be a list of files and directories";
+    else if (mode && !(mode->type == JSON_STRING && (streq(mode->string, "matches") || streq(mode->string, "count") || streq(mode->string, "files"))))
+        invalid = "\"mode\" should be \"matches\", \"count\", or \"files\"";
+    else if (ignorecase && ignorecase->type != JSON_TRUE && ignorecase->type != JSON_FALSE)
+        invalid = "\"ignorecase\" should be true or false";
+    else if (max_steps && !is_positive_integer(max_steps))
+        invalid = "\"max_steps\" should be a positive number";
+    if (invalid) {
+        fprint_result_error(stdout, NULL, invalid);
+        fflush(stdout);
+        return;
+    }
+
+    char *error = NULL;
+    json_t no_grammars = {.type = JSON_ARRAY};
+    grammar_set_t *set = get_grammar_set(defs, grammars ? grammars : &no_grammars, loaded_files, &error);
+    compiled_pattern_t *compiled = set ? get_compiled_pattern(pattern->string, pattern->len, set->grammars, set->defs, &error) : NULL;
+    if (!compiled) {
+        fprint_result_error(stdout, NULL, error);
+        delete(&error);
+        fflush(stdout);
+        return;
+    }
+
+    options.mode = !mode || streq(mode->string, "matches") ? MODE_NORMAL
+        : (streq(mode->string, "count") ? MODE_COUNT : MODE_LISTFILES);
+    options.ignorecase = ignorecase ? ignorecase->type == JSON_TRUE : !any_uppercase(compiled->text);
+    options.max_steps = max_steps ? (size_t)strtoull(max_steps->start, NULL, 10) : 0;
+    // No files are being searched, so the worker threads can switch patterns:
+    pool.pattern = compiled->pat;
+    pool.defs = compiled->defs;
+
+    int matches = 0;
+    for (size_t i = 0; i < (files ? files->nitems : 1); i++) {
+        const char *filename = files ? files->items[i].string : ".";
+        struct stat statbuf;
+        if (stat(filename, &statbuf) == 0 && S_ISDIR(statbuf.st_mode))
+            matches += process_dir(filename, NULL, compiled->pat, compiled->defs);
+        else
+            matches += queue_file(filename, compiled->pat, compiled->defs, false);
+    }
+    matches += wait_for_jobs();
+
+    fprint_result_start(stdout, NULL);
+    fprintf(stdout, ",\"done\":true,\"matches\":%d}\n", matches);
+    fflush(stdout);
+}
+
+//
+// Answer search requests (one JSON object per line) from stdin until it's
+// closed, keeping compiled patterns and loaded files (with their line
+// indexes) between requests. See `man bp` for the format of requests and
+// results.
+//
+__attribute__((nonnull))
+static void serve(bp_pat_t *defs, file_t **loaded_files)
+{
+    serving.files = new_file_cache(SERVE_CACHED_FILES, SERVE_CACHED_BYTES);
+    char *line = NULL;
+    size_t size = 0;
+    for (ssize_t len; (len = getline(&line, &size, stdin)) > 0; ) {
+        const char *end = &line[len];
+        if (after_spaces(line, true, end) >= end) continue;
+        const char *error = NULL;
+        json_t *request = parse_json(line, end, &error);
+        if (!request) {
+            char msg[256];
+            snprintf(msg, sizeof(msg), "Invalid JSON: %s", error);
+            fprint_result_error(stdout, NULL, msg);
+            fflush(stdout);
+            continue;
+        }
+        serve_request(request, defs, loaded_files);
+        serving.id = NULL;
+        destroy_json(&request);
+    }
+    if (line) delete(&line);
+
+    (void)finish_jobs();
+    destroy_file_cache(&serving.files);
+    for (size_t i = 0; i < serving.npatterns; i++) {
+        free_pat_arena(&serving.patterns[i].arena);
+        delete(&serving.patterns[i].text);
+        delete(&serving.patterns[i].grammars);
+    }
+    for (size_t i = 0; i < serving.ngrammar_sets; i++)
+        delete(&serving.grammar_sets[i].grammars);
+    if (serving.grammar_sets) delete(&serving.grammar_sets);
+}
+
 #define FLAG(f) (flag = get_flag(argv, f, &argv))
 #define BOOLFLAG(f) get_boolflag(argv, f, &argv)
 
@@ -556,7 +1761,7 @@ int main(int argc, char *argv[])
     file_t *local_file = load_filef(&loaded_files, "%s/.config/"BP_NAME"/builtins.bp", getenv("HOME"));
     if (local_file) defs = load_grammar(defs, local_file);
 
-    bool explicit_case_sensitivity = false;
+    bool explicit_case_sensitivity = false, explicit_jobs = false;
 
     ++argv; // skip program name
     while (argv[0]) {
@@ -574,6 +1779,8 @@ int main(int argc, char *argv[])
             options.mode = MODE_INPLACE;
             options.print_filenames = false;
             options.format = FORMAT_BARE;
+        } else if (BOOLFLAG("--no-ignore")) {
+            options.use_ignore_files = false;
         } else if (BOOLFLAG("-G") || BOOLFLAG("--git")) {
             options.git_mode = true;
         } else if (BOOLFLAG("-i") || BOOLFLAG("--ignore-case")) {
@@ -582,9 +1789,61 @@ int main(int argc, char *argv[])
         } else if (BOOLFLAG("-c") || BOOLFLAG("--case")) {
             options.ignorecase = false;
             explicit_case_sensitivity = true;
+        } else if (FLAG("-j")     || FLAG("--jobs")) {
+            char *end;
+            long jobs = strtol(flag, &end, 10);
+            if (end == flag || *end != '\0' || jobs < 0 || jobs > INT_MAX)
+                errx(EXIT_FAILURE, "Invalid --jobs: %s", flag);
+            // `-j0` means one thread for each CPU:
+            options.jobs = jobs > 0 ? (int)jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+            explicit_jobs = true;
         } else if (BOOLFLAG("-l") || BOOLFLAG("--list-files")) {
             options.mode = MODE_LISTFILES;
+        } else if (BOOLFLAG("--count")) {
+            options.mode = MODE_COUNT;
+        } else if (BOOLFLAG("-p") || BOOLFLAG("--packrat")) {
+            options.packrat = true;
+        } else if (BOOLFLAG("--profile")) {
+            options.profile = true;
+        } else if (BOOLFLAG("--serve")) {
+            options.serve = true;
+        } else if (BOOLFLAG("-S") || BOOLFLAG("--stream")) {
+            options.stream = true;
+        } else if (FLAG("-M")     || FLAG("--max-span")) {
+            long max_span = strtol(flag, NULL, 10);
+            if (max_span <= 0)
+                errx(EXIT_FAILURE, "Invalid --max-span: %s", flag);
+            options.max_span = (size_t)max_span;
+            options.stream = true;
+        } else if (FLAG("--max-steps")) {
+            long max_steps = strtol(flag, NULL, 10);
+            if (max_steps <= 0)
+                errx(EXIT_FAILURE, "Invalid --max-steps: %s", flag);
+            options.max_steps = (size_t)max_steps;
+        } else if (FLAG("-P")     || FLAG("--patterns-file")) {
+            if (pattern || options.patterns)
+                errx(EXIT_FAILURE, "--patterns-file can't be used with another pattern");
+            file_t *f = load_file(&loaded_files, flag);
+            if (f == NULL)
+                errx(EXIT_FAILURE, "Couldn't open patterns file: %s", flag);
+            bp_pat_t *file_defs = assert_pat(f->start, f->end, bp_pattern(f->start, f->end));
+            if (file_defs->type != BP_DEFINITIONS)
+                errx(EXIT_FAILURE, "The patterns file should only have definitions (name: pattern): %s", flag);
+            defs = chain_together(defs, file_defs);
+            // Each definition is searched for with a reference to it, so
+            // definitions can use each other (and left recursion works):
+            for (bp_pat_t *def = file_defs; def; def = When(def, BP_DEFINITIONS)->next_def) {
+                auto d = When(def, BP_DEFINITIONS);
+                options.patterns = grow(options.patterns, options.npatterns + 1);
+                options.patterns[options.npatterns++] = (named_pattern_t){
+                    .name = d->name, .namelen = d->namelen,
+                    .pat = assert_pat(d->name, &d->name[d->namelen], bp_pattern(d->name, &d->name[d->namelen])),
+                };
+                pattern = either_pat(pattern, options.patterns[options.npatterns-1].pat);
+            }
         } else if (FLAG("-r")     || FLAG("--replace")) {
+            if (options.patterns)
+                errx(EXIT_FAILURE, "--replace can't be used with --patterns-file");
             if (!pattern)
                 errx(EXIT_FAILURE, "No pattern has been defined for replacement to operate on");
             // TODO: spoof file as sprintf("pattern => '%s'", flag)
@@ -593,13 +1852,7 @@ int main(int argc, char *argv[])
             if (options.context_before == USE_DEFAULT_CONTEXT) options.context_before = ALL_CONTEXT;
             if (options.context_after == USE_DEFAULT_CONTEXT) options.context_after = ALL_CONTEXT;
         } else if (FLAG("-g")     || FLAG("--grammar")) {
-            file_t *f = NULL;
-            if (strlen(flag) > 3 && strncmp(&flag[strlen(flag)-3], ".bp", 3) == 0)
-                f = load_file(&loaded_files, flag);
-            if (f == NULL)
-                f = load_filef(&loaded_files, "%s/.config/"BP_NAME"/%s.bp", getenv("HOME"), flag);
-            if (f == NULL)
-                f = load_filef(&loaded_files, "/etc/"BP_NAME"/%s.bp", flag);
+            file_t *f = load_grammar_file(&loaded_files, flag);
             if (f == NULL)
                 errx(EXIT_FAILURE, "Couldn't find grammar: %s", flag);
             defs = load_grammar(defs, f); // Keep in memory for debug output
@@ -643,8 +1896,12 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (pattern == NULL)
+    if (options.serve && (pattern || argv[0] || options.mode == MODE_EXPLAIN || options.mode == MODE_INPLACE))
+        errx(EXIT_FAILURE, "--serve takes its patterns and files from requests, and can't be used with --explain or --inplace");
+    if (pattern == NULL && !options.serve)
         errx(EXIT_FAILURE, "No pattern provided.\n\n%s", usage);
+    if (options.patterns && (options.mode == MODE_EXPLAIN || options.mode == MODE_INPLACE))
+        errx(EXIT_FAILURE, "--patterns-file can't be used with --explain or --inplace");
 
     for (argc = 0; argv[argc]; ++argc) ; // update argc
 
@@ -654,6 +1911,24 @@ int main(int argc, char *argv[])
     if (options.format == FORMAT_AUTO)
         options.format = isatty(STDOUT_FILENO) ? (getenv("NO_COLOR") ? FORMAT_PLAIN : FORMAT_FANCY) : FORMAT_BARE;
 
+    if (!isatty(STDOUT_FILENO))
+        (void)setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+    // Explanations are printed straight to the terminal, in-place
+    // modification keeps track of a single temporary file, and profiling
+    // counts the work done by a single matcher, so these all run serially:
+    if (options.mode == MODE_EXPLAIN || options.mode == MODE_INPLACE || options.profile)
+        options.jobs = 1;
+    if (options.profile)
+        bp_matcher_set_profiling(bp_default_matcher(), true);
+    // Results are JSON lines, and requests are searched using every core
+    // unless told otherwise:
+    if (options.serve) {
+        options.print_filenames = false;
+        if (!explicit_jobs && !options.profile)
+            options.jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
     // If any of these signals triggers, and there is a temporary file in use,
     // be sure to clean it up before exiting.
     int signals[] = {SIGTERM, SIGINT, SIGXCPU, SIGXFSZ, SIGVTALRM, SIGPROF, SIGSEGV, SIGTSTP};
@@ -664,19 +1939,25 @@ int main(int argc, char *argv[])
     // Handle exit() calls gracefully:
     require(atexit(&cleanup), "Failed to set cleanup handler at exit");
 
-    if (options.verbose)
+    if (options.verbose && pattern)
         printf("Matching pattern: %P\n", pattern);
 
     // Default to git mode if there's a .git directory and no files were specified:
     struct stat gitdir;
-    if (argc == 0 && stat(".git", &gitdir) == 0 && S_ISDIR(gitdir.st_mode))
+    if (argc == 0 && !options.serve && stat(".git", &gitdir) == 0 && S_ISDIR(gitdir.st_mode))
         options.git_mode = true;
 
     int found = 0;
-    if (!isatty(STDIN_FILENO) && !argv[0]) {
+    if (options.serve) {
+        serve(defs, &loaded_files);
+        found = 1; // Exit successfully once stdin is closed
+    } else if (!isatty(STDIN_FILENO) && !argv[0]) {
         // Piped in input:
         options.print_filenames = false; // Don't print filename on stdin
-        found += process_file("", pattern, defs);
+        if (options.stream && options.mode == MODE_NORMAL && !options.patterns)
+            found += process_stream(stdout, STDIN_FILENO, pattern, defs);
+        else
+            found += process_file(stdout, "", pattern, defs, false);
     } else if (options.git_mode) {
         // Get the list of files from `git --ls-files ...`
         found = process_git_files(pattern, defs, argc, argv);
@@ -687,20 +1968,27 @@ int main(int argc, char *argv[])
             options.print_filenames = false;
         for ( ; argv[0]; argv++) {
             if (stat(argv[0], &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) // Symlinks are okay if manually specified
-                found += process_dir(argv[0], pattern, defs);
+                found += process_dir(argv[0], NULL, pattern, defs);
+            else if (!argv[1] && !pool.threads) // A lone file is searched here, so its search can use the threads itself
+                found += process_file(stdout, argv[0], pattern, defs, false);
             else
-                found += process_file(argv[0], pattern, defs);
+                found += queue_file(argv[0], pattern, defs, false);
         }
     } else {
         // No files, no piped in input, so use files in current dir, recursively
-        found += process_dir(".", pattern, defs);
+        found += process_dir(".", NULL, pattern, defs);
     }
+    found += finish_jobs();
+
+    if (options.profile)
+        print_profile(stderr, bp_default_matcher());
 
     // This code frees up all residual heap-allocated memory. Since the program
     // is about to exit, this step is unnecessary. However, it is useful for
     // tracking down memory leaks.
     free_all_matches();
     free_all_pats();
+    if (options.patterns) delete(&options.patterns);
     while (loaded_files) {
         file_t *next = loaded_files->next;
         destroy_file(&loaded_files);
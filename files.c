@@ -5,7 +5,10 @@
 #include <err.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -15,26 +18,67 @@
 #include "pattern.h"
 #include "utils.h"
 
+// Files up to this size are read into a buffer instead of being memory mapped,
+// since setting up (and tearing down) a mapping costs more than reading them
+#define MAX_READ_FILE_SIZE (64*1024)
+// How much already-searched text of a memory-mapped file piles up before it's
+// released
+#define RELEASE_GRANULARITY (4*1024*1024)
+
+// A file in a file cache, along with what the file looked like on disk when
+// it was loaded (to tell if it has changed since then)
+typedef struct cached_file_s {
+    struct cached_file_s *next_in_bucket, *newer, *older;
+    char *filename;
+    file_t *file;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    // Whether a thread is using the file (so it can't be evicted)
+    bool in_use;
+} cached_file_t;
+
+// Files are looked up by name in a hash table, and are also kept in a list
+// from most to least recently used, so the least recently used files can be
+// evicted once the cache is full
+struct file_cache_s {
+    pthread_mutex_t lock;
+    cached_file_t **buckets, *newest, *oldest;
+    size_t nbuckets, count, bytes, max_files, max_bytes;
+};
+
+// Empty files all share this (empty) text
+static char empty_text[1] = "";
+// A buffer for reading small files into that's reused once its file is
+// destroyed (each buffer has room for MAX_READ_FILE_SIZE bytes plus a NUL)
+static _Thread_local char *spare_buffer = NULL;
+
 //
-// In the file object, populate the `lines` array with pointers to the
-// beginning of each line.
+// Extend the file's index of line starts until it has at least `min_lines`
+// lines and includes a line that starts after `after` (or until all of the
+// lines have been indexed).
 //
-__attribute__((nonnull))
-static void populate_lines(file_t *f)
+__attribute__((nonnull(1)))
+static void index_lines(file_t *f, const char *after, size_t min_lines)
 {
-    // Calculate line numbers:
-    size_t linecap = 10;
-    f->lines = new(const char*[linecap]);
-    f->nlines = 0;
-    char *p = f->start;
-    for (size_t n = 0; p && p <= f->end; ++n) {
-        ++f->nlines;
-        if (n >= linecap)
-            f->lines = grow(f->lines, linecap *= 2);
-        f->lines[n] = p;
-        char *nl = memchr(p, '\n', (size_t)(f->end - p));
-        if (nl && nl < f->end) p = nl+1;
-        else break;
+    if (f->total_lines > 0 && f->nlines >= f->total_lines) return;
+    if (f->nlines == 0) {
+        f->line_capacity = 10;
+        f->lines = new(char*[f->line_capacity]);
+        f->lines[f->nlines++] = f->start;
+    }
+    char *p = f->lines[f->nlines-1];
+    while ((after && p <= after) || f->nlines < min_lines) {
+        char *nl = p < f->end ? memchr(p, '\n', (size_t)(f->end - p)) : NULL;
+        if (!nl) {
+            f->total_lines = f->nlines;
+            return;
+        }
+        if (f->nlines >= f->line_capacity)
+            f->lines = grow(f->lines, f->line_capacity *= 2);
+        p = nl+1;
+        f->lines[f->nlines++] = p;
     }
 }
 
@@ -69,6 +113,9 @@ public file_t *load_file(file_t **files, const char *filename)
             file_t *f = load_file(files, tmp);
             if (!f) return f;
             long line = strtol(colon+1, &colon, 10);
+            // Line numbers are relative to the whole file, so it needs to be
+            // indexed before it's narrowed down to one line:
+            index_lines(f, f->end, 0);
             f->start = (char*)get_line(f, (size_t)line);
             f->end = (char*)get_line(f, (size_t)line+1);
             return f;
@@ -86,13 +133,40 @@ public file_t *load_file(file_t **files, const char *filename)
     if (fstat(fd, &sb) == -1)
         goto read_file;
 
+    if (S_ISREG(sb.st_mode) && sb.st_size == 0) {
+        // Some files (like the ones in /proc) say they're empty but still
+        // have text to read, so this checks before skipping the allocation:
+        char c;
+        if (pread(fd, &c, 1, 0) != 0) goto read_file;
+        f->start = f->end = empty_text;
+        goto finished_loading;
+    } else if (S_ISREG(sb.st_mode) && sb.st_size <= MAX_READ_FILE_SIZE) {
+        char *buf = spare_buffer ? spare_buffer : new(char[MAX_READ_FILE_SIZE+1]);
+        spare_buffer = NULL;
+        size_t length = 0;
+        for (ssize_t just_read; length < (size_t)sb.st_size; length += (size_t)just_read) {
+            just_read = pread(fd, &buf[length], (size_t)sb.st_size - length, (off_t)length);
+            if (just_read <= 0) break;
+        }
+        buf[length] = '\0';
+        f->allocated = buf;
+        f->reusable = true;
+        f->start = f->allocated;
+        f->end = &f->allocated[length];
+        goto finished_loading;
+    }
+
     f->mmapped = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     if (f->mmapped == MAP_FAILED) {
         f->mmapped = NULL;
         goto read_file;
     }
+    // Files are mostly read from start to end, so the kernel can read ahead
+    // more aggressively:
+    (void)madvise(f->mmapped, (size_t)sb.st_size, MADV_SEQUENTIAL);
     f->start = f->mmapped;
     f->end = &f->mmapped[sb.st_size];
+    f->released = f->mmapped;
     goto finished_loading;
 
   read_file:
@@ -114,7 +188,6 @@ public file_t *load_file(file_t **files, const char *filename)
     if (fd != STDIN_FILENO)
         require(close(fd), "Failed to close file");
 
-    populate_lines(f);
     if (files != NULL) {
         f->next = *files;
         *files = f;
@@ -129,8 +202,13 @@ public void slice_file(file_t *slice, file_t *src, const char *start, const char
 {
     memset(slice, 0, sizeof(file_t));
     slice->filename = src->filename;
+    // The slice shares the source file's index of lines, so the index has to
+    // be complete (it won't be reallocated after that):
+    index_lines(src, src->end, 0);
     slice->lines = src->lines;
     slice->nlines = src->nlines;
+    slice->line_capacity = src->line_capacity;
+    slice->total_lines = src->total_lines;
     slice->start = (char*)start;
     slice->end = (char*)end;
 }
@@ -148,7 +226,6 @@ public file_t *spoof_file(file_t **files, const char *filename, const char *text
     memcpy(f->allocated, text, len);
     f->start = &f->allocated[0];
     f->end = &f->allocated[len];
-    populate_lines(f);
     if (files != NULL) {
         f->next = *files;
         *files = f;
@@ -156,6 +233,65 @@ public file_t *spoof_file(file_t **files, const char *filename, const char *text
     return f;
 }
 
+//
+// Read up to `chunk_size` more bytes from a stream onto the end of a file's
+// text (which may move the text to a new location in memory). Returns the
+// number of bytes read, which is 0 at the end of the stream.
+//
+public ssize_t read_stream(file_t *f, int fd, size_t chunk_size)
+{
+    size_t len = (size_t)(f->end - f->start);
+    if (!f->allocated || len + chunk_size + 1 > f->capacity) {
+        f->capacity = f->capacity > 0 ? f->capacity : 1000;
+        while (len + chunk_size + 1 > f->capacity) f->capacity *= 2;
+        f->allocated = grow(f->allocated, f->capacity);
+        f->start = f->allocated;
+        f->end = &f->allocated[len];
+        // Lines will be re-indexed as needed:
+        if (f->lines) delete(&f->lines);
+        f->nlines = f->line_capacity = 0;
+    }
+    ssize_t just_read = read(fd, f->end, chunk_size);
+    if (just_read > 0) {
+        f->end += just_read;
+        *f->end = '\0';
+        // More lines may have been read:
+        f->total_lines = 0;
+    }
+    return just_read;
+}
+
+//
+// Discard the part of a stream's text before `keep` (which should be the
+// start of a line), moving the rest of the text to the start of the buffer.
+//
+public void discard_stream_text(file_t *f, const char *keep)
+{
+    for (const char *p = f->start; p < keep && (p = memchr(p, '\n', (size_t)(keep - p))); ++p)
+        ++f->discarded_lines;
+    size_t len = (size_t)(f->end - keep);
+    memmove(f->allocated, keep, len);
+    f->start = f->allocated;
+    f->end = &f->allocated[len];
+    *f->end = '\0';
+    if (f->lines) delete(&f->lines);
+    f->nlines = f->line_capacity = f->total_lines = 0;
+}
+
+//
+// Let the memory used for a memory-mapped file's text before `before` be
+// released, once enough of it has piled up. This is only an optimization:
+// the text is still there if it's used again (it's read from the file again).
+//
+public void release_file_text(file_t *f, const char *before)
+{
+    if (!f->mmapped || !before || before < f->released + RELEASE_GRANULARITY) return;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    char *end = &f->mmapped[(size_t)(before - f->mmapped) / page_size * page_size];
+    (void)madvise(f->released, (size_t)(end - f->released), MADV_DONTNEED);
+    f->released = end;
+}
+
 //
 // Free a file and all memory contained inside its members, then set the input
 // pointer to NULL.
@@ -169,7 +305,9 @@ public void destroy_file(file_t **at_f)
     if (f->lines)
         delete(&f->lines);
 
-    if (f->allocated)
+    if (f->allocated && f->reusable && !spare_buffer)
+        spare_buffer = f->allocated;
+    else if (f->allocated)
         delete(&f->allocated);
 
     if (f->mmapped) {
@@ -181,24 +319,217 @@ public void destroy_file(file_t **at_f)
     delete(at_f);
 }
 
+//
+// Create a cache that holds up to `max_files` files, whose texts add up to no
+// more than `max_bytes` bytes.
+//
+public file_cache_t *new_file_cache(size_t max_files, size_t max_bytes)
+{
+    file_cache_t *cache = new(file_cache_t);
+    require(pthread_mutex_init(&cache->lock, NULL), "Failed to create file cache lock");
+    cache->nbuckets = 64;
+    cache->buckets = new(cached_file_t*[cache->nbuckets]);
+    cache->max_files = max_files;
+    cache->max_bytes = max_bytes;
+    return cache;
+}
+
+static inline size_t filename_hash(const char *filename)
+{
+    uint64_t h = 0xcbf29ce484222325; // FNV-1a
+    for (const char *p = filename; *p; p++)
+        h = (h ^ (unsigned char)*p) * 0x100000001b3;
+    return (size_t)h;
+}
+
+static inline bool same_version(cached_file_t *entry, struct stat *sb)
+{
+    return entry->dev == sb->st_dev && entry->ino == sb->st_ino && entry->size == sb->st_size
+        && entry->mtime.tv_sec == sb->st_mtim.tv_sec && entry->mtime.tv_nsec == sb->st_mtim.tv_nsec;
+}
+
+//
+// Find a file's cache entry. This must be called with the cache locked.
+//
+static cached_file_t *find_cached(file_cache_t *cache, const char *filename)
+{
+    for (cached_file_t *e = cache->buckets[filename_hash(filename) % cache->nbuckets]; e; e = e->next_in_bucket)
+        if (streq(e->filename, filename)) return e;
+    return NULL;
+}
+
+//
+// Move an entry to the front of the most recently used list (adding it to the
+// list if it's new). This must be called with the cache locked.
+//
+static void mark_used(file_cache_t *cache, cached_file_t *entry)
+{
+    if (cache->newest == entry) return;
+    if (entry->newer) entry->newer->older = entry->older;
+    if (entry->older) entry->older->newer = entry->newer;
+    if (cache->oldest == entry) cache->oldest = entry->newer;
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest) cache->newest->newer = entry;
+    cache->newest = entry;
+    if (!cache->oldest) cache->oldest = entry;
+}
+
+//
+// Remove an entry from the cache and free it (and its file). This must be
+// called with the cache locked.
+//
+static void evict(file_cache_t *cache, cached_file_t *entry)
+{
+    cached_file_t **prev = &cache->buckets[filename_hash(entry->filename) % cache->nbuckets];
+    while (*prev != entry) prev = &(*prev)->next_in_bucket;
+    *prev = entry->next_in_bucket;
+    if (entry->newer) entry->newer->older = entry->older;
+    else cache->newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer;
+    else cache->oldest = entry->newer;
+    cache->count -= 1;
+    cache->bytes -= (size_t)(entry->file->end - entry->file->start);
+    destroy_file(&entry->file);
+    delete(&entry->filename);
+    delete(&entry);
+}
+
+//
+// Add a newly loaded file to the cache (in use), evicting the least recently
+// used files that aren't in use until it fits. This must be called with the
+// cache locked.
+//
+static void add_cached(file_cache_t *cache, const char *filename, file_t *f, struct stat *sb)
+{
+    size_t len = (size_t)(f->end - f->start);
+    for (cached_file_t *e = cache->oldest, *newer; e && (cache->count + 1 > cache->max_files || cache->bytes + len > cache->max_bytes); e = newer) {
+        newer = e->newer;
+        if (!e->in_use) evict(cache, e);
+    }
+
+    if (cache->count + 1 > cache->nbuckets) {
+        size_t old_nbuckets = cache->nbuckets;
+        cached_file_t **old_buckets = cache->buckets;
+        cache->nbuckets *= 2;
+        cache->buckets = new(cached_file_t*[cache->nbuckets]);
+        for (size_t i = 0; i < old_nbuckets; i++) {
+            for (cached_file_t *e = old_buckets[i], *next; e; e = next) {
+                next = e->next_in_bucket;
+                size_t b = filename_hash(e->filename) % cache->nbuckets;
+                e->next_in_bucket = cache->buckets[b];
+                cache->buckets[b] = e;
+            }
+        }
+        delete(&old_buckets);
+    }
+
+    cached_file_t *entry = new(cached_file_t);
+    *entry = (cached_file_t){
+        .filename = checked_strdup(filename), .file = f, .dev = sb->st_dev, .ino = sb->st_ino,
+        .size = sb->st_size, .mtime = sb->st_mtim, .in_use = true,
+    };
+    size_t b = filename_hash(filename) % cache->nbuckets;
+    entry->next_in_bucket = cache->buckets[b];
+    cache->buckets[b] = entry;
+    mark_used(cache, entry);
+    cache->count += 1;
+    cache->bytes += len;
+}
+
+//
+// Get a file from the cache, loading it if it isn't cached yet or has changed
+// since it was cached. The file has to be given back with return_file() once
+// the caller is done with it. A file that's already in use by another thread
+// (or isn't a regular file) is loaded separately and isn't cached.
+//
+public file_t *checkout_file(file_cache_t *cache, const char *filename)
+{
+    struct stat sb;
+    if (stat(filename, &sb) != 0 || !S_ISREG(sb.st_mode))
+        return load_file(NULL, filename);
+
+    pthread_mutex_lock(&cache->lock);
+    cached_file_t *entry = find_cached(cache, filename);
+    if (entry && !entry->in_use) {
+        if (same_version(entry, &sb)) {
+            entry->in_use = true;
+            mark_used(cache, entry);
+            pthread_mutex_unlock(&cache->lock);
+            return entry->file;
+        }
+        evict(cache, entry);
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    file_t *f = load_file(NULL, filename);
+    if (!f || entry) return f;
+    // Small files are read into a buffer with room for any small file, which
+    // is trimmed to fit since it won't be reused any time soon:
+    if (f->reusable) {
+        size_t len = (size_t)(f->end - f->start);
+        f->allocated = grow(f->allocated, len + 1);
+        f->start = f->allocated;
+        f->end = &f->allocated[len];
+        f->reusable = false;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    // Another thread may have cached the file in the meantime:
+    if (!find_cached(cache, filename))
+        add_cached(cache, filename, f, &sb);
+    pthread_mutex_unlock(&cache->lock);
+    return f;
+}
+
+//
+// Give back a file that was gotten with checkout_file(), then set the input
+// pointer to NULL. (Files that weren't cached are destroyed.)
+//
+public void return_file(file_cache_t *cache, const char *filename, file_t **at_f)
+{
+    pthread_mutex_lock(&cache->lock);
+    cached_file_t *entry = find_cached(cache, filename);
+    if (entry && entry->file == *at_f) {
+        entry->in_use = false;
+        *at_f = NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (*at_f) destroy_file(at_f);
+}
+
+//
+// Free a file cache and all of the files in it, then set the input pointer
+// to NULL. None of the files should be in use.
+//
+public void destroy_file_cache(file_cache_t **at_cache)
+{
+    file_cache_t *cache = *at_cache;
+    while (cache->oldest) evict(cache, cache->oldest);
+    delete(&cache->buckets);
+    pthread_mutex_destroy(&cache->lock);
+    delete(at_cache);
+}
+
 //
 // Given a pointer, determine which line number it points to.
 //
 public size_t get_line_number(file_t *f, const char *p)
 {
-    if (f->nlines == 0) return 0;
+    index_lines(f, p, 1);
     // Binary search:
     size_t lo = 0, hi = f->nlines-1;
     while (lo <= hi) {
         size_t mid = (lo + hi) / 2;
         if (f->lines[mid] == p)
-            return mid + 1;
+            return f->discarded_lines + mid + 1;
         else if (f->lines[mid] < p)
             lo = mid + 1;    
         else if (f->lines[mid] > p)
             hi = mid - 1;
     }
-    return lo; // Return the line number whose line starts closest before p
+    return f->discarded_lines + lo; // Return the line number whose line starts closest before p
 }
 
 //
@@ -206,17 +537,40 @@ public size_t get_line_number(file_t *f, const char *p)
 //
 public size_t get_line_column(file_t *f, const char *p)
 {
-    size_t line_no = get_line_number(f, p);
-    return 1 + (size_t)(p - f->lines[line_no]);
+    size_t line_no = get_line_number(f, p) - f->discarded_lines;
+    return 1 + (size_t)(p - f->lines[line_no - 1]);
 }
 
 //
-// Return a pointer to the line with the specified line number.
+// Return a pointer to the line with the specified line number. (For lines
+// that have been discarded from a stream, this is the start of the text.)
 //
 public const char *get_line(file_t *f, size_t line_number)
 {
-    if (line_number == 0 || line_number > f->nlines) return NULL;
+    if (line_number == 0) return NULL;
+    if (line_number <= f->discarded_lines) return f->start;
+    line_number -= f->discarded_lines;
+    index_lines(f, NULL, line_number);
+    if (line_number > f->nlines) return NULL;
     return f->lines[line_number - 1];
 }
 
+//
+// Return the total number of lines in the file. This only counts the lines
+// that haven't been indexed yet, without adding them to the index.
+//
+public size_t get_num_lines(file_t *f)
+{
+    if (f->total_lines == 0) {
+        index_lines(f, NULL, 1);
+        size_t n = f->nlines;
+        for (const char *p = f->lines[f->nlines-1]; p < f->end; ++p, ++n) {
+            p = memchr(p, '\n', (size_t)(f->end - p));
+            if (!p) break;
+        }
+        f->total_lines = n;
+    }
+    return f->discarded_lines + f->total_lines;
+}
+
 // vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -3,6 +3,7 @@
 //
 #pragma once
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <unistd.h>
 
@@ -10,10 +11,24 @@ typedef struct file_s {
     struct file_s *next;
     const char *filename;
     char *mmapped, *allocated;
-    char **lines, *start, *end;
-    size_t nlines;
+    char *start, *end;
+    // How far the memory-mapped text has been released (after it was searched)
+    char *released;
+    // Whether `allocated` is a reusable buffer for reading small files
+    bool reusable;
+    // The starts of lines are indexed lazily, only as far as they've been
+    // needed. `total_lines` is 0 until the total number of lines is known.
+    char **lines;
+    size_t nlines, line_capacity, total_lines;
+    // For streams, which are read incrementally and can discard text that's
+    // no longer needed (line numbers still count the discarded lines):
+    size_t capacity, discarded_lines;
 } file_t;
 
+// A cache of loaded files (along with their line indexes) that threads can
+// share, so files that are searched again and again are only loaded once
+typedef struct file_cache_s file_cache_t;
+
 __attribute__((nonnull(2)))
 file_t *load_file(file_t **files, const char *filename);
 __attribute__((format(printf,2,3)))
@@ -23,12 +38,28 @@ void slice_file(file_t *slice, file_t *src, const char *start, const char *end);
 __attribute__((nonnull(3), returns_nonnull))
 file_t *spoof_file(file_t **files, const char *filename, const char *text, ssize_t len);
 __attribute__((nonnull))
+ssize_t read_stream(file_t *f, int fd, size_t chunk_size);
+__attribute__((nonnull))
+void discard_stream_text(file_t *f, const char *keep);
+__attribute__((nonnull(1)))
+void release_file_text(file_t *f, const char *before);
+__attribute__((nonnull))
 void destroy_file(file_t **f);
-__attribute__((pure, nonnull))
+__attribute__((returns_nonnull))
+file_cache_t *new_file_cache(size_t max_files, size_t max_bytes);
+__attribute__((nonnull))
+file_t *checkout_file(file_cache_t *cache, const char *filename);
+__attribute__((nonnull))
+void return_file(file_cache_t *cache, const char *filename, file_t **at_f);
+__attribute__((nonnull))
+void destroy_file_cache(file_cache_t **at_cache);
+__attribute__((nonnull))
 size_t get_line_number(file_t *f, const char *p);
-__attribute__((pure, nonnull))
+__attribute__((nonnull))
 size_t get_line_column(file_t *f, const char *p);
-__attribute__((pure, nonnull))
+__attribute__((nonnull))
 const char *get_line(file_t *f, size_t line_number);
+__attribute__((nonnull))
+size_t get_num_lines(file_t *f);
 
 // vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
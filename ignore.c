@@ -0,0 +1,200 @@
+//
+// ignore.c - Code for .gitignore-style rules for skipping files.
+//
+// Each directory's `.gitignore` and `.ignore` files add rules on top of the
+// rules inherited from parent directories. Rules in deeper directories take
+// precedence over rules in parent directories, and within a directory, later
+// rules (and `.ignore` rules) take precedence over earlier ones.
+//
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "ignore.h"
+#include "utils.h"
+
+typedef struct {
+    char *glob;
+    // `negated` rules start with "!" and un-ignore files, `dir_only` rules end
+    // with "/" and only match directories, and `anchored` rules contain a "/"
+    // and match a path relative to the directory instead of just a filename.
+    bool negated, dir_only, anchored;
+} ignore_rule_t;
+
+struct ignore_rules_s {
+    ignore_rules_t *parent;
+    // The directory the rules were loaded from (as a prefix of the paths
+    // being checked)
+    char *dirname;
+    size_t dirname_len;
+    ignore_rule_t *rules;
+    size_t nrules, capacity;
+};
+
+//
+// Return whether a string matches a gitignore glob, where "*" and "?" don't
+// match slashes, but "**" does.
+//
+__attribute__((nonnull, pure))
+static bool glob_matches(const char *glob, const char *str)
+{
+    for (;;) {
+        switch (*glob) {
+        case '\0': return *str == '\0';
+        case '*': {
+            bool any_dirs = glob[1] == '*';
+            glob += any_dirs ? 2 : 1;
+            if (any_dirs && *glob == '/') {
+                // "**/" matches any number of leading directories (or none):
+                ++glob;
+                for (const char *s = str; s; s = strchr(s, '/')) {
+                    if (*s == '/') ++s;
+                    if (glob_matches(glob, s)) return true;
+                }
+                return false;
+            }
+            for (const char *s = str; ; ++s) {
+                if (glob_matches(glob, s)) return true;
+                if (*s == '\0' || (*s == '/' && !any_dirs)) return false;
+            }
+        }
+        case '?': {
+            if (*str == '\0' || *str == '/') return false;
+            ++glob, ++str;
+            break;
+        }
+        case '[': {
+            const char *p = glob + 1;
+            bool negated = (*p == '!' || *p == '^');
+            if (negated) ++p;
+            bool matched = false;
+            for (const char *first = p; *p && (*p != ']' || p == first); ) {
+                unsigned char lo = (unsigned char)*p, hi = lo;
+                if (p[1] == '-' && p[2] && p[2] != ']') {
+                    hi = (unsigned char)p[2];
+                    p += 3;
+                } else {
+                    ++p;
+                }
+                if (lo <= (unsigned char)*str && (unsigned char)*str <= hi) matched = true;
+            }
+            if (*p != ']') goto literal; // Not a character class after all
+            if (*str == '\0' || *str == '/' || matched == negated) return false;
+            glob = p + 1, ++str;
+            break;
+        }
+        case '\\': {
+            if (glob[1]) ++glob;
+            goto literal;
+        }
+        default: {
+          literal:
+            if (*glob != *str) return false;
+            ++glob, ++str;
+            break;
+        }
+        }
+    }
+}
+
+//
+// Add the rules from an ignore file (if it exists) to a set of rules.
+//
+__attribute__((nonnull))
+static void add_rules_from_file(ignore_rules_t *rules, const char *dirname, const char *basename)
+{
+    char *path = NULL;
+    require(asprintf(&path, "%s/%s", dirname, basename), "Could not allocate memory");
+    FILE *f = fopen(path, "r");
+    delete(&path);
+    if (!f) return;
+
+    char *line = NULL;
+    size_t size = 0;
+    for (ssize_t len; (len = getline(&line, &size, f)) >= 0; ) {
+        // Trailing whitespace is ignored, unless it's escaped:
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'
+                           || (line[len-1] == ' ' && !(len > 1 && line[len-2] == '\\'))))
+            line[--len] = '\0';
+        if (len == 0 || line[0] == '#') continue;
+
+        ignore_rule_t rule = {0};
+        char *glob = line;
+        if (*glob == '!') {
+            rule.negated = true;
+            ++glob;
+        }
+        size_t glob_len = strlen(glob);
+        if (glob_len > 0 && glob[glob_len-1] == '/') {
+            rule.dir_only = true;
+            glob[--glob_len] = '\0';
+        }
+        rule.anchored = strchr(glob, '/') != NULL;
+        if (*glob == '/') ++glob;
+        if (*glob == '\0') continue;
+        rule.glob = checked_strdup(glob);
+
+        if (rules->nrules >= rules->capacity)
+            rules->rules = grow(rules->rules, rules->capacity = (rules->capacity == 0 ? 16 : 2*rules->capacity));
+        rules->rules[rules->nrules++] = rule;
+    }
+    if (line) delete(&line);
+    (void)fclose(f);
+}
+
+//
+// Load the ignore rules for a directory. If the directory doesn't have any
+// ignore files, this returns the parent's rules, otherwise the new rules need
+// to be freed with destroy_ignore_rules().
+//
+public ignore_rules_t *load_ignore_rules(ignore_rules_t *parent, const char *dirname)
+{
+    ignore_rules_t *rules = new(ignore_rules_t);
+    add_rules_from_file(rules, dirname, ".gitignore");
+    add_rules_from_file(rules, dirname, ".ignore");
+    if (rules->nrules == 0) {
+        delete(&rules);
+        return parent;
+    }
+    rules->parent = parent;
+    rules->dirname = checked_strdup(dirname);
+    rules->dirname_len = strlen(dirname);
+    return rules;
+}
+
+//
+// Return whether a file (or directory) should be skipped. `path` is the full
+// path to the file, which starts with the directory the rules were loaded
+// from, and `name` is the file's name.
+//
+public bool is_ignored(ignore_rules_t *rules, const char *path, const char *name, bool is_dir)
+{
+    for (; rules; rules = rules->parent) {
+        if (strncmp(path, rules->dirname, rules->dirname_len) != 0 || path[rules->dirname_len] != '/')
+            continue;
+        const char *relative = &path[rules->dirname_len + 1];
+        for (size_t i = rules->nrules; i-- > 0; ) {
+            ignore_rule_t *rule = &rules->rules[i];
+            if (rule->dir_only && !is_dir) continue;
+            if (glob_matches(rule->glob, rule->anchored ? relative : name))
+                return !rule->negated;
+        }
+    }
+    return false;
+}
+
+//
+// Free the memory used by a directory's ignore rules (but not its parent's).
+//
+public void destroy_ignore_rules(ignore_rules_t **rules)
+{
+    for (size_t i = 0; i < (*rules)->nrules; i++)
+        delete(&(*rules)->rules[i].glob);
+    if ((*rules)->rules) delete(&(*rules)->rules);
+    delete(&(*rules)->dirname);
+    delete(rules);
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
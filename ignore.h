@@ -0,0 +1,19 @@
+//
+// ignore.h - Header file for .gitignore-style rules for skipping files.
+//
+#pragma once
+
+#include <stdbool.h>
+
+// The ignore rules that apply inside a directory, including the rules
+// inherited from its parent directories
+typedef struct ignore_rules_s ignore_rules_t;
+
+__attribute__((nonnull(2)))
+ignore_rules_t *load_ignore_rules(ignore_rules_t *parent, const char *dirname);
+__attribute__((nonnull(2,3)))
+bool is_ignored(ignore_rules_t *rules, const char *path, const char *name, bool is_dir);
+__attribute__((nonnull))
+void destroy_ignore_rules(ignore_rules_t **rules);
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
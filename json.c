@@ -0,0 +1,310 @@
+//
+// json.c - A small JSON reader and writer (for bp --serve requests and
+// results).
+//
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "json.h"
+#include "utils.h"
+
+// How deeply arrays and objects may be nested (to bound the recursion)
+#define MAX_JSON_DEPTH 64
+
+typedef struct {
+    const char *pos, *end;
+    const char *error;
+} json_parser_t;
+
+__attribute__((nonnull))
+static bool parse_value(json_parser_t *p, json_t *json, int depth);
+
+static inline void skip_whitespace(json_parser_t *p)
+{
+    while (p->pos < p->end && (*p->pos == ' ' || *p->pos == '\t' || *p->pos == '\n' || *p->pos == '\r'))
+        ++p->pos;
+}
+
+static inline bool fail(json_parser_t *p, const char *msg)
+{
+    if (!p->error) p->error = msg;
+    return false;
+}
+
+//
+// Append a unicode codepoint to a string as UTF-8.
+//
+static size_t encode_utf8(char *out, uint32_t codepoint)
+{
+    if (codepoint < 0x80) {
+        out[0] = (char)codepoint;
+        return 1;
+    } else if (codepoint < 0x800) {
+        out[0] = (char)(0xC0 | (codepoint >> 6));
+        out[1] = (char)(0x80 | (codepoint & 0x3F));
+        return 2;
+    } else if (codepoint < 0x10000) {
+        out[0] = (char)(0xE0 | (codepoint >> 12));
+        out[1] = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (codepoint & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (codepoint >> 18));
+    out[1] = (char)(0x80 | ((codepoint >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (codepoint & 0x3F));
+    return 4;
+}
+
+//
+// Parse the four hex digits of a \u escape.
+//
+static bool parse_hex4(json_parser_t *p, uint32_t *codepoint)
+{
+    if (p->end - p->pos < 4) return fail(p, "Unfinished \\u escape");
+    *codepoint = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = *(p->pos++);
+        if (!isxdigit(c)) return fail(p, "Invalid \\u escape");
+        *codepoint = (*codepoint << 4) | (uint32_t)(isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+    }
+    return true;
+}
+
+//
+// Parse a string (starting at its opening quote) and return its decoded text.
+// The decoded string is never longer than its source text.
+//
+static char *parse_string(json_parser_t *p, size_t *len)
+{
+    ++p->pos; // opening quote
+    const char *close = p->pos;
+    while (close < p->end && *close != '"')
+        close += (*close == '\\' && close + 1 < p->end) ? 2 : 1;
+    if (close >= p->end) {
+        fail(p, "Unterminated string");
+        return NULL;
+    }
+
+    char *str = new(char[(size_t)(close - p->pos) + 1]);
+    size_t n = 0;
+    while (p->pos < close) {
+        char c = *(p->pos++);
+        if ((unsigned char)c < 0x20) {
+            fail(p, "Control character in string");
+            goto failed;
+        } else if (c != '\\') {
+            str[n++] = c;
+            continue;
+        }
+        switch (*(p->pos++)) {
+        case '"': str[n++] = '"'; break;
+        case '\\': str[n++] = '\\'; break;
+        case '/': str[n++] = '/'; break;
+        case 'b': str[n++] = '\b'; break;
+        case 'f': str[n++] = '\f'; break;
+        case 'n': str[n++] = '\n'; break;
+        case 'r': str[n++] = '\r'; break;
+        case 't': str[n++] = '\t'; break;
+        case 'u': {
+            uint32_t codepoint;
+            if (!parse_hex4(p, &codepoint)) goto failed;
+            // Characters outside of the basic plane are escaped as a pair of
+            // UTF-16 surrogates:
+            if (codepoint >= 0xD800 && codepoint < 0xDC00 && close - p->pos >= 6
+                && p->pos[0] == '\\' && p->pos[1] == 'u') {
+                const char *second = p->pos;
+                p->pos += 2;
+                uint32_t low;
+                if (!parse_hex4(p, &low)) goto failed;
+                if (low >= 0xDC00 && low < 0xE000)
+                    codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+                else
+                    p->pos = second;
+            }
+            n += encode_utf8(&str[n], codepoint);
+            break;
+        }
+        default: fail(p, "Invalid escape sequence in string"); goto failed;
+        }
+    }
+    ++p->pos; // closing quote
+    str[n] = '\0';
+    *len = n;
+    return str;
+
+  failed:
+    delete(&str);
+    return NULL;
+}
+
+//
+// Parse the items of an array or object (starting at its opening bracket).
+//
+static bool parse_items(json_parser_t *p, json_t *json, char close, int depth)
+{
+    if (depth >= MAX_JSON_DEPTH) return fail(p, "Too deeply nested");
+    ++p->pos;
+    skip_whitespace(p);
+    if (p->pos < p->end && *p->pos == close) {
+        ++p->pos;
+        return true;
+    }
+    size_t capacity = 0;
+    for (;;) {
+        if (json->nitems >= capacity)
+            json->items = grow(json->items, capacity = (capacity == 0 ? 8 : 2*capacity));
+        json_t *item = &json->items[json->nitems++];
+        *item = (json_t){0};
+
+        skip_whitespace(p);
+        if (close == '}') {
+            if (p->pos >= p->end || *p->pos != '"') return fail(p, "Expected a key");
+            size_t keylen;
+            item->key = parse_string(p, &keylen);
+            if (!item->key) return false;
+            skip_whitespace(p);
+            if (p->pos >= p->end || *p->pos != ':') return fail(p, "Expected ':' after key");
+            ++p->pos;
+        }
+        if (!parse_value(p, item, depth + 1)) return false;
+
+        skip_whitespace(p);
+        if (p->pos < p->end && *p->pos == ',') {
+            ++p->pos;
+        } else if (p->pos < p->end && *p->pos == close) {
+            ++p->pos;
+            return true;
+        } else {
+            return fail(p, close == '}' ? "Expected ',' or '}'" : "Expected ',' or ']'");
+        }
+    }
+}
+
+static bool parse_value(json_parser_t *p, json_t *json, int depth)
+{
+    skip_whitespace(p);
+    if (p->pos >= p->end) return fail(p, "Expected a value");
+    json->start = p->pos;
+    bool ok = true;
+    switch (*p->pos) {
+    case '{': json->type = JSON_OBJECT; ok = parse_items(p, json, '}', depth); break;
+    case '[': json->type = JSON_ARRAY; ok = parse_items(p, json, ']', depth); break;
+    case '"':
+        json->type = JSON_STRING;
+        json->string = parse_string(p, &json->len);
+        ok = json->string != NULL;
+        break;
+    case 't': case 'f': case 'n': {
+        static const struct { const char *word; json_type_t type; } words[] = {
+            {"true", JSON_TRUE}, {"false", JSON_FALSE}, {"null", JSON_NULL},
+        };
+        ok = false;
+        for (size_t i = 0; i < sizeof(words)/sizeof(words[0]); i++) {
+            size_t len = strlen(words[i].word);
+            if ((size_t)(p->end - p->pos) >= len && strncmp(p->pos, words[i].word, len) == 0) {
+                json->type = words[i].type;
+                p->pos += len;
+                ok = true;
+                break;
+            }
+        }
+        if (!ok) fail(p, "Invalid value");
+        break;
+    }
+    default: {
+        const char *q = p->pos;
+        if (q < p->end && *q == '-') ++q;
+        if (q >= p->end || !isdigit(*q)) return fail(p, "Invalid value");
+        while (q < p->end && (isdigit(*q) || *q == '.' || *q == 'e' || *q == 'E' || *q == '+' || *q == '-'))
+            ++q;
+        json->type = JSON_NUMBER;
+        p->pos = q;
+        break;
+    }
+    }
+    json->end = p->pos;
+    return ok;
+}
+
+//
+// Parse a JSON value (surrounded by nothing but whitespace). If the text isn't
+// valid JSON, NULL is returned and `error` is set to a message.
+//
+public json_t *parse_json(const char *str, const char *end, const char **error)
+{
+    json_parser_t p = {.pos = str, .end = end};
+    json_t *json = new(json_t);
+    if (parse_value(&p, json, 0)) {
+        skip_whitespace(&p);
+        if (p.pos < p.end) fail(&p, "Unexpected text after the value");
+    }
+    if (p.error) {
+        if (error) *error = p.error;
+        destroy_json(&json);
+        return NULL;
+    }
+    return json;
+}
+
+static void free_json_contents(json_t *json)
+{
+    for (size_t i = 0; i < json->nitems; i++)
+        free_json_contents(&json->items[i]);
+    if (json->items) delete(&json->items);
+    if (json->string) delete(&json->string);
+    if (json->key) delete(&json->key);
+}
+
+//
+// Free a parsed JSON value and everything inside of it, then set the input
+// pointer to NULL.
+//
+public void destroy_json(json_t **at_json)
+{
+    free_json_contents(*at_json);
+    delete(at_json);
+}
+
+//
+// Return the value for a key in an object (or NULL if it's not an object or
+// doesn't have the key).
+//
+public json_t *json_get(json_t *obj, const char *key)
+{
+    if (!obj || obj->type != JSON_OBJECT) return NULL;
+    for (size_t i = 0; i < obj->nitems; i++)
+        if (obj->items[i].key && streq(obj->items[i].key, key))
+            return &obj->items[i];
+    return NULL;
+}
+
+//
+// Print a string as a quoted JSON string.
+//
+public void fprint_json_string(FILE *out, const char *str, size_t len)
+{
+    fputc('"', out);
+    const char *run = str;
+    for (const char *p = str; p < &str[len]; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        if (p > run) fwrite(run, sizeof(char), (size_t)(p - run), out);
+        run = p + 1;
+        switch (c) {
+        case '"': fputs("\\\"", out); break;
+        case '\\': fputs("\\\\", out); break;
+        case '\n': fputs("\\n", out); break;
+        case '\r': fputs("\\r", out); break;
+        case '\t': fputs("\\t", out); break;
+        default: fprintf(out, "\\u%04x", c); break;
+        }
+    }
+    if (&str[len] > run) fwrite(run, sizeof(char), (size_t)(&str[len] - run), out);
+    fputc('"', out);
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -0,0 +1,36 @@
+//
+// json.h - Definitions of a small API for reading and writing JSON.
+//
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef enum {
+    JSON_NULL, JSON_FALSE, JSON_TRUE, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT,
+} json_type_t;
+
+typedef struct json_s {
+    json_type_t type;
+    // Where the value is in the text it was parsed from
+    const char *start, *end;
+    // For strings, the decoded (NUL-terminated) string
+    char *string;
+    size_t len;
+    // For arrays and objects, the items (an object's items have keys)
+    struct json_s *items;
+    size_t nitems;
+    char *key;
+} json_t;
+
+__attribute__((nonnull(1,2)))
+json_t *parse_json(const char *str, const char *end, const char **error);
+__attribute__((nonnull))
+void destroy_json(json_t **at_json);
+__attribute__((nonnull(2)))
+json_t *json_get(json_t *obj, const char *key);
+__attribute__((nonnull))
+void fprint_json_string(FILE *out, const char *str, size_t len);
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -7,14 +7,18 @@
 #include <limits.h>
 #include <setjmp.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "match.h"
 #include "pattern.h"
+#include "scan.h"
 #include "utils.h"
 #include "utf8.h"
+#include "vm.h"
 
 #define MAX_CACHE_SIZE (1<<14)
 
@@ -22,109 +26,328 @@
 typedef struct cache_entry_s {
     bp_pat_t *pat;
     const char *start;
+    // The successful match (in packrat mode), or NULL for a failure
+    bp_match_t *match;
     // Cache entries use a chained scatter approach modeled after Lua's tables
     struct cache_entry_s *next_probe;
+    // Entries from older generations are treated as empty
+    unsigned int generation;
 } cache_entry_t;
 
-// Cache uses a hash table to store places where matches will always fail
+// Cache uses a hash table to store places where matches will always fail (or
+// in packrat mode, what they will match)
 typedef struct {
-    unsigned int size, occupancy, next_free;
-    cache_entry_t *fails;
+    unsigned int size, occupancy, next_free, generation;
+    cache_entry_t *entries;
 } cache_t;
 
+#define ARENA_BLOCK_SIZE (1<<16)
+
+// A block of memory that match objects are allocated from
+typedef struct arena_block_s {
+    struct arena_block_s *next;
+    size_t capacity;
+    char memory[];
+} arena_block_t;
+
+// A position in an arena. Resetting the arena to a previously saved position
+// frees everything that was allocated after that point.
+typedef struct {
+    arena_block_t *block;
+    size_t used, total, nmatches;
+} arena_mark_t;
+
+// Match objects are bump-allocated from a chain of blocks. Blocks are never
+// freed until the matcher is destroyed, just reused after the arena is reset.
+// Matches stored in the packrat cache must outlive the match attempt that
+// created them, so the arena is never reset to below the `pinned` mark
+// (except when the cache is cleared).
+typedef struct {
+    arena_block_t *first;
+    arena_mark_t top, pinned;
+} arena_t;
+
+#define MAX_PREFILTERS 8
+#define MAX_PREFILTER_LITERALS 256
+
+// A scanner for the string literals that every match of a top-level search
+// pattern must start with, and the pattern's compiled program. Patterns and
+// definitions are identified by their IDs, since pointers to freed patterns
+// may be reused.
+typedef struct prefilter_s {
+    struct prefilter_s *next;
+    uint32_t pat_id, defs_id;
+    bool ignorecase, tried_compiling;
+    // NULL if the pattern doesn't start with a small set of string literals
+    literal_scanner_t *scanner;
+    // NULL if the pattern can't be compiled (or hasn't been yet)
+    bp_program_t *program;
+} prefilter_t;
+
+// How to search for a pattern, which is worked out once for a search and then
+// used for finding each match
+typedef struct {
+    // What every match has to start with (see get_prerequisite())
+    bp_pat_t *first;
+    literal_scanner_t *scanner;
+    bp_program_t *program;
+    // Only the top-level search can clear out the packrat cache between
+    // attempts, since nested searches are inside of matches that are in use
+    bool can_evict;
+} search_plan_t;
+
+// A rule definition that's in scope, along with the definition of the same
+// name that it shadows (if any), which is restored when it goes out of scope.
+typedef struct {
+    uint32_t name_id;
+    bp_pat_t *meaning, *shadowed;
+} binding_t;
+
+// A matcher holds all of the state that persists between calls to
+// bp_next_match(), so separate threads can match concurrently by using
+// separate matchers.
+struct bp_matcher_s {
+    // Match objects are allocated from the arena. Since matching never
+    // modifies a match after creating it, a failed match attempt (along with
+    // all of its submatches) can be released by resetting the arena to where
+    // it was before the attempt, and all the matches for a search can be
+    // released at once by resetting the arena to empty.
+    arena_t arena;
+    // Matches with an unknown number of children (e.g. repetitions) collect
+    // their children on this stack and copy them into the match object once
+    // all of them have been found:
+    struct {
+        bp_match_t **items;
+        size_t len, capacity;
+    } child_stack;
+    cache_t cache;
+    // In packrat mode (packrat_limit > 0), successful matches are cached too,
+    // and the cache is kept for the whole search until it uses more than
+    // packrat_limit bytes of memory, at which point it is cleared.
+    size_t packrat_limit;
+    bp_packrat_stats_t stats;
+    // Most recently used first:
+    prefilter_t *prefilters;
+    // Rules are looked up by the interned IDs of their names: `slots[id]` is
+    // the innermost definition of the name that's in scope. Entering a scope
+    // pushes its bindings onto `bindings`, and leaving it pops them. While a
+    // left recursion fallback is matched in an outer context, the bindings
+    // that aren't in scope there are moved to `saved`. The search's top-level
+    // definitions (identified by `defs_id`) stay bound between searches.
+    struct {
+        bp_pat_t **slots;
+        size_t nslots;
+        struct {
+            binding_t *items;
+            size_t len, capacity;
+        } bindings, saved;
+        uint32_t defs_id;
+    } rules;
+    // When full match trees aren't needed, top-level patterns can be matched
+    // with compiled programs. Each search of new text gets a new ID.
+    bool partial_trees;
+    uint32_t search_id;
+    // How many steps (pattern matching attempts) the current search has
+    // taken, and how many it may take (or 0 for no limit). Each search of new
+    // text gets a fresh budget.
+    size_t steps, step_limit;
+    // When profiling, `profile.rules[id]` holds the counts for the rule whose
+    // name has the interned ID `id`, and `profile.depth[id]` is how many
+    // matches of that rule are in progress, so the time spent in recursive
+    // matches of a rule is only counted once.
+    struct {
+        bool enabled;
+        bp_rule_profile_t *rules;
+        unsigned int *depth;
+        size_t nrules;
+    } profile;
+    char *error_message;
+    bp_error_t error_code;
+    bp_errhand_t error_handler;
+};
+
 // Data structure for holding ambient state values during matching
 typedef struct match_ctx_s {
-    struct match_ctx_s *parent_ctx;
+    bp_matcher_t *matcher;
+    // The search's top-level definitions
     bp_pat_t *defs;
+    // The number of rule bindings that are in scope
+    size_t bindings;
     cache_t *cache;
     const char *start, *end;
+    // The position where the innermost left recursion check is active.
+    // Matches at this position may depend on the left recursion's progress,
+    // so they shouldn't be memoized.
+    const char *leftrec_at;
     jmp_buf error_jump;
     bool ignorecase;
 } match_ctx_t;
 
-// New match objects are either recycled from unused match objects or allocated
-// from the heap. While it is in use, the match object is stored in the
-// `in_use_matches` linked list. Once it is no longer needed, it is moved to
-// the `unused_matches` linked list so it can be reused without the need for
-// additional calls to malloc/free. Thus, it is an invariant that every match
-// object is in one of these two lists:
-static bp_match_t *unused_matches = NULL;
-static bp_match_t *in_use_matches = NULL;
-
 static void default_error_handler(char **msg) {
     errx(EXIT_FAILURE, "%s", *msg);
 }
 
-static bp_errhand_t error_handler = default_error_handler;
+// Each thread has its own matcher, which is used by next_match() and the
+// other functions that don't take an explicit matcher argument:
+static _Thread_local bp_matcher_t default_matcher = {.error_handler = default_error_handler};
 
 public bp_errhand_t bp_set_error_handler(bp_errhand_t new_handler)
 {
-    bp_errhand_t old_handler = error_handler;
-    error_handler = new_handler;
-    return old_handler;
+    return bp_matcher_set_error_handler(&default_matcher, new_handler);
 }
 
 #define MATCHES(...) (bp_match_t*[]){__VA_ARGS__, NULL}
+#define IN_BYTESET(bits, c) (((bits)[(unsigned char)(c) >> 6] >> ((unsigned char)(c) & 63)) & 1)
 
 __attribute__((hot, nonnull(1,2,3)))
 static bp_match_t *match(match_ctx_t *ctx, const char *str, bp_pat_t *pat);
-__attribute__((returns_nonnull))
-static bp_match_t *new_match(bp_pat_t *pat, const char *start, const char *end, bp_match_t *children[]);
-
-char *error_message = NULL;
+__attribute__((hot, nonnull))
+static bp_match_t *_match(match_ctx_t *ctx, const char *str, bp_pat_t *pat);
+__attribute__((nonnull))
+static bp_match_t *match_ref_profiled(match_ctx_t *ctx, const char *str, bp_pat_t *pat);
+__attribute__((nonnull(1,2), returns_nonnull))
+static bp_match_t *new_match(bp_matcher_t *matcher, bp_pat_t *pat, const char *start, const char *end, bp_match_t *children[]);
+__attribute__((nonnull))
+static void limit_packrat_memory(bp_matcher_t *matcher);
 
-__attribute__((format(printf,2,3)))
-static inline void match_error(match_ctx_t *ctx, const char *fmt, ...)
+__attribute__((format(printf,3,4)))
+static inline void match_error(match_ctx_t *ctx, bp_error_t code, const char *fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
-    if (error_message) free(error_message);
-    vasprintf(&error_message, fmt, args);
+    bp_matcher_t *matcher = ctx->matcher;
+    if (matcher->error_message) free(matcher->error_message);
+    vasprintf(&matcher->error_message, fmt, args);
+    matcher->error_code = code;
     va_end(args);
     longjmp(ctx->error_jump, 1);
 }
 
-static bp_match_t *clone_match(bp_match_t *m)
+//
+// Stop matching because the search has used up its step budget.
+//
+__attribute__((noreturn))
+static void out_of_steps(match_ctx_t *ctx)
+{
+    match_error(ctx, BP_STEP_LIMIT_ERROR, "Matching took more than the limit of %zu steps", ctx->matcher->step_limit);
+    __builtin_unreachable();
+}
+
+//
+// Allocate memory from the arena, adding a new block if there isn't enough
+// space left in the current one.
+//
+__attribute__((nonnull, returns_nonnull))
+static void *arena_alloc(arena_t *arena, size_t size)
 {
-    if (!m) return NULL;
-    bp_match_t *ret = new_match(m->pat, m->start, m->end, NULL);
-    if (m->children) {
-        size_t child_cap = 0, nchildren = 0;
-        if (!m->children[0] || !m->children[1] || !m->children[2]) {
-            child_cap = 3;
-            ret->children = ret->_children;
-        }
-        for (int i = 0; m->children[i]; i++) {
-            if (nchildren+1 >= child_cap) {
-                ret->children = grow(ret->children, child_cap += 5);
-                for (size_t j = nchildren; j < child_cap; j++) ret->children[j] = NULL;
-            }
-            ret->children[nchildren++] = clone_match(m->children[i]);
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    arena_block_t *block = arena->top.block;
+    if (!block || arena->top.used + size > block->capacity) {
+        arena_block_t **next = block ? &block->next : &arena->first;
+        if (!*next || (*next)->capacity < size) {
+            size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+            arena_block_t *fresh = require(malloc(sizeof(arena_block_t) + capacity), "Failed to allocate memory for matches");
+            fresh->capacity = capacity;
+            fresh->next = *next;
+            *next = fresh;
         }
+        arena->top.block = *next;
+        arena->top.used = 0;
     }
-    return ret;
+    void *mem = &arena->top.block->memory[arena->top.used];
+    arena->top.used += size;
+    arena->top.total += size;
+    return mem;
+}
+
+//
+// Release all of the match objects created after the given mark, except for
+// any that need to be kept for the packrat cache.
+//
+__attribute__((nonnull))
+static inline void release_matches(bp_matcher_t *matcher, arena_mark_t mark)
+{
+    matcher->arena.top = mark.total >= matcher->arena.pinned.total ? mark : matcher->arena.pinned;
+}
+
+//
+// Free all of the memory blocks in an arena.
+//
+__attribute__((nonnull))
+static void arena_free(arena_t *arena)
+{
+    for (arena_block_t *block = arena->first, *next; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    *arena = (arena_t){0};
+}
+
+//
+// Push a match onto the matcher's stack of children for a match that is
+// still being built.
+//
+__attribute__((nonnull(1)))
+static inline void push_child(bp_matcher_t *matcher, bp_match_t *child)
+{
+    if (matcher->child_stack.len >= matcher->child_stack.capacity) {
+        matcher->child_stack.capacity = matcher->child_stack.capacity ? 2*matcher->child_stack.capacity : 64;
+        matcher->child_stack.items = grow(matcher->child_stack.items, matcher->child_stack.capacity);
+    }
+    matcher->child_stack.items[matcher->child_stack.len++] = child;
+}
+
+//
+// Create a new match whose children are everything that has been pushed onto
+// the child stack above `base`, and pop those children off the stack.
+//
+__attribute__((nonnull(1,2), returns_nonnull))
+static bp_match_t *new_match_from_stack(bp_matcher_t *matcher, bp_pat_t *pat, const char *start, const char *end, size_t base)
+{
+    bp_match_t *m;
+    if (matcher->child_stack.len > base) {
+        push_child(matcher, NULL);
+        m = new_match(matcher, pat, start, end, &matcher->child_stack.items[base]);
+    } else {
+        m = new_match(matcher, pat, start, end, NULL);
+    }
+    matcher->child_stack.len = base;
+    return m;
 }
 
-// Prepend to a doubly linked list
-static inline void gc_list_prepend(bp_match_t **head, bp_match_t *m)
+//
+// Create a pattern that matches a copy of the given text exactly. It's
+// allocated from the arena, so it's released along with the matches that
+// refer to it.
+//
+__attribute__((nonnull, returns_nonnull))
+static bp_pat_t *new_backref(bp_matcher_t *matcher, const char *str, size_t len)
 {
-    if (m->gc.home)
-        errx(1, "Node already has a home");
-    m->gc.home = head;
-    m->gc.next = *head;
-    if (*head) (*head)->gc.home = &m->gc.next;
-    *head = m;
+    bp_pat_t *backref = arena_alloc(&matcher->arena, sizeof(bp_pat_t) + len + 1);
+    char *text = (char*)&backref[1];
+    memcpy(text, str, len);
+    text[len] = '\0';
+    *backref = (bp_pat_t){
+        .type = BP_STRING,
+        .start = str, .end = &str[len],
+        .min_matchlen = (uint32_t)len, .max_matchlen = (int32_t)len,
+        .__tagged.BP_STRING.string = text,
+    };
+    return backref;
 }
 
-// Remove from a doubly linked list
-static inline void gc_list_remove(bp_match_t *m)
+static bp_match_t *clone_match(bp_matcher_t *matcher, bp_match_t *m)
 {
-    if (!m->gc.home)
-        errx(1, "Attempt to remove something that isn't in a list");
-    *m->gc.home = m->gc.next;
-    if (m->gc.next) m->gc.next->gc.home = m->gc.home;
-    m->gc.home = NULL;
-    m->gc.next = NULL;
+    if (!m) return NULL;
+    if (!m->children)
+        return new_match(matcher, m->pat, m->start, m->end, NULL);
+    size_t base = matcher->child_stack.len;
+    for (int i = 0; m->children[i]; i++)
+        push_child(matcher, clone_match(matcher, m->children[i]));
+    push_child(matcher, NULL);
+    bp_match_t *ret = new_match(matcher, m->pat, m->start, m->end, &matcher->child_stack.items[base]);
+    matcher->child_stack.len = base;
+    return ret;
 }
 
 //
@@ -136,77 +359,87 @@ static inline size_t hash(const char *str, size_t pat_id)
 }
 
 //
-// Check if we have cached a failure to match a given pattern at the given position.
+// Look up the cached result of matching a given pattern at the given position.
+// Returns NULL if there is no cache entry.
 //
-static bool has_cached_failure(match_ctx_t *ctx, const char *str, bp_pat_t *pat)
+static cache_entry_t *cache_lookup(cache_t *cache, const char *str, bp_pat_t *pat)
 {
-    if (!ctx->cache->fails) return false;
-    for (cache_entry_t *fail = &ctx->cache->fails[hash(str, pat->id) & (ctx->cache->size-1)]; fail; fail = fail->next_probe) {
-        if (fail->pat == pat && fail->start == str)
-            return true;
+    if (!cache->entries) return NULL;
+    cache_entry_t *entry = &cache->entries[hash(str, pat->id) & (cache->size-1)];
+    if (entry->generation != cache->generation) return NULL;
+    for (; entry; entry = entry->next_probe) {
+        if (entry->pat == pat && entry->start == str)
+            return entry;
     }
-    return false;
+    return NULL;
+}
+
+//
+// Check whether a cache slot is unused (or only holds stale entries).
+//
+static inline bool is_free_slot(cache_t *cache, cache_entry_t *entry)
+{
+    return entry->pat == NULL || entry->generation != cache->generation;
 }
 
 //
 // Insert into the hash table using a chained scatter table approach.
 //
-static void _hash_insert(cache_t *cache, const char *str, bp_pat_t *pat)
+static void _hash_insert(cache_t *cache, const char *str, bp_pat_t *pat, bp_match_t *m)
 {
     size_t h = hash(str, pat->id) & (cache->size-1);
-    if (cache->fails[h].pat == NULL) { // No collision
-        cache->fails[h].pat = pat;
-        cache->fails[h].start = str;
-        cache->fails[h].next_probe = NULL;
+    if (is_free_slot(cache, &cache->entries[h])) { // No collision
+        cache->entries[h] = (cache_entry_t){.pat = pat, .start = str, .match = m, .generation = cache->generation};
         ++cache->occupancy;
         return;
     }
 
-    if (cache->fails[h].pat == pat && cache->fails[h].start == str)
+    if (cache->entries[h].pat == pat && cache->entries[h].start == str)
         return; // Duplicate entry, just leave it be
 
     // Shuffle the colliding entry along to a free space:
-    while (cache->fails[cache->next_free].pat) ++cache->next_free;
-    cache_entry_t *free_slot = &cache->fails[cache->next_free];
-    *free_slot = cache->fails[h];
+    while (!is_free_slot(cache, &cache->entries[cache->next_free])) ++cache->next_free;
+    cache_entry_t *free_slot = &cache->entries[cache->next_free];
+    *free_slot = cache->entries[h];
     size_t h_orig = hash(free_slot->start, free_slot->pat->id) & (cache->size-1);
 
     // Put the new entry in its desired slot
-    cache->fails[h].pat = pat;
-    cache->fails[h].start = str;
-    cache->fails[h].next_probe = h_orig == h ? free_slot : NULL;
+    cache->entries[h] = (cache_entry_t){
+        .pat = pat, .start = str, .match = m, .next_probe = h_orig == h ? free_slot : NULL, .generation = cache->generation,
+    };
     ++cache->occupancy;
 
     if (h_orig != h) { // Maintain the chain that points to the colliding entry
-        cache_entry_t *prev = &cache->fails[h_orig]; // Start of the chain
-        while (prev->next_probe != &cache->fails[h]) prev = prev->next_probe;
+        cache_entry_t *prev = &cache->entries[h_orig]; // Start of the chain
+        while (prev->next_probe != &cache->entries[h]) prev = prev->next_probe;
         prev->next_probe = free_slot;
     }
 }
 
 //
-// Save a match in the cache.
+// Save a match result in the cache (a NULL match means failure).
 //
-static void cache_failure(match_ctx_t *ctx, const char *str, bp_pat_t *pat)
+static void cache_result(match_ctx_t *ctx, const char *str, bp_pat_t *pat, bp_match_t *m)
 {
     cache_t *cache = ctx->cache;
     // Grow the hash if needed (>99% utilization):
     if (cache->occupancy+1 > (cache->size*99)/100) {
-        cache_entry_t *old_fails = cache->fails;
+        cache_entry_t *old_entries = cache->entries;
         size_t old_size = cache->size;
         cache->size = old_size == 0 ? 16 : 2*old_size;
-        cache->fails = new(cache_entry_t[cache->size]);
+        cache->entries = new(cache_entry_t[cache->size]);
         cache->next_free = 0;
 
         // Rehash:
+        cache->occupancy = 0;
         for (size_t i = 0; i < old_size; i++) {
-            if (old_fails[i].pat)
-                _hash_insert(cache, old_fails[i].start, old_fails[i].pat);
+            if (!is_free_slot(cache, &old_entries[i]))
+                _hash_insert(cache, old_entries[i].start, old_entries[i].pat, old_entries[i].match);
         }
-        if (old_fails) delete(&old_fails);
+        if (old_entries) delete(&old_entries);
     }
 
-    _hash_insert(cache, str, pat);
+    _hash_insert(cache, str, pat, m);
 }
 
 //
@@ -215,46 +448,105 @@ static void cache_failure(match_ctx_t *ctx, const char *str, bp_pat_t *pat)
 void cache_destroy(match_ctx_t *ctx)
 {
     cache_t *cache = ctx->cache;
-    if (cache->fails) delete(&cache->fails);
+    if (cache->entries) delete(&cache->entries);
     memset(cache, 0, sizeof(cache_t));
 }
 
 //
-// Look up a pattern definition by name from a definition pattern.
+// Clear the cache, but keep its memory around for reuse. Bumping the
+// generation number invalidates all existing entries without touching them.
+//
+static void cache_clear(cache_t *cache)
+{
+    if (++cache->generation == 0) { // Wrapped around, so old entries could look valid
+        if (cache->entries) memset(cache->entries, 0, sizeof(cache_entry_t)*cache->size);
+        cache->generation = 1;
+    }
+    cache->occupancy = 0;
+    cache->next_free = 0;
+}
+
+//
+// Make a rule definition visible (shadowing any definition of the same name)
+// until the bindings are unwound.
+//
+__attribute__((nonnull(1)))
+static void bind_rule(bp_matcher_t *matcher, uint32_t name_id, bp_pat_t *meaning)
+{
+    if (name_id >= matcher->rules.nslots) {
+        size_t nslots = matcher->rules.nslots ? matcher->rules.nslots : 64;
+        while (nslots <= name_id) nslots *= 2;
+        matcher->rules.slots = grow(matcher->rules.slots, nslots);
+        memset(&matcher->rules.slots[matcher->rules.nslots], 0, sizeof(bp_pat_t*[nslots - matcher->rules.nslots]));
+        matcher->rules.nslots = nslots;
+    }
+    auto bindings = &matcher->rules.bindings;
+    if (bindings->len >= bindings->capacity)
+        bindings->items = grow(bindings->items, bindings->capacity = bindings->capacity ? bindings->capacity*2 : 256);
+    bindings->items[bindings->len++] = (binding_t){name_id, meaning, matcher->rules.slots[name_id]};
+    matcher->rules.slots[name_id] = meaning;
+}
+
+//
+// Bind all of the rules from a definition pattern. Later bindings shadow
+// earlier ones, so the definitions that take priority are bound last.
 //
-__attribute__((nonnull(2)))
-static bp_pat_t *_lookup_def(match_ctx_t *ctx, bp_pat_t *defs, const char *name, size_t namelen)
+__attribute__((nonnull(1)))
+static void bind_defs(match_ctx_t *ctx, bp_pat_t *defs)
 {
     while (defs) {
         if (defs->type == BP_CHAIN) {
             auto chain = When(defs, BP_CHAIN);
-            bp_pat_t *second = _lookup_def(ctx, chain->second, name, namelen);
-            if (second) return second;
-            defs = chain->first;
+            bind_defs(ctx, chain->first);
+            defs = chain->second;
         } else if (defs->type == BP_DEFINITIONS) {
             auto def = When(defs, BP_DEFINITIONS);
-            if (namelen == def->namelen && strncmp(def->name, name, namelen) == 0)
-                return def->meaning;
-            defs = def->next_def;
+            bind_defs(ctx, def->next_def);
+            bind_rule(ctx->matcher, def->name_id, def->meaning);
+            return;
         } else {
-            match_error(ctx, "Invalid pattern type in definitions");
-            return NULL;
+            match_error(ctx, BP_PATTERN_ERROR, "Invalid pattern type in definitions");
         }
     }
-    return NULL;
 }
 
 //
-// Look up a pattern definition by name from a context.
+// Pop rule bindings until only `height` of them are left.
 //
 __attribute__((nonnull))
-bp_pat_t *lookup_ctx(match_ctx_t *ctx, const char *name, size_t namelen)
+static inline void unbind_rules(bp_matcher_t *matcher, size_t height)
 {
-    for (; ctx; ctx = ctx->parent_ctx) {
-        bp_pat_t *def = _lookup_def(ctx, ctx->defs, name, namelen);
-        if (def) return def;
+    auto bindings = &matcher->rules.bindings;
+    while (bindings->len > height) {
+        binding_t *b = &bindings->items[--bindings->len];
+        matcher->rules.slots[b->name_id] = b->shadowed;
     }
-    return NULL;
+}
+
+//
+// Forget all rule bindings (e.g. after an error).
+//
+__attribute__((nonnull))
+static void reset_rules(bp_matcher_t *matcher)
+{
+    if (matcher->rules.slots)
+        memset(matcher->rules.slots, 0, sizeof(bp_pat_t*[matcher->rules.nslots]));
+    matcher->rules.bindings.len = 0;
+    matcher->rules.saved.len = 0;
+    matcher->rules.defs_id = 0;
+    // None of the rules are being matched anymore either:
+    if (matcher->profile.depth)
+        memset(matcher->profile.depth, 0, sizeof(unsigned int[matcher->profile.nrules]));
+}
+
+//
+// Look up the rule definition with the given name ID that's currently in
+// scope (or NULL if there is none).
+//
+__attribute__((nonnull))
+static inline bp_pat_t *lookup_rule(bp_matcher_t *matcher, uint32_t name_id)
+{
+    return name_id < matcher->rules.nslots ? matcher->rules.slots[name_id] : NULL;
 }
 
 //
@@ -266,12 +558,26 @@ static inline bp_pat_t *deref(match_ctx_t *ctx, bp_pat_t *pat)
 {
     if (pat && pat->type == BP_REF) {
         auto ref = When(pat, BP_REF);
-        bp_pat_t *def = lookup_ctx(ctx, ref->name, ref->len);
+        bp_pat_t *def = lookup_rule(ctx->matcher, ref->name_id);
         if (def) return def;
     }
     return pat;
 }
 
+//
+// Follow references to the pattern they refer to (stopping after a few steps,
+// in case of left recursion).
+//
+static bp_pat_t *resolve_refs(match_ctx_t *ctx, bp_pat_t *pat)
+{
+    for (int i = 0; pat->type == BP_REF && i < 10; i++) {
+        bp_pat_t *def = deref(ctx, pat);
+        if (def == pat) break;
+        pat = def;
+    }
+    return pat;
+}
+
 //
 // Find and return the first and simplest pattern that will definitely have to
 // match for the whole pattern to match (if any). Ideally, this would be a
@@ -294,8 +600,17 @@ static bp_pat_t *get_prerequisite(match_ctx_t *ctx, bp_pat_t *pat)
             p = When(p, BP_TAGGED)->pat; break;
         case BP_CHAIN: {
             auto chain = When(p, BP_CHAIN);
+            bp_pat_t *head = resolve_refs(ctx, chain->first);
             // If pattern is something like (|"foo"|), then use "foo" as the first thing to scan for
-            p = chain->first->max_matchlen == 0 ? chain->second : chain->first;
+            if (head->max_matchlen == 0) {
+                p = chain->second;
+            } else if (head->type == BP_REPEAT && When(head, BP_REPEAT)->min == 0) {
+                // Something like `_ "foo"` starts with either the repeated
+                // pattern or whatever follows it:
+                return p;
+            } else {
+                p = chain->first;
+            }
             break;
         }
         case BP_MATCH:
@@ -317,62 +632,454 @@ static bp_pat_t *get_prerequisite(match_ctx_t *ctx, bp_pat_t *pat)
     return pat;
 }
 
+// A one-byte string for every byte value, so bytes from byte sets can be
+// handled the same as other string literals
+#define BYTES4(n) (char)(n), (char)((n)+1), (char)((n)+2), (char)((n)+3)
+#define BYTES16(n) BYTES4(n), BYTES4((n)+4), BYTES4((n)+8), BYTES4((n)+12)
+#define BYTES64(n) BYTES16(n), BYTES16((n)+16), BYTES16((n)+32), BYTES16((n)+48)
+static const char byte_literals[256] = {BYTES64(0), BYTES64(64), BYTES64(128), BYTES64(192)};
+#undef BYTES64
+#undef BYTES16
+#undef BYTES4
+
 //
-// Find the next match after prev (or the first match if prev is NULL)
+// Collect the string literals that a match of the given pattern must start
+// with (one of), returning false if there isn't a small set of them.
 //
-__attribute__((nonnull(1,2,3)))
-static bp_match_t *_next_match(match_ctx_t *ctx, const char *str, bp_pat_t *pat, bp_pat_t *skip)
+static bool collect_literals(match_ctx_t *ctx, bp_pat_t *pat, const char *literals[], size_t lengths[], size_t *n, int depth)
 {
-    // Clear the cache so it's not full of old cache values from different parts of the file:
-    cache_destroy(ctx);
-
     bp_pat_t *first = get_prerequisite(ctx, pat);
+    if (first->type == BP_STRING && first->min_matchlen > 0) {
+        if (*n >= MAX_PREFILTER_LITERALS) return false;
+        literals[*n] = When(first, BP_STRING)->string;
+        lengths[*n] = first->min_matchlen;
+        ++(*n);
+        return true;
+    } else if (first->type == BP_BYTESET) {
+        // Each byte can be scanned for as a one-byte literal. When ignoring
+        // case, scanning finds some extra positions for sets like `a-z, but
+        // that's fine because the full pattern is matched at each position.
+        const uint64_t *bits = ctx->ignorecase ? When(first, BP_BYTESET)->nocase_bits : When(first, BP_BYTESET)->bits;
+        for (int c = 0; c < 256; c++) {
+            if (!IN_BYTESET(bits, c)) continue;
+            if (*n >= MAX_PREFILTER_LITERALS) return false;
+            literals[*n] = &byte_literals[c];
+            lengths[*n] = 1;
+            ++(*n);
+        }
+        return true;
+    } else if (first->type == BP_ID_START || first->type == BP_ID_CONTINUE) {
+        // Identifier characters are either ASCII or start with a multi-byte
+        // UTF-8 lead byte (which might not turn out to be an identifier
+        // character, but the full pattern is matched there anyway).
+        for (int c = 0; c < 256; c++) {
+            const char *byte = &byte_literals[c];
+            bool is_id = first->type == BP_ID_START ? isidstart(byte, byte+1) : isidcontinue(byte, byte+1);
+            if (!(is_id || c >= 0xC0)) continue;
+            if (*n >= MAX_PREFILTER_LITERALS) return false;
+            literals[*n] = byte;
+            lengths[*n] = 1;
+            ++(*n);
+        }
+        return true;
+    } else if (first->type == BP_OTHERWISE && depth < 100) {
+        return collect_literals(ctx, When(first, BP_OTHERWISE)->first, literals, lengths, n, depth+1)
+            && collect_literals(ctx, When(first, BP_OTHERWISE)->second, literals, lengths, n, depth+1);
+    } else if (first->type == BP_CHAIN && depth < 100) {
+        // A chain that starts with an optional repetition (see get_prerequisite())
+        bp_pat_t *head = resolve_refs(ctx, When(first, BP_CHAIN)->first);
+        return collect_literals(ctx, When(head, BP_REPEAT)->repeat_pat, literals, lengths, n, depth+1)
+            && collect_literals(ctx, When(first, BP_CHAIN)->second, literals, lengths, n, depth+1);
+    }
+    return false;
+}
+
+//
+// Get the prefilter for a top-level search pattern, creating it (and the
+// scanner for the string literals the pattern must start with, if any) the
+// first time it's needed.
+//
+static prefilter_t *get_prefilter(match_ctx_t *ctx, bp_pat_t *pat)
+{
+    bp_matcher_t *matcher = ctx->matcher;
+    uint32_t defs_id = ctx->defs ? ctx->defs->id : 0;
+    prefilter_t **prev = &matcher->prefilters;
+    size_t count = 0;
+    for (prefilter_t *p = matcher->prefilters; p; prev = &p->next, p = p->next) {
+        if (p->pat_id == pat->id && p->defs_id == defs_id && p->ignorecase == ctx->ignorecase) {
+            // Move to front:
+            *prev = p->next;
+            p->next = matcher->prefilters;
+            matcher->prefilters = p;
+            return p;
+        }
+        if (++count >= MAX_PREFILTERS && p->next) {
+            // Evict the least recently used prefilter:
+            prefilter_t *old = p->next;
+            p->next = old->next;
+            if (old->scanner) destroy_scanner(&old->scanner);
+            if (old->program) destroy_program(&old->program);
+            delete(&old);
+        }
+    }
+
+    prefilter_t *p = new(prefilter_t);
+    p->pat_id = pat->id;
+    p->defs_id = defs_id;
+    p->ignorecase = ctx->ignorecase;
+    const char *literals[MAX_PREFILTER_LITERALS];
+    size_t lengths[MAX_PREFILTER_LITERALS];
+    size_t n = 0;
+    if (collect_literals(ctx, pat, literals, lengths, &n, 0))
+        p->scanner = new_scanner(literals, lengths, n, ctx->ignorecase);
+    p->next = matcher->prefilters;
+    matcher->prefilters = p;
+    return p;
+}
+
+//
+// Get the compiled program for a top-level search pattern (if it can be
+// compiled), compiling it the first time it's needed. Captures are only kept
+// for a top-level replacement, since that's the only place they're used.
+//
+static bp_program_t *get_program(match_ctx_t *ctx, prefilter_t *p, bp_pat_t *pat)
+{
+    if (!p->tried_compiling) {
+        p->tried_compiling = true;
+        if (pat->type == BP_REPLACE)
+            p->program = When(pat, BP_REPLACE)->pat ? compile_program(When(pat, BP_REPLACE)->pat, ctx->defs, true) : NULL;
+        else
+            p->program = compile_program(pat, ctx->defs, false);
+    }
+    return p->program;
+}
+
+//
+// Match a top-level search pattern by running its compiled program, which
+// only finds where the match ends, so the match has no children (except for
+// a replacement, which needs the match of the pattern being replaced).
+//
+static bp_match_t *match_compiled(match_ctx_t *ctx, const char *str, bp_pat_t *pat, bp_program_t *program)
+{
+    bp_matcher_t *matcher = ctx->matcher;
+    if (matcher->step_limit && ++matcher->steps > matcher->step_limit)
+        out_of_steps(ctx);
+    size_t steps_left = matcher->step_limit > matcher->steps ? matcher->step_limit - matcher->steps : 0;
+    const char *end = run_program(program, ctx->start, ctx->end, str, ctx->ignorecase, matcher->search_id,
+                                  matcher->step_limit ? &steps_left : NULL);
+    if (matcher->step_limit) {
+        matcher->steps = matcher->step_limit - steps_left;
+        if (steps_left == 0) out_of_steps(ctx);
+    }
+    if (!end) return NULL;
+    if (pat->type == BP_REPLACE) {
+        bp_match_t *replaced = new_match(ctx->matcher, When(pat, BP_REPLACE)->pat, str, end, NULL);
+        return new_match(ctx->matcher, pat, str, end, MATCHES(replaced));
+    }
+    return new_match(ctx->matcher, pat, str, end, NULL);
+}
+
+//
+// Free all of a matcher's prefilters.
+//
+static void free_prefilters(bp_matcher_t *matcher)
+{
+    for (prefilter_t *p = matcher->prefilters, *next; p; p = next) {
+        next = p->next;
+        if (p->scanner) destroy_scanner(&p->scanner);
+        if (p->program) destroy_program(&p->program);
+        delete(&p);
+    }
+    matcher->prefilters = NULL;
+}
+
+//
+// Work out how to search for a pattern. If `use_program` is true, the
+// top-level search can use the compiled version of the pattern (if any),
+// which only finds where each match starts and ends.
+//
+__attribute__((nonnull(1,2)))
+static search_plan_t plan_search(match_ctx_t *ctx, bp_pat_t *pat, bp_pat_t *skip, bool use_program)
+{
+    // Performance optimization: if every match has to start with one of a set
+    // of string literals (e.g. "foo" or `"foo"/"baz"`), then the top-level
+    // search can scan for the literals to skip past areas where we know we
+    // won't find a match.
+    bool top_level = ctx->cache == &ctx->matcher->cache;
+    prefilter_t *prefilter = top_level ? get_prefilter(ctx, pat) : NULL;
+    return (search_plan_t){
+        .first = get_prerequisite(ctx, pat),
+        .scanner = (prefilter && !skip) ? prefilter->scanner : NULL,
+        // Profiling needs to see every rule that gets matched:
+        .program = (prefilter && use_program && !ctx->matcher->profile.enabled) ? get_program(ctx, prefilter, pat) : NULL,
+        .can_evict = ctx->matcher->packrat_limit > 0 && top_level,
+    };
+}
+
+//
+// Return where to stop scanning for a string of the given length that has to
+// start before `stop` (or anywhere, if `stop` is NULL).
+//
+static inline const char *scan_end(match_ctx_t *ctx, const char *stop, size_t len)
+{
+    return (stop && stop < ctx->end && len < (size_t)(ctx->end - stop)) ? stop + len : ctx->end;
+}
+
+//
+// Find the first match at or after `str` using a search plan. If `stop` isn't
+// NULL, only matches that start before `stop` are found.
+//
+__attribute__((nonnull(1,2,3,5)))
+static bp_match_t *find_next(match_ctx_t *ctx, search_plan_t *plan, const char *str, const char *stop, bp_pat_t *pat, bp_pat_t *skip)
+{
+    bp_pat_t *first = plan->first;
+    literal_scanner_t *scanner = plan->scanner;
+    bp_program_t *program = plan->program;
+    if (stop && str >= stop) return NULL;
 
     // Don't bother looping if this can only match at the start/end:
     if (first->type == BP_START_OF_FILE)
         return match(ctx, str, pat);
     else if (first->type == BP_END_OF_FILE)
-        return match(ctx, ctx->end, pat);
-
-    // Performance optimization: if the pattern starts with a string literal,
-    // we can just rely on the highly optimized memmem() implementation to skip
-    // past areas where we know we won't find a match.
-    if (!skip && first->type == BP_STRING && first->min_matchlen > 0) {
-        char *found = ctx->ignorecase ?
-            strcasestr(str, When(first, BP_STRING)->string)
-            : memmem(str, (size_t)(ctx->end - str), When(first, BP_STRING)->string, first->min_matchlen);
+        return stop ? NULL : match(ctx, ctx->end, pat);
+
+    if (!scanner && !skip && first->type == BP_STRING && first->min_matchlen > 0) {
+        const char *end = scan_end(ctx, stop, first->min_matchlen);
+        char *found = (ctx->ignorecase ? memcasemem : memmem)(
+            str, (size_t)(end - str), When(first, BP_STRING)->string, first->min_matchlen);
         str = found ? found : ctx->end;
-    } else if (!skip && str > ctx->start && (first->type == BP_START_OF_LINE || first->type == BP_END_OF_LINE)) {
-        char *found = memchr(str, '\n', (size_t)(ctx->end - str));
+    } else if (!skip && str > ctx->start && ((first->type == BP_START_OF_LINE && str[-1] != '\n') || first->type == BP_END_OF_LINE)) {
+        // Skip ahead to the next line start/end (unless `str` is already at
+        // the start of a line, e.g. on an empty line after a zero-width match)
+        char *found = memchr(str, '\n', (size_t)(scan_end(ctx, stop, 0) - str));
         str = found ? (first->type == BP_START_OF_LINE ? found+1 : found) : ctx->end;
     }
 
+    const char *tried;
     do {
-        bp_match_t *m = match(ctx, str, pat);
+        if (stop && str >= stop) return NULL;
+        if (scanner) {
+            str = scan_literals(scanner, str, scan_end(ctx, stop, scanner_max_length(scanner)));
+            if (!str || (stop && str >= stop)) return NULL;
+        }
+        if (plan->can_evict) limit_packrat_memory(ctx->matcher);
+        tried = str;
+        bp_match_t *m = program ? match_compiled(ctx, str, pat, program) : match(ctx, str, pat);
         if (m) return m;
+        arena_mark_t mark = ctx->matcher->arena.top;
         bp_match_t *skipped = skip ? match(ctx, str, skip) : NULL;
         if (skipped) {
             str = skipped->end > str ? skipped->end : str + 1;
-            recycle_match(&skipped);
+            release_matches(ctx->matcher, mark);
         } else str = next_char(str, ctx->end);
-    } while (str < ctx->end);
+        // A line start can be at the very end of the text (after a trailing
+        // newline), so that gets tried too:
+    } while (str < ctx->end || (first->type == BP_START_OF_LINE && tried < ctx->end));
     return NULL;
 }
 
+//
+// Find the next match after prev (or the first match if prev is NULL)
+//
+__attribute__((nonnull(1,2,3)))
+static bp_match_t *_next_match(match_ctx_t *ctx, const char *str, bp_pat_t *pat, bp_pat_t *skip)
+{
+    search_plan_t plan = plan_search(ctx, pat, skip, ctx->matcher->partial_trees);
+    return find_next(ctx, &plan, str, NULL, pat, skip);
+}
+
 //
 // Attempt to match the given pattern against the input string and return a
-// match object, or NULL if no match is found.
-// The returned value should be free()'d to avoid memory leaking.
+// match object, or NULL if no match is found. If the match fails, any match
+// objects that were created while trying to match are released.
 //
 static bp_match_t *match(match_ctx_t *ctx, const char *str, bp_pat_t *pat)
+{
+    if (ctx->matcher->step_limit && ++ctx->matcher->steps > ctx->matcher->step_limit)
+        out_of_steps(ctx);
+    arena_mark_t mark = ctx->matcher->arena.top;
+    bp_match_t *m = _match(ctx, str, pat);
+    if (!m) release_matches(ctx->matcher, mark);
+    return m;
+}
+
+//
+// Match a pattern in an outer context (the context where a left recursion
+// check was set up), which means temporarily moving the rule bindings that
+// aren't in scope there out of the way.
+//
+static bp_match_t *match_in_scope(match_ctx_t *ctx, const char *str, bp_pat_t *pat)
+{
+    bp_matcher_t *matcher = ctx->matcher;
+    auto bindings = &matcher->rules.bindings;
+    auto saved = &matcher->rules.saved;
+    size_t n = bindings->len - ctx->bindings;
+    if (n == 0) return match(ctx, str, pat);
+
+    if (saved->len + n > saved->capacity) {
+        saved->capacity = saved->len + n > 2*saved->capacity ? saved->len + n : 2*saved->capacity;
+        saved->items = grow(saved->items, saved->capacity);
+    }
+    for (size_t i = bindings->len; i-- > ctx->bindings; )
+        matcher->rules.slots[bindings->items[i].name_id] = bindings->items[i].shadowed;
+    memcpy(&saved->items[saved->len], &bindings->items[ctx->bindings], sizeof(binding_t[n]));
+    saved->len += n;
+    bindings->len = ctx->bindings;
+
+    bp_match_t *m = match(ctx, str, pat);
+
+    saved->len -= n;
+    memcpy(&bindings->items[bindings->len], &saved->items[saved->len], sizeof(binding_t[n]));
+    for (size_t i = bindings->len; i < bindings->len + n; i++)
+        matcher->rules.slots[bindings->items[i].name_id] = bindings->items[i].meaning;
+    bindings->len += n;
+    return m;
+}
+
+//
+// Match a reference to a named rule. If `from_cache` isn't NULL, it's set to
+// true when the result came from the cache.
+//
+__attribute__((nonnull(1,2,3)))
+static bp_match_t *match_ref(match_ctx_t *ctx, const char *str, bp_pat_t *pat, bool *from_cache)
+{
+    bool memoize = ctx->matcher->packrat_limit > 0 && ctx->leftrec_at != str;
+    cache_entry_t *cached = cache_lookup(ctx->cache, str, pat);
+    if (cached && (!cached->match || memoize)) {
+        ++ctx->matcher->stats.hits;
+        if (from_cache) *from_cache = true;
+        return cached->match;
+    }
+    ++ctx->matcher->stats.misses;
+
+    auto ref_pat = When(pat, BP_REF);
+    bp_pat_t *ref = lookup_rule(ctx->matcher, ref_pat->name_id);
+    if (ref == NULL) {
+        match_error(ctx, BP_PATTERN_ERROR, "Unknown pattern: '%.*s'", (int)ref_pat->len, ref_pat->name);
+        return NULL;
+    }
+
+    if (ref->type == BP_LEFTRECURSION)
+        return match(ctx, str, ref);
+
+    bp_pat_t rec_op = {
+        .type = BP_LEFTRECURSION,
+        .start = ref->start, .end = ref->end,
+        .min_matchlen = 0, .max_matchlen = -1,
+        .__tagged.BP_LEFTRECURSION = {
+            .match = NULL,
+            .visited = false,
+            .at = str,
+            .fallback = pat,
+            .ctx = (void*)ctx,
+        },
+    };
+    // While the definition is being matched, the name refers to the
+    // left recursion check instead:
+    match_ctx_t ctx2 = *ctx;
+    ctx2.leftrec_at = str;
+    bind_rule(ctx->matcher, ref_pat->name_id, &rec_op);
+    ctx2.bindings = ctx->bindings + 1;
+
+    bp_match_t *m = match(&ctx2, str, ref);
+    // If left recursion was involved, keep retrying while forward progress can be made:
+    if (m && rec_op.__tagged.BP_LEFTRECURSION.visited) {
+        while (1) {
+            const char *prev = m->end;
+            rec_op.__tagged.BP_LEFTRECURSION.match = m;
+            ctx2.cache = &(cache_t){0};
+            arena_mark_t mark = ctx->matcher->arena.top;
+            bp_match_t *m2 = match(&ctx2, str, ref);
+            cache_destroy(&ctx2);
+            if (!m2) break;
+            if (m2->end <= prev) {
+                release_matches(ctx->matcher, mark);
+                break;
+            }
+            // The previous match is left in the arena until the whole
+            // search is released, since later allocations follow it.
+            m = m2;
+        }
+    }
+    unbind_rules(ctx->matcher, ctx->bindings);
+
+    if (!m) {
+        cache_result(ctx, str, pat, NULL);
+        return NULL;
+    }
+
+    // This match wrapper mainly exists for record-keeping purposes.
+    // It also helps with visualization of match results.
+    // OPTIMIZE: remove this if necessary
+    bp_match_t *ret = new_match(ctx->matcher, pat, m->start, m->end, MATCHES(m));
+    if (memoize) {
+        cache_result(ctx, str, pat, ret);
+        ctx->matcher->arena.pinned = ctx->matcher->arena.top;
+    }
+    return ret;
+}
+
+//
+// Match a reference to a named rule while keeping count of how many times the
+// rule was matched, how often it failed or came from the cache, how much text
+// it matched, and how long it took.
+//
+__attribute__((nonnull))
+static bp_match_t *match_ref_profiled(match_ctx_t *ctx, const char *str, bp_pat_t *pat)
+{
+    auto profile = &ctx->matcher->profile;
+    auto ref_pat = When(pat, BP_REF);
+    uint32_t id = ref_pat->name_id;
+    if (id >= profile->nrules) {
+        size_t nrules = profile->nrules ? profile->nrules : 64;
+        while (nrules <= id) nrules *= 2;
+        profile->rules = grow(profile->rules, nrules);
+        profile->depth = grow(profile->depth, nrules);
+        memset(&profile->rules[profile->nrules], 0, sizeof(bp_rule_profile_t[nrules - profile->nrules]));
+        memset(&profile->depth[profile->nrules], 0, sizeof(unsigned int[nrules - profile->nrules]));
+        profile->nrules = nrules;
+    }
+    bp_rule_profile_t *rule = &profile->rules[id];
+    if (!rule->name) {
+        // Names are copied, since the pattern's source text may be freed
+        // before the profile is used:
+        rule->name = require(strndup(ref_pat->name, ref_pat->len), "`strndup()` allocation failure");
+        rule->namelen = ref_pat->len;
+    }
+
+    struct timespec started;
+    bool outermost = profile->depth[id]++ == 0;
+    if (outermost) clock_gettime(CLOCK_MONOTONIC, &started);
+    bool from_cache = false;
+    bp_match_t *m = match_ref(ctx, str, pat, &from_cache);
+    // The rule table may have moved if other rules were profiled meanwhile:
+    rule = &profile->rules[id];
+    --profile->depth[id];
+    if (outermost) {
+        struct timespec finished;
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        rule->seconds += (double)(finished.tv_sec - started.tv_sec) + 1e-9*(double)(finished.tv_nsec - started.tv_nsec);
+    }
+    ++rule->calls;
+    if (from_cache) ++rule->cache_hits;
+    if (m) rule->bytes += (size_t)(m->end - m->start);
+    else ++rule->failures;
+    return m;
+}
+
+//
+// The implementation of match() for each pattern type.
+//
+static bp_match_t *_match(match_ctx_t *ctx, const char *str, bp_pat_t *pat)
 {
     switch (pat->type) {
     case BP_DEFINITIONS: {
         match_ctx_t ctx2 = *ctx;
         ctx2.cache = &(cache_t){0};
-        ctx2.parent_ctx = ctx;
-        ctx2.defs = pat;
+        bind_defs(ctx, pat);
+        ctx2.bindings = ctx->matcher->rules.bindings.len;
         bp_match_t *m = match(&ctx2, str, When(pat, BP_DEFINITIONS)->meaning);
+        unbind_rules(ctx->matcher, ctx->bindings);
         cache_destroy(&ctx2);
         return m;
     }
@@ -385,90 +1092,89 @@ static bp_match_t *match(match_ctx_t *ctx, const char *str, bp_pat_t *pat)
         auto leftrec = When(pat, BP_LEFTRECURSION);
         if (str == leftrec->at) {
             leftrec->visited = true;
-            return clone_match(leftrec->match);
+            return clone_match(ctx->matcher, leftrec->match);
         } else {
-            return match(leftrec->ctx, str, leftrec->fallback);
+            return match_in_scope(leftrec->ctx, str, leftrec->fallback);
         }
     }
     case BP_ANYCHAR: {
-        return (str < ctx->end && *str != '\n') ? new_match(pat, str, next_char(str, ctx->end), NULL) : NULL;
+        return (str < ctx->end && *str != '\n') ? new_match(ctx->matcher, pat, str, next_char(str, ctx->end), NULL) : NULL;
     }
     case BP_ID_START: {
-        return (str < ctx->end && isidstart(str, ctx->end)) ? new_match(pat, str, next_char(str, ctx->end), NULL) : NULL;
+        return (str < ctx->end && isidstart(str, ctx->end)) ? new_match(ctx->matcher, pat, str, next_char(str, ctx->end), NULL) : NULL;
     }
     case BP_ID_CONTINUE: {
-        return (str < ctx->end && isidcontinue(str, ctx->end)) ? new_match(pat, str, next_char(str, ctx->end), NULL) : NULL;
+        return (str < ctx->end && isidcontinue(str, ctx->end)) ? new_match(ctx->matcher, pat, str, next_char(str, ctx->end), NULL) : NULL;
     }
     case BP_START_OF_FILE: {
-        return (str == ctx->start) ? new_match(pat, str, str, NULL) : NULL;
+        return (str == ctx->start) ? new_match(ctx->matcher, pat, str, str, NULL) : NULL;
     }
     case BP_START_OF_LINE: {
-        return (str == ctx->start || str[-1] == '\n') ? new_match(pat, str, str, NULL) : NULL;
+        return (str == ctx->start || str[-1] == '\n') ? new_match(ctx->matcher, pat, str, str, NULL) : NULL;
     }
     case BP_END_OF_FILE: {
-        return (str == ctx->end || (str == ctx->end-1 && *str == '\n')) ? new_match(pat, str, str, NULL) : NULL;
+        return (str == ctx->end || (str == ctx->end-1 && *str == '\n')) ? new_match(ctx->matcher, pat, str, str, NULL) : NULL;
     }
     case BP_END_OF_LINE: {
-        return (str == ctx->end || *str == '\n') ? new_match(pat, str, str, NULL) : NULL;
+        return (str == ctx->end || *str == '\n') ? new_match(ctx->matcher, pat, str, str, NULL) : NULL;
     }
     case BP_WORD_BOUNDARY: {
         return (str == ctx->start || isidcontinue(str, ctx->end) != isidcontinue(prev_char(ctx->start, str), ctx->end)) ?
-            new_match(pat, str, str, NULL) : NULL;
+            new_match(ctx->matcher, pat, str, str, NULL) : NULL;
     }
     case BP_STRING: {
         if (&str[pat->min_matchlen] > ctx->end) return NULL;
-        if (pat->min_matchlen > 0 && (ctx->ignorecase ? strncasecmp : strncmp)(str, When(pat, BP_STRING)->string, pat->min_matchlen) != 0)
+        if (ctx->ignorecase ? !memcaseeq(str, When(pat, BP_STRING)->string, pat->min_matchlen)
+            : memcmp(str, When(pat, BP_STRING)->string, pat->min_matchlen) != 0)
             return NULL;
-        return new_match(pat, str, str + pat->min_matchlen, NULL);
+        return new_match(ctx->matcher, pat, str, str + pat->min_matchlen, NULL);
     }
     case BP_RANGE: {
         if (str >= ctx->end) return NULL;
         auto range = When(pat, BP_RANGE);
         if ((unsigned char)*str < range->low || (unsigned char)*str > range->high)
             return NULL;
-        return new_match(pat, str, str+1, NULL);
+        return new_match(ctx->matcher, pat, str, str+1, NULL);
+    }
+    case BP_BYTESET: {
+        if (str >= ctx->end) return NULL;
+        auto set = When(pat, BP_BYTESET);
+        if (!IN_BYTESET(ctx->ignorecase ? set->nocase_bits : set->bits, *str))
+            return NULL;
+        return new_match(ctx->matcher, pat, str, str+1, NULL);
     }
     case BP_NOT: {
-        bp_match_t *m = match(ctx, str, When(pat, BP_NOT)->pat);
-        if (m != NULL) {
-            recycle_match(&m);
+        // If the pattern matches, returning NULL releases its match:
+        if (match(ctx, str, When(pat, BP_NOT)->pat) != NULL)
             return NULL;
-        }
-        return new_match(pat, str, str, NULL);
+        return new_match(ctx->matcher, pat, str, str, NULL);
     }
     case BP_UPTO: case BP_UPTO_STRICT: {
-        bp_match_t *m = new_match(pat, str, str, NULL);
+        const char *start = str;
         bp_pat_t *target = deref(ctx, pat->type == BP_UPTO ? When(pat, BP_UPTO)->target : When(pat, BP_UPTO_STRICT)->target),
               *skip = deref(ctx, pat->type == BP_UPTO ? When(pat, BP_UPTO)->skip : When(pat, BP_UPTO_STRICT)->skip);
         if (!target && !skip) {
             while (str < ctx->end && *str != '\n') ++str;
-            m->end = str;
-            return m;
+            return new_match(ctx->matcher, pat, start, str, NULL);
         }
 
-        size_t child_cap = 0, nchildren = 0;
+        size_t base = ctx->matcher->child_stack.len;
         for (const char *prev = NULL; prev < str; ) {
             prev = str;
             if (target) {
-                bp_match_t *p = match(ctx, str, target);
-                if (p != NULL) {
-                    recycle_match(&p);
-                    m->end = str;
-                    return m;
+                arena_mark_t mark = ctx->matcher->arena.top;
+                if (match(ctx, str, target) != NULL) {
+                    release_matches(ctx->matcher, mark);
+                    return new_match_from_stack(ctx->matcher, pat, start, str, base);
                 }
             } else if (str == ctx->end || *str == '\n') {
-                m->end = str;
-                return m;
+                return new_match_from_stack(ctx->matcher, pat, start, str, base);
             }
             if (skip) {
                 bp_match_t *s = match(ctx, str, skip);
                 if (s != NULL) {
                     str = s->end;
-                    if (nchildren+2 >= child_cap) {
-                        m->children = grow(m->children, child_cap += 5);
-                        for (size_t i = nchildren; i < child_cap; i++) m->children[i] = NULL;
-                    }
-                    m->children[nchildren++] = s;
+                    push_child(ctx->matcher, s);
                     continue;
                 }
             }
@@ -478,18 +1184,29 @@ static bp_match_t *match(match_ctx_t *ctx, const char *str, bp_pat_t *pat)
             if (str < ctx->end && *str != '\n' && pat->type != BP_UPTO_STRICT)
                 str = next_char(str, ctx->end);
         }
-        recycle_match(&m);
+        ctx->matcher->child_stack.len = base;
         return NULL;
     }
     case BP_REPEAT: {
-        bp_match_t *m = new_match(pat, str, str, NULL);
+        const char *start = str;
         size_t reps = 0;
         auto repeat = When(pat, BP_REPEAT);
         bp_pat_t *repeating = deref(ctx, repeat->repeat_pat);
         bp_pat_t *sep = deref(ctx, repeat->sep);
-        size_t child_cap = 0, nchildren = 0;
+        if (repeating->type == BP_BYTESET && !sep) {
+            // Fast path: repetitions of a single byte don't need a match
+            // object for each byte
+            auto set = When(repeating, BP_BYTESET);
+            const uint64_t *bits = ctx->ignorecase ? set->nocase_bits : set->bits;
+            for (; (repeat->max == -1 || reps < (size_t)repeat->max) && str < ctx->end && IN_BYTESET(bits, *str); ++reps)
+                ++str;
+            if (reps < (size_t)repeat->min) return NULL;
+            return new_match(ctx->matcher, pat, start, str, NULL);
+        }
+        size_t base = ctx->matcher->child_stack.len;
         for (reps = 0; repeat->max == -1 || reps < (size_t)repeat->max; ++reps) {
-            const char *start = str;
+            const char *rep_start = str;
+            arena_mark_t mark = ctx->matcher->arena.top;
             // Separator
             bp_match_t *msep = NULL;
             if (sep != NULL && reps > 0) {
@@ -499,47 +1216,34 @@ static bp_match_t *match(match_ctx_t *ctx, const char *str, bp_pat_t *pat)
             }
             bp_match_t *mp = match(ctx, str, repeating);
             if (mp == NULL) {
-                str = start;
-                if (msep) recycle_match(&msep);
+                str = rep_start;
+                release_matches(ctx->matcher, mark);
                 break;
             }
-            if (mp->end == start && reps > 0) {
+            if (mp->end == rep_start && reps > 0) {
                 // Since no forward progress was made on either `repeating`
                 // or `sep` and BP does not have mutable state, it's
                 // guaranteed that no progress will be made on the next
                 // loop either. We know that this will continue to loop
                 // until reps==max, so let's just cut to the chase instead
                 // of looping infinitely.
-                if (msep) recycle_match(&msep);
-                recycle_match(&mp);
+                release_matches(ctx->matcher, mark);
                 if (repeat->max == -1)
                     reps = ~(size_t)0;
                 else
                     reps = (size_t)repeat->max;
                 break;
             }
-            if (msep) {
-                if (nchildren+2 >= child_cap) {
-                    m->children = grow(m->children, child_cap += 5);
-                    for (size_t i = nchildren; i < child_cap; i++) m->children[i] = NULL;
-                }
-                m->children[nchildren++] = msep;
-            }
-
-            if (nchildren+2 >= child_cap) {
-                m->children = grow(m->children, child_cap += 5);
-                for (size_t i = nchildren; i < child_cap; i++) m->children[i] = NULL;
-            }
-            m->children[nchildren++] = mp;
+            if (msep) push_child(ctx->matcher, msep);
+            push_child(ctx->matcher, mp);
             str = mp->end;
         }
 
         if (reps < (size_t)repeat->min) {
-            recycle_match(&m);
+            ctx->matcher->child_stack.len = base;
             return NULL;
         }
-        m->end = str;
-        return m;
+        return new_match_from_stack(ctx->matcher, pat, start, str, base);
     }
     case BP_AFTER: {
         bp_pat_t *back = deref(ctx, When(pat, BP_AFTER)->pat);
@@ -558,13 +1262,14 @@ static bp_match_t *match(match_ctx_t *ctx, const char *str, bp_pat_t *pat)
              pos = prev_char(ctx->start, pos)) {
             cache_destroy(&slice_ctx);
             slice_ctx.start = (char*)pos;
+            arena_mark_t mark = ctx->matcher->arena.top;
             bp_match_t *m = match(&slice_ctx, pos, back);
             // Match should not go past str (i.e. (<"AB" "B") should match "ABB", but not "AB")
             if (m && m->end != str)
-                recycle_match(&m);
+                release_matches(ctx->matcher, mark);
             else if (m) {
                 cache_destroy(&slice_ctx);
-                return new_match(pat, str, str, MATCHES(m));
+                return new_match(ctx->matcher, pat, str, str, MATCHES(m));
             }
             if (pos == ctx->start) break;
             // To prevent extreme performance degradation, don't keep
@@ -576,27 +1281,32 @@ static bp_match_t *match(match_ctx_t *ctx, const char *str, bp_pat_t *pat)
     }
     case BP_BEFORE: {
         bp_match_t *after = match(ctx, str, When(pat, BP_BEFORE)->pat);
-        return after ? new_match(pat, str, str, MATCHES(after)) : NULL;
+        return after ? new_match(ctx->matcher, pat, str, str, MATCHES(after)) : NULL;
     }
     case BP_CAPTURE: case BP_TAGGED: {
         bp_pat_t *to_match = pat->type == BP_CAPTURE ? When(pat, BP_CAPTURE)->pat : When(pat, BP_TAGGED)->pat;
         if (!to_match)
-            return new_match(pat, str, str, NULL);
+            return new_match(ctx->matcher, pat, str, str, NULL);
         bp_match_t *p = match(ctx, str, to_match);
-        return p ? new_match(pat, str, p->end, MATCHES(p)) : NULL;
+        return p ? new_match(ctx->matcher, pat, str, p->end, MATCHES(p)) : NULL;
     }
     case BP_OTHERWISE: {
-        bp_match_t *m = match(ctx, str, When(pat, BP_OTHERWISE)->first);
-        return m ? m : match(ctx, str, When(pat, BP_OTHERWISE)->second);
+        auto choice = When(pat, BP_OTHERWISE);
+        // Don't bother trying the first choice if it can't start here:
+        if (str < ctx->end && !IN_BYTESET(choice->first_bytes, *str))
+            return match(ctx, str, choice->second);
+        bp_match_t *m = match(ctx, str, choice->first);
+        return m ? m : match(ctx, str, choice->second);
     }
     case BP_CHAIN: {
         auto chain = When(pat, BP_CHAIN);
         if (chain->first->type == BP_DEFINITIONS) {
             match_ctx_t ctx2 = *ctx;
             ctx2.cache = &(cache_t){0};
-            ctx2.parent_ctx = ctx;
-            ctx2.defs = chain->first;
+            bind_defs(ctx, chain->first);
+            ctx2.bindings = ctx->matcher->rules.bindings.len;
             bp_match_t *m = match(&ctx2, str, chain->second);
+            unbind_rules(ctx->matcher, ctx->bindings);
             cache_destroy(&ctx2);
             return m;
         }
@@ -621,36 +1331,23 @@ static bp_match_t *match(match_ctx_t *ctx, const char *str, bp_pat_t *pat)
                     while (linestart[dents] == denter && &linestart[dents] < ctx->end)
                         ++dents;
                 }
-                backref = bp_raw_literal(linestart, dents);
+                backref = new_backref(ctx->matcher, linestart, dents);
             } else {
-                backref = bp_raw_literal(m1->start, (size_t)(m1->end - m1->start));
+                backref = new_backref(ctx->matcher, m1->start, (size_t)(m1->end - m1->start));
             }
             match_ctx_t ctx2 = *ctx;
             ctx2.cache = &(cache_t){0};
-            ctx2.parent_ctx = ctx;
-            ctx2.defs = &(bp_pat_t){
-                .type = BP_DEFINITIONS,
-                .start = m1->pat->start, .end = m1->pat->end,
-                .__tagged.BP_DEFINITIONS = {
-                    .name = When(m1->pat, BP_CAPTURE)->name,
-                    .namelen = When(m1->pat, BP_CAPTURE)->namelen,
-                    .meaning = backref,
-                },
-            };
+            bind_rule(ctx->matcher, When(m1->pat, BP_CAPTURE)->name_id, backref);
+            ctx2.bindings = ctx->bindings + 1;
             m2 = match(&ctx2, m1->end, chain->second);
-            if (!m2) // No need to keep the backref in memory if it didn't match
-                delete_pat(&backref, false);
+            unbind_rules(ctx->matcher, ctx->bindings);
             cache_destroy(&ctx2);
         } else {
             m2 = match(ctx, m1->end, chain->second);
         }
 
-        if (m2 == NULL) {
-            recycle_match(&m1);
-            return NULL;
-        }
-
-        return new_match(pat, str, m2->end, MATCHES(m1, m2));
+        if (m2 == NULL) return NULL;
+        return new_match(ctx->matcher, pat, str, m2->end, MATCHES(m1, m2));
     }
     case BP_MATCH: case BP_NOT_MATCH: {
         bp_pat_t *target = pat->type == BP_MATCH ? When(pat, BP_MATCH)->pat : When(pat, BP_NOT_MATCH)->pat;
@@ -666,16 +1363,12 @@ static bp_match_t *match(match_ctx_t *ctx, const char *str, bp_pat_t *pat)
         bp_match_t *ret = NULL, *m2 = NULL;
         if (pat->type == BP_MATCH) {
             m2 = _next_match(&slice_ctx, slice_ctx.start, When(pat, BP_MATCH)->must_match, NULL);
-            if (m2) ret = new_match(pat, m1->start, m1->end, MATCHES(m1, m2));
+            if (m2) ret = new_match(ctx->matcher, pat, m1->start, m1->end, MATCHES(m1, m2));
         } else {
             m2 = _next_match(&slice_ctx, slice_ctx.start, When(pat, BP_NOT_MATCH)->must_not_match, NULL);
-            if (!m2) ret = new_match(pat, m1->start, m1->end, MATCHES(m1));
+            if (!m2) ret = new_match(ctx->matcher, pat, m1->start, m1->end, MATCHES(m1));
         }
         cache_destroy(&slice_ctx);
-        if (!ret) {
-            if (m2) recycle_match(&m2);
-            recycle_match(&m1);
-        }
         return ret;
     }
     case BP_REPLACE: {
@@ -685,74 +1378,10 @@ static bp_match_t *match(match_ctx_t *ctx, const char *str, bp_pat_t *pat)
             p = match(ctx, str, replace->pat);
             if (p == NULL) return NULL;
         }
-        return new_match(pat, str, p ? p->end : str, MATCHES(p));
+        return new_match(ctx->matcher, pat, str, p ? p->end : str, MATCHES(p));
     }
     case BP_REF: {
-        if (has_cached_failure(ctx, str, pat))
-            return NULL;
-
-        auto ref_pat = When(pat, BP_REF);
-        bp_pat_t *ref = lookup_ctx(ctx, ref_pat->name, ref_pat->len);
-        if (ref == NULL) {
-            match_error(ctx, "Unknown pattern: '%.*s'", (int)ref_pat->len, ref_pat->name);
-            return NULL;
-        }
-
-        if (ref->type == BP_LEFTRECURSION)
-            return match(ctx, str, ref);
-
-        bp_pat_t rec_op = {
-            .type = BP_LEFTRECURSION,
-            .start = ref->start, .end = ref->end,
-            .min_matchlen = 0, .max_matchlen = -1,
-            .__tagged.BP_LEFTRECURSION = {
-                .match = NULL,
-                .visited = false,
-                .at = str,
-                .fallback = pat,
-                .ctx = (void*)ctx,
-            },
-        };
-        match_ctx_t ctx2 = *ctx;
-        ctx2.parent_ctx = ctx;
-        ctx2.defs = &(bp_pat_t){
-            .type = BP_DEFINITIONS,
-                .start = pat->start, .end = pat->end,
-                .__tagged.BP_DEFINITIONS = {
-                    .name = ref_pat->name,
-                    .namelen = ref_pat->len,
-                    .meaning = &rec_op,
-                },
-        };
-
-        bp_match_t *m = match(&ctx2, str, ref);
-        // If left recursion was involved, keep retrying while forward progress can be made:
-        if (m && rec_op.__tagged.BP_LEFTRECURSION.visited) {
-            while (1) {
-                const char *prev = m->end;
-                rec_op.__tagged.BP_LEFTRECURSION.match = m;
-                ctx2.cache = &(cache_t){0};
-                bp_match_t *m2 = match(&ctx2, str, ref);
-                cache_destroy(&ctx2);
-                if (!m2) break;
-                if (m2->end <= prev) {
-                    recycle_match(&m2);
-                    break;
-                }
-                recycle_match(&m);
-                m = m2;
-            }
-        }
-
-        if (!m) {
-            cache_failure(ctx, str, pat);
-            return NULL;
-        }
-
-        // This match wrapper mainly exists for record-keeping purposes.
-        // It also helps with visualization of match results.
-        // OPTIMIZE: remove this if necessary
-        return new_match(pat, m->start, m->end, MATCHES(m));
+        return ctx->matcher->profile.enabled ? match_ref_profiled(ctx, str, pat) : match_ref(ctx, str, pat, NULL);
     }
     case BP_NODENT: {
         if (*str != '\n') return NULL;
@@ -773,138 +1402,468 @@ static bp_match_t *match(match_ctx_t *ctx, const char *str, bp_pat_t *pat)
         for (int i = 0; i < dents; i++)
             if (&str[i] >= ctx->end || str[i] != denter) return NULL;
 
-        return new_match(pat, start, &str[dents], NULL);
+        return new_match(ctx->matcher, pat, start, &str[dents], NULL);
     }
     case BP_CURDENT: {
-        return new_match(pat, str, str, NULL);
+        return new_match(ctx->matcher, pat, str, str, NULL);
     }
     default: {
-        match_error(ctx, "Unknown pattern type: %u", pat->type);
+        match_error(ctx, BP_PATTERN_ERROR, "Unknown pattern type: %u", pat->type);
         return NULL;
     }
     }
 }
 
 //
-// Return a match object which can be used (may be allocated or recycled).
+// Return a new match object allocated from the matcher's arena. The children
+// (if any) are copied into the match object.
 //
-bp_match_t *new_match(bp_pat_t *pat, const char *start, const char *end, bp_match_t *children[])
+bp_match_t *new_match(bp_matcher_t *matcher, bp_pat_t *pat, const char *start, const char *end, bp_match_t *children[])
 {
-    bp_match_t *m;
-    if (unused_matches) {
-        m = unused_matches;
-        gc_list_remove(m);
-        memset(m, 0, sizeof(bp_match_t));
-    } else {
-        m = new(bp_match_t);
-    }
-    // Keep track of the object:
-    gc_list_prepend(&in_use_matches, m);
+    size_t nchildren = 0;
+    if (children)
+        while (children[nchildren]) ++nchildren;
 
+    bp_match_t *m = arena_alloc(&matcher->arena, sizeof(bp_match_t) + (children ? (nchildren+1)*sizeof(bp_match_t*) : 0));
+    ++matcher->arena.top.nmatches;
     m->pat = pat;
     m->start = start;
     m->end = end;
-
     if (children) {
-        for (int i = 0; children[i]; i++)
-            m->_children[i] = children[i];
+        memcpy(m->_children, children, (nchildren+1)*sizeof(bp_match_t*));
         m->children = m->_children;
+    } else {
+        m->children = NULL;
     }
     return m;
 }
 
 //
-// If the given match is not currently a child member of another match (or
-// otherwise reserved) then put it back in the pool of unused match objects.
+// Release a match. Match objects are freed in bulk when the matcher's arena is
+// reset (i.e. on the next call to bp_next_match()), so this only clears the
+// reference.
 //
 public void recycle_match(bp_match_t **at_m)
 {
-    bp_match_t *m = *at_m;
-    if (m->children) {
-        for (int i = 0; m->children[i]; i++)
-            recycle_match(&m->children[i]);
-        if (m->children != m->_children)
-            delete(&m->children);
-    }
-
-    gc_list_remove(m);
-    (void)memset(m, 0, sizeof(bp_match_t));
-    gc_list_prepend(&unused_matches, m);
     *at_m = NULL;
 }
 
 //
-// Force all match objects into the pool of unused match objects.
+// Release all of a matcher's match objects so their memory can be reused.
+// Returns the number of match objects that were still in use (not counting
+// ones that were only being kept for the packrat cache).
 //
-public size_t recycle_all_matches(void)
+static size_t _recycle_all_matches(bp_matcher_t *matcher)
 {
-    size_t count = 0;
-    for (bp_match_t *m; (m = in_use_matches); ++count) {
-        gc_list_remove(m);
-        if (m->children && m->children != m->_children)
-            delete(&m->children);
-        gc_list_prepend(&unused_matches, m);
-    }
+    size_t count = matcher->arena.top.nmatches - matcher->arena.pinned.nmatches;
+    matcher->arena.top = matcher->arena.pinned = (arena_mark_t){.block = matcher->arena.first};
+    matcher->child_stack.len = 0;
+    cache_clear(&matcher->cache);
     return count;
 }
 
 //
-// Free all match objects in memory.
+// If the packrat cache has grown past its memory limit, clear it out.
 //
-public size_t free_all_matches(void)
+static void limit_packrat_memory(bp_matcher_t *matcher)
 {
-    size_t count = 0;
-    recycle_all_matches();
-    for (bp_match_t *m; (m = unused_matches); ++count) {
-        gc_list_remove(m);
-        delete(&m);
+    size_t used = matcher->arena.pinned.total + matcher->cache.occupancy*sizeof(cache_entry_t);
+    if (used > matcher->packrat_limit) {
+        _recycle_all_matches(matcher);
+        ++matcher->stats.evictions;
     }
+}
+
+public size_t recycle_all_matches(void)
+{
+    return _recycle_all_matches(&default_matcher);
+}
+
+//
+// Free all of the memory used for a matcher's match objects (and the other
+// data it keeps between searches). Returns the number of match objects that
+// were still in use.
+//
+static size_t _free_all_matches(bp_matcher_t *matcher)
+{
+    size_t count = matcher->arena.top.nmatches - matcher->arena.pinned.nmatches;
+    arena_free(&matcher->arena);
+    if (matcher->cache.entries) delete(&matcher->cache.entries);
+    matcher->cache = (cache_t){0};
+    if (matcher->child_stack.items) delete(&matcher->child_stack.items);
+    matcher->child_stack.len = matcher->child_stack.capacity = 0;
+    free_prefilters(matcher);
+    if (matcher->rules.slots) delete(&matcher->rules.slots);
+    if (matcher->rules.bindings.items) delete(&matcher->rules.bindings.items);
+    if (matcher->rules.saved.items) delete(&matcher->rules.saved.items);
+    matcher->rules = (__typeof__(matcher->rules)){0};
     return count;
 }
 
+public size_t free_all_matches(void)
+{
+    return _free_all_matches(&default_matcher);
+}
+
 //
-// Iterate over matches.
-// Usage: for (bp_match_t *m = NULL; next_match(&m, ...); ) {...}
+// Create a new matcher. A matcher is not thread-safe, but different threads
+// can use different matchers at the same time. By default, a matcher has no
+// error handler, so errors can be retrieved with bp_matcher_error().
 //
-public bool next_match(bp_match_t **m, const char *start, const char *end, bp_pat_t *pat, bp_pat_t *defs, bp_pat_t *skip, bool ignorecase)
+public bp_matcher_t *bp_new_matcher(void)
 {
-    const char *pos;
-    if (*m) {
-        // Make sure forward progress is occurring, even after zero-width matches:
-        pos = ((*m)->end > (*m)->start) ? (*m)->end : (*m)->end+1;
-        recycle_match(m);
-    } else {
-        pos = start;
+    return new(bp_matcher_t);
+}
+
+//
+// Free a matcher and all of the match objects and memory it owns, then set
+// the input pointer to NULL.
+//
+public void bp_destroy_matcher(bp_matcher_t **at_matcher)
+{
+    bp_matcher_t *matcher = *at_matcher;
+    _free_all_matches(matcher);
+    if (matcher->error_message) delete(&matcher->error_message);
+    bp_matcher_set_profiling(matcher, false);
+    delete(at_matcher);
+}
+
+//
+// Set the function that will be called with the error message when an error
+// occurs during matching (or NULL to not call any function). Returns the
+// previous error handler.
+//
+public bp_errhand_t bp_matcher_set_error_handler(bp_matcher_t *matcher, bp_errhand_t new_handler)
+{
+    bp_errhand_t old_handler = matcher->error_handler;
+    matcher->error_handler = new_handler;
+    return old_handler;
+}
+
+//
+// Return the error message from the error that stopped the most recent call
+// to bp_next_match(), or NULL if there was no error (or the error handler
+// took ownership of the message).
+//
+public const char *bp_matcher_error(bp_matcher_t *matcher)
+{
+    return matcher->error_message;
+}
+
+//
+// Return what kind of error stopped the most recent search (or BP_NO_ERROR).
+//
+public bp_error_t bp_matcher_error_code(bp_matcher_t *matcher)
+{
+    return matcher->error_code;
+}
+
+//
+// Turn packrat mode on (with the given memory limit in bytes) or off (with a
+// limit of 0). In packrat mode, successful matches of named patterns are
+// cached along with failures, and the cache is kept for the whole search
+// instead of being cleared every time a match is found. This uses more
+// memory, but avoids re-matching the same rules at the same positions.
+//
+public void bp_matcher_set_packrat(bp_matcher_t *matcher, size_t memory_limit)
+{
+    matcher->packrat_limit = memory_limit;
+}
+
+//
+// Limit how many steps each search may take (or with a limit of 0, don't). A
+// step is an attempt to match part of a pattern at a position, so this bounds
+// how long pathological patterns can backtrack. When a search runs out of
+// steps, it stops with a BP_STEP_LIMIT_ERROR.
+//
+public void bp_matcher_set_step_limit(bp_matcher_t *matcher, size_t max_steps)
+{
+    matcher->step_limit = max_steps;
+}
+
+//
+// Set whether a matcher needs to build full match trees (the default). If
+// not, only the text of each match and any replacements inside of it are
+// kept, which lets the matcher skip building match objects for most of the
+// steps of a match (e.g. with a compiled version of the pattern).
+//
+public void bp_matcher_set_full_trees(bp_matcher_t *matcher, bool full_trees)
+{
+    matcher->partial_trees = !full_trees;
+}
+
+//
+// Return statistics about how well a matcher's cache has been working.
+//
+public bp_packrat_stats_t bp_matcher_packrat_stats(bp_matcher_t *matcher)
+{
+    return matcher->stats;
+}
+
+//
+// Turn profiling on or off. While profiling is on, the matcher keeps count of
+// the work done matching each named rule (see bp_matcher_profile()). Turning
+// profiling off discards the counts.
+//
+public void bp_matcher_set_profiling(bp_matcher_t *matcher, bool profiling)
+{
+    auto profile = &matcher->profile;
+    if (!profiling && profile->rules) {
+        for (size_t i = 0; i < profile->nrules; i++)
+            if (profile->rules[i].name) free((char*)profile->rules[i].name);
+        delete(&profile->rules);
+        delete(&profile->depth);
+        profile->nrules = 0;
+    }
+    profile->enabled = profiling;
+}
+
+//
+// Return the profile of each rule that has been matched since profiling was
+// turned on, and set `*nrules` to the number of entries. Entries for rules
+// that haven't been matched have a NULL name. The entries are only valid
+// until the matcher is used again.
+//
+public const bp_rule_profile_t *bp_matcher_profile(bp_matcher_t *matcher, size_t *nrules)
+{
+    *nrules = matcher->profile.nrules;
+    return matcher->profile.rules;
+}
+
+//
+// Return the matcher that next_match() uses on the current thread.
+//
+public bp_matcher_t *bp_default_matcher(void)
+{
+    return &default_matcher;
+}
+
+//
+// Bind the top-level definitions for a search. They're kept bound from one
+// search to the next as long as the same definitions are used.
+//
+static void bind_top_level_defs(match_ctx_t *ctx)
+{
+    bp_matcher_t *matcher = ctx->matcher;
+    uint32_t defs_id = ctx->defs ? ctx->defs->id : 0;
+    if (matcher->rules.defs_id != defs_id) {
+        reset_rules(matcher);
+        if (ctx->defs) bind_defs(ctx, ctx->defs);
+        matcher->rules.defs_id = defs_id;
     }
+    ctx->bindings = matcher->rules.bindings.len;
+}
 
-    if (!pat) {
-        error_handler = default_error_handler;
-        return false;
+//
+// Find the first match at or after `pos` in the text between `start` and
+// `end`, releasing the previous match (if any). If `continuing` is true, the
+// previous match came from the same search of the same text.
+//
+static bool search(bp_matcher_t *matcher, bp_match_t **m, bool continuing, const char *start, const char *pos, const char *end,
+                   bp_pat_t *pat, bp_pat_t *defs, bp_pat_t *skip, bool ignorecase)
+{
+    if (matcher->error_message) delete(&matcher->error_message);
+    matcher->error_code = BP_NO_ERROR;
+
+    if (*m && continuing && matcher->packrat_limit > 0) {
+        // When continuing a search, keep the packrat cache and its matches,
+        // but release everything else:
+        release_matches(matcher, (arena_mark_t){0});
+        limit_packrat_memory(matcher);
+    } else {
+        // Release the previous match (and anything else left over) all at once:
+        _recycle_all_matches(matcher);
+    }
+    if (!(*m && continuing)) {
+        ++matcher->search_id;
+        matcher->steps = 0;
     }
+    *m = NULL;
+
+    if (!pat) return false;
 
     match_ctx_t ctx = {
-        .cache = &(cache_t){0},
+        .matcher = matcher,
+        .cache = &matcher->cache,
         .start = start,
         .end = end,
         .ignorecase = ignorecase,
         .defs = defs,
     };
     if (setjmp(ctx.error_jump) == 0) {
+        bind_top_level_defs(&ctx);
         *m = (pos <= end) ? _next_match(&ctx, pos, pat, skip) : NULL;
-        cache_destroy(&ctx);
     } else {
-        recycle_all_matches();
-        cache_destroy(&ctx);
+        reset_rules(matcher);
+        _recycle_all_matches(matcher);
         *m = NULL;
-        if (error_handler)
-            error_handler(&error_message);
+        if (matcher->error_handler)
+            matcher->error_handler(&matcher->error_message);
+    }
+    return *m != NULL;
+}
 
-        if (error_message) {
-            free(error_message);
-            error_message = NULL;
+//
+// Iterate over matches using the given matcher.
+// Usage: for (bp_match_t *m = NULL; bp_next_match(matcher, &m, ...); ) {...}
+//
+public bool bp_next_match(bp_matcher_t *matcher, bp_match_t **m, const char *start, const char *end, bp_pat_t *pat, bp_pat_t *defs, bp_pat_t *skip, bool ignorecase)
+{
+    const char *pos;
+    if (*m) {
+        // Make sure forward progress is occurring, even after zero-width matches:
+        pos = ((*m)->end > (*m)->start) ? (*m)->end : (*m)->end+1;
+    } else {
+        pos = start;
+    }
+    return search(matcher, m, true, start, pos, end, pat, defs, skip, ignorecase);
+}
+
+//
+// Start a new search for matches at or after `pos`. Unlike passing `pos` as the
+// start of the text, this lets patterns like `^` and lookbehinds see the text
+// between `start` and `pos`. The search can be continued with bp_next_match().
+//
+public bool bp_next_match_from(bp_matcher_t *matcher, bp_match_t **m, const char *start, const char *pos, const char *end, bp_pat_t *pat, bp_pat_t *defs, bp_pat_t *skip, bool ignorecase)
+{
+    return search(matcher, m, false, start, pos, end, pat, defs, skip, ignorecase);
+}
+
+//
+// Iterate over matches using the current thread's default matcher.
+// Usage: for (bp_match_t *m = NULL; next_match(&m, ...); ) {...}
+//
+public bool next_match(bp_match_t **m, const char *start, const char *end, bp_pat_t *pat, bp_pat_t *defs, bp_pat_t *skip, bool ignorecase)
+{
+    bool found = bp_next_match(&default_matcher, m, start, end, pat, defs, skip, ignorecase);
+    if (!pat)
+        default_matcher.error_handler = default_error_handler;
+    // The default matcher doesn't hold on to error messages:
+    if (default_matcher.error_message) delete(&default_matcher.error_message);
+    return found;
+}
+
+//
+// Find the next batch of matches for a search (up to `max_matches` of them),
+// filling in `spans` with where each match is, followed by where each of its
+// first `search->ncaptures` numbered captures are (or NULLs for a capture
+// that didn't match). So `spans` needs room for
+// `max_matches * (1 + search->ncaptures)` spans. The search continues where
+// the last batch left off, and the number of matches found is returned, which
+// is zero when there are no more matches or when there's an error (after
+// returning the matches found before the error).
+//
+// Since only where each match starts and ends is kept, the matches can
+// usually be found with the compiled version of the pattern, and searching
+// for a replacement is the same as searching for the pattern being replaced.
+//
+public size_t bp_next_spans(bp_matcher_t *matcher, bp_span_search_t *search, bp_span_t spans[], size_t max_matches)
+{
+    if (matcher->error_message) delete(&matcher->error_message);
+    matcher->error_code = BP_NO_ERROR;
+
+    // A search can keep using the packrat cache (and what's known about which
+    // rules fail where) from its last batch, unless the matcher has been used
+    // for something else since then:
+    bool continuing = search->search_id != 0 && search->search_id == matcher->search_id;
+    if (continuing && matcher->packrat_limit > 0) {
+        release_matches(matcher, (arena_mark_t){0});
+        limit_packrat_memory(matcher);
+    } else {
+        _recycle_all_matches(matcher);
+    }
+    if (!continuing) {
+        if (++matcher->search_id == 0) ++matcher->search_id;
+        search->search_id = matcher->search_id;
+        matcher->steps = 0;
+    }
+
+    if (!search->pos || !search->pat || max_matches == 0) return 0;
+
+    bp_pat_t *pat = search->pat;
+    while (pat->type == BP_REPLACE && When(pat, BP_REPLACE)->pat)
+        pat = When(pat, BP_REPLACE)->pat;
+
+    match_ctx_t ctx = {
+        .matcher = matcher,
+        .cache = &matcher->cache,
+        .start = search->start,
+        .end = search->end,
+        .ignorecase = search->ignorecase,
+        .defs = search->defs,
+    };
+    size_t stride = 1 + (size_t)(search->ncaptures > 0 ? search->ncaptures : 0);
+    volatile size_t n = 0;
+    if (setjmp(ctx.error_jump) == 0) {
+        bind_top_level_defs(&ctx);
+        // Captures are only in full match trees:
+        search_plan_t plan = plan_search(&ctx, pat, search->skip, search->ncaptures <= 0);
+        while (n < max_matches) {
+            bp_match_t *m = search->pos <= search->end ? find_next(&ctx, &plan, search->pos, search->stop, pat, search->skip) : NULL;
+            if (!m) {
+                search->pos = NULL;
+                break;
+            }
+            bp_span_t *span = &spans[n*stride];
+            span[0] = (bp_span_t){m->start, m->end};
+            for (size_t i = 1; i < stride; i++) {
+                bp_match_t *cap = get_numbered_capture(m, (int)i);
+                span[i] = cap ? (bp_span_t){cap->start, cap->end} : (bp_span_t){NULL, NULL};
+            }
+            ++n;
+            // Make sure forward progress is occurring, even after zero-width matches:
+            search->pos = (m->end > m->start) ? m->end : m->end+1;
+            if (matcher->packrat_limit > 0) release_matches(matcher, (arena_mark_t){0});
+            else _recycle_all_matches(matcher);
         }
+    } else {
+        reset_rules(matcher);
+        _recycle_all_matches(matcher);
+        // The matches found before the error are returned first, and the
+        // next batch will run into the error again:
+        if (n > 0) return n;
+        search->pos = NULL;
+        if (matcher->error_handler)
+            matcher->error_handler(&matcher->error_message);
+        return 0;
     }
-    return *m != NULL;
+    return n;
+}
+
+//
+// Count the matches in the text (up to `limit` of them) without keeping their
+// match trees.
+//
+static size_t count_matches(bp_matcher_t *matcher, size_t limit, const char *start, const char *end,
+                            bp_pat_t *pat, bp_pat_t *defs, bp_pat_t *skip, bool ignorecase)
+{
+    bp_span_search_t search = {
+        .start = start, .pos = start, .end = end,
+        .pat = pat, .defs = defs, .skip = skip, .ignorecase = ignorecase,
+    };
+    bp_span_t spans[64];
+    size_t count = 0;
+    for (size_t n; count < limit && (n = bp_next_spans(matcher, &search, spans, limit - count < 64 ? limit - count : 64)) > 0; )
+        count += n;
+    return count;
+}
+
+//
+// Return whether the pattern matches anywhere in the text, without keeping a
+// match tree.
+//
+public bool bp_search_exists(bp_matcher_t *matcher, const char *start, const char *end, bp_pat_t *pat, bp_pat_t *defs, bp_pat_t *skip, bool ignorecase)
+{
+    return count_matches(matcher, 1, start, end, pat, defs, skip, ignorecase) > 0;
+}
+
+//
+// Return the number of matches in the text (the same matches that iterating
+// with bp_next_match() would find), without keeping any match trees.
+//
+public size_t bp_count_matches(bp_matcher_t *matcher, const char *start, const char *end, bp_pat_t *pat, bp_pat_t *defs, bp_pat_t *skip, bool ignorecase)
+{
+    return count_matches(matcher, SIZE_MAX, start, end, pat, defs, skip, ignorecase);
 }
 
 //
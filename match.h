@@ -4,6 +4,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/types.h>
 
@@ -17,16 +18,103 @@ struct bp_match_s {
     // Where the match starts and ends (end is after the last character)
     const char *start, *end;
     bp_pat_t *pat;
-    // Intrusive linked list node for garbage collection:
-    struct {
-        bp_match_t **home, *next;
-    } gc;
+    // NULL-terminated list of child matches (or NULL if there are none).
+    // Matches are allocated with their children stored inline:
     bp_match_t **children;
-    bp_match_t *_children[3];
+    bp_match_t *_children[];
 };
 
 typedef void (*bp_errhand_t)(char **err_msg);
 
+// What kind of error stopped a search
+typedef enum {
+    BP_NO_ERROR = 0,
+    // The pattern couldn't be matched (e.g. it uses an undefined rule)
+    BP_PATTERN_ERROR,
+    // The search used up the step budget from bp_matcher_set_step_limit()
+    BP_STEP_LIMIT_ERROR,
+} bp_error_t;
+
+// Counts of how often cached match results were used
+typedef struct {
+    size_t hits, misses, evictions;
+} bp_packrat_stats_t;
+
+// How much work went into matching a named rule while profiling
+typedef struct {
+    const char *name;
+    size_t namelen;
+    // How many times the rule was matched, how many of those attempts failed,
+    // and how many were answered by the cache
+    size_t calls, failures, cache_hits;
+    // The total length of the rule's successful matches
+    size_t bytes;
+    // Time spent matching the rule (including the rules it uses)
+    double seconds;
+} bp_rule_profile_t;
+
+// Where a match (or one of its captures) is in the text
+typedef struct {
+    const char *start, *end;
+} bp_span_t;
+
+// A search that finds matches in batches with bp_next_spans(). `pos` is where
+// the next batch of matches will be searched for (it should start out as
+// `start`), and it's set to NULL when there are no more matches. If `stop`
+// isn't NULL, only matches that start before it are found, but patterns can
+// still look at the text after it (up to `end`).
+typedef struct {
+    const char *start, *pos, *stop, *end;
+    bp_pat_t *pat, *defs, *skip;
+    bool ignorecase;
+    // How many numbered captures (@1, @2, ...) to find for each match
+    int ncaptures;
+    // Used to tell if the matcher was used for anything else between batches
+    uint32_t search_id;
+} bp_span_search_t;
+
+// A matcher owns the match objects, cache, and error state used for matching.
+// Each thread that matches concurrently should use its own matcher. Match
+// objects are allocated in bulk by the matcher and are only valid until the
+// next call to bp_next_match() with that matcher.
+typedef struct bp_matcher_s bp_matcher_t;
+
+__attribute__((returns_nonnull))
+bp_matcher_t *bp_new_matcher(void);
+__attribute__((nonnull))
+void bp_destroy_matcher(bp_matcher_t **at_matcher);
+__attribute__((nonnull(1,2)))
+bool bp_next_match(bp_matcher_t *matcher, bp_match_t **m, const char *start, const char *end, bp_pat_t *pat, bp_pat_t *defs, bp_pat_t *skip, bool ignorecase);
+__attribute__((nonnull(1,2)))
+bool bp_next_match_from(bp_matcher_t *matcher, bp_match_t **m, const char *start, const char *pos, const char *end, bp_pat_t *pat, bp_pat_t *defs, bp_pat_t *skip, bool ignorecase);
+#define bp_stop_matching(matcher, m) bp_next_match(matcher, m, NULL, NULL, NULL, NULL, NULL, 0)
+__attribute__((nonnull))
+size_t bp_next_spans(bp_matcher_t *matcher, bp_span_search_t *search, bp_span_t spans[], size_t max_matches);
+__attribute__((nonnull(1,4)))
+bool bp_search_exists(bp_matcher_t *matcher, const char *start, const char *end, bp_pat_t *pat, bp_pat_t *defs, bp_pat_t *skip, bool ignorecase);
+__attribute__((nonnull(1,4)))
+size_t bp_count_matches(bp_matcher_t *matcher, const char *start, const char *end, bp_pat_t *pat, bp_pat_t *defs, bp_pat_t *skip, bool ignorecase);
+__attribute__((nonnull(1)))
+bp_errhand_t bp_matcher_set_error_handler(bp_matcher_t *matcher, bp_errhand_t handler);
+__attribute__((nonnull, pure))
+const char *bp_matcher_error(bp_matcher_t *matcher);
+__attribute__((nonnull, pure))
+bp_error_t bp_matcher_error_code(bp_matcher_t *matcher);
+__attribute__((nonnull))
+void bp_matcher_set_packrat(bp_matcher_t *matcher, size_t memory_limit);
+__attribute__((nonnull))
+void bp_matcher_set_step_limit(bp_matcher_t *matcher, size_t max_steps);
+__attribute__((nonnull))
+void bp_matcher_set_full_trees(bp_matcher_t *matcher, bool full_trees);
+__attribute__((nonnull, pure))
+bp_packrat_stats_t bp_matcher_packrat_stats(bp_matcher_t *matcher);
+__attribute__((nonnull))
+void bp_matcher_set_profiling(bp_matcher_t *matcher, bool profiling);
+__attribute__((nonnull))
+const bp_rule_profile_t *bp_matcher_profile(bp_matcher_t *matcher, size_t *nrules);
+__attribute__((returns_nonnull))
+bp_matcher_t *bp_default_matcher(void);
+
 __attribute__((nonnull))
 void recycle_match(bp_match_t **at_m);
 size_t free_all_matches(void);
@@ -4,8 +4,10 @@
 #include <ctype.h>
 #include <err.h>
 #include <printf.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -19,7 +21,44 @@
                                                               .min_matchlen=_min, .max_matchlen=_max, .__tagged._tag={__VA_ARGS__}})
 #define UNBOUNDED(pat) ((pat)->max_matchlen == -1)
 
-static bp_pat_t *allocated_pats = NULL;
+// Patterns are allocated from arenas, so that the patterns in a compiled
+// pattern are laid out next to each other in memory and can be freed all at
+// once. Each call to bp_pattern(), bp_stringpattern() or bp_replacement() gets
+// its own arena, and patterns created outside of those (e.g. by
+// chain_together()) go in the thread's default arena. Each thread keeps a list
+// of its arenas so free_all_pats() can free them.
+#define PAT_ARENA_MIN_BLOCK 1024
+#define PAT_ARENA_MAX_BLOCK (64*1024)
+typedef struct pat_block_s {
+    struct pat_block_s *next;
+    size_t used, capacity;
+    _Alignas(max_align_t) char memory[];
+} pat_block_t;
+
+struct bp_pat_arena_s {
+    bp_pat_arena_t *next, **home;
+    pat_block_t *blocks;
+};
+
+static _Thread_local bp_pat_arena_t *arenas = NULL;
+static _Thread_local bp_pat_arena_t *default_arena = NULL;
+// The arena for the pattern currently being compiled (if any)
+static _Thread_local bp_pat_arena_t *compiling_arena = NULL;
+// Pattern IDs are unique across all threads:
+static size_t next_pat_id = 1;
+
+// Rule names are interned into small integer IDs (shared by all threads), so
+// that matching can look up rules by ID instead of comparing names. ID 0 is
+// never used for a name.
+typedef struct {
+    char *name;
+    uint32_t len, id;
+} interned_name_t;
+static struct {
+    pthread_mutex_t lock;
+    interned_name_t *entries;
+    size_t size, count;
+} interned = {.lock = PTHREAD_MUTEX_INITIALIZER};
 
 __attribute__((nonnull))
 static bp_pat_t *bp_pattern_nl(const char *str, const char *end, bool allow_nl);
@@ -27,10 +66,11 @@ __attribute__((nonnull))
 static bp_pat_t *bp_simplepattern(const char *str, const char *end);
 
 // For error-handling purposes, use setjmp/longjmp to break out of deeply
-// recursive function calls when a parse error occurs.
-bool is_in_try_catch = false;
-static jmp_buf err_jmp;
-static maybe_pat_t parse_error = {.success = false};
+// recursive function calls when a parse error occurs. This state is
+// thread-local so that patterns can be compiled on multiple threads.
+static _Thread_local bool is_in_try_catch = false;
+static _Thread_local jmp_buf err_jmp;
+static _Thread_local maybe_pat_t parse_error = {.success = false};
 
 #define __TRY_PATTERN__ bool was_in_try_catch = is_in_try_catch; \
     if (!is_in_try_catch) { is_in_try_catch = true; if (setjmp(err_jmp)) return parse_error; }
@@ -49,22 +89,141 @@ static inline void parse_err(const char *start, const char *end, const char *msg
 }
 
 //
-// Allocate a new pattern for this file (ensuring it will be automatically
-// freed when the file is freed)
+// Create a new, empty arena for patterns.
+//
+static bp_pat_arena_t *new_arena(void)
+{
+    bp_pat_arena_t *arena = new(bp_pat_arena_t);
+    arena->home = &arenas;
+    arena->next = arenas;
+    if (arenas) arenas->home = &arena->next;
+    arenas = arena;
+    return arena;
+}
+
+//
+// Allocate zeroed memory from the arena that patterns are currently being
+// allocated from.
+//
+__attribute__((returns_nonnull))
+static void *pat_alloc(size_t size)
+{
+    bp_pat_arena_t *arena = compiling_arena;
+    if (!arena) {
+        if (!default_arena) default_arena = new_arena();
+        arena = default_arena;
+    }
+    size = (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+    pat_block_t *block = arena->blocks;
+    if (!block || block->used + size > block->capacity) {
+        // Blocks get bigger as the arena grows, so small patterns stay small
+        size_t capacity = block ? 2*block->capacity : PAT_ARENA_MIN_BLOCK;
+        if (capacity > PAT_ARENA_MAX_BLOCK) capacity = PAT_ARENA_MAX_BLOCK;
+        if (capacity < size) capacity = size;
+        pat_block_t *fresh = require(malloc(sizeof(pat_block_t) + capacity), "Failed to allocate memory for patterns");
+        fresh->used = 0;
+        fresh->capacity = capacity;
+        fresh->next = block;
+        arena->blocks = block = fresh;
+    }
+    void *mem = &block->memory[block->used];
+    block->used += size;
+    return memset(mem, 0, size);
+}
+
+//
+// Copy a string into the current pattern arena (with a NUL terminator).
+//
+__attribute__((nonnull, returns_nonnull))
+static char *copy_string(const char *str, size_t len)
+{
+    char *copy = pat_alloc(len + 1);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+//
+// Allocate a new pattern in the current arena.
 //
 public bp_pat_t *allocate_pat(bp_pat_t pat)
 {
-    static size_t next_pat_id = 1;
-    bp_pat_t *allocated = new(bp_pat_t);
+    bp_pat_t *allocated = pat_alloc(sizeof(bp_pat_t));
     *allocated = pat;
-    allocated->home = &allocated_pats;
-    allocated->next = allocated_pats;
-    allocated->id = next_pat_id++;
-    if (allocated_pats) allocated_pats->home = &allocated->next;
-    allocated_pats = allocated;
+    allocated->id = (uint32_t)__atomic_fetch_add(&next_pat_id, 1, __ATOMIC_RELAXED);
     return allocated;
 }
 
+//
+// Start compiling a pattern into a new arena (unless a pattern is already
+// being compiled). Returns whether a new arena was started.
+//
+static bool begin_compiling(void)
+{
+    if (compiling_arena) return false;
+    compiling_arena = new_arena();
+    return true;
+}
+
+//
+// Finish compiling a pattern. If the compilation started a new arena, the
+// arena is returned with the result, or freed if compilation failed.
+//
+static maybe_pat_t finish_compiling(bool started, maybe_pat_t result)
+{
+    if (!started) return result;
+    if (result.success) result.arena = compiling_arena;
+    else free_pat_arena(&compiling_arena);
+    compiling_arena = NULL;
+    return result;
+}
+
+//
+// Hash function for interned names.
+//
+static inline size_t name_hash(const char *name, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325; // FNV-1a
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)name[i]) * 0x100000001b3;
+    return (size_t)h;
+}
+
+//
+// Return the unique ID for a rule name (adding it if it's new). Names are
+// copied, so the ID stays valid after the pattern's source text is freed.
+//
+public uint32_t intern_name(const char *name, size_t len)
+{
+    pthread_mutex_lock(&interned.lock);
+    if (interned.count*2 >= interned.size) {
+        size_t old_size = interned.size;
+        interned_name_t *old = interned.entries;
+        interned.size = old_size ? old_size*2 : 256;
+        interned.entries = new(interned_name_t[interned.size]);
+        for (size_t i = 0; i < old_size; i++) {
+            if (!old[i].name) continue;
+            size_t k = name_hash(old[i].name, old[i].len) & (interned.size-1);
+            while (interned.entries[k].name) k = (k+1) & (interned.size-1);
+            interned.entries[k] = old[i];
+        }
+        if (old) delete(&old);
+    }
+
+    size_t i = name_hash(name, len) & (interned.size-1);
+    interned_name_t *entry;
+    while ((entry = &interned.entries[i])->name
+           && !(entry->len == len && memcmp(entry->name, name, len) == 0))
+        i = (i+1) & (interned.size-1);
+    if (!entry->name) {
+        entry->name = require(strndup(name, len), "`strndup()` allocation failure");
+        entry->len = (uint32_t)len;
+        entry->id = (uint32_t)++interned.count;
+    }
+    uint32_t id = entry->id;
+    pthread_mutex_unlock(&interned.lock);
+    return id;
+}
+
 //
 // Helper function to initialize a range object.
 //
@@ -151,6 +310,48 @@ static bp_pat_t *expand_choices(bp_pat_t *first, const char *end, bool allow_nl)
     return either_pat(first, second);
 }
 
+//
+// Return a string literal for part of another string literal (or NULL if the
+// part is empty).
+//
+__attribute__((nonnull))
+static bp_pat_t *substring(bp_pat_t *str, size_t start, size_t end)
+{
+    if (start >= end) return NULL;
+    return Pattern(BP_STRING, str->start, str->end, end - start, (ssize_t)(end - start),
+                   .string=copy_string(&When(str, BP_STRING)->string[start], end - start));
+}
+
+//
+// Return a string literal that matches one string literal followed by
+// another.
+//
+__attribute__((nonnull))
+static bp_pat_t *fuse_strings(bp_pat_t *first, bp_pat_t *second)
+{
+    size_t len1 = first->min_matchlen, len2 = second->min_matchlen;
+    char *fused = pat_alloc(len1 + len2 + 1);
+    memcpy(fused, When(first, BP_STRING)->string, len1);
+    memcpy(&fused[len1], When(second, BP_STRING)->string, len2);
+    return Pattern(BP_STRING, first->start, second->end, len1 + len2, (ssize_t)(len1 + len2), .string=fused);
+}
+
+//
+// If a pattern starts with a string literal, return the literal and set
+// `rest` to whatever follows it (or NULL), otherwise return NULL.
+//
+__attribute__((nonnull))
+static bp_pat_t *leading_string(bp_pat_t *pat, bp_pat_t **rest)
+{
+    *rest = NULL;
+    if (pat->type == BP_STRING) return pat;
+    if (pat->type == BP_CHAIN && When(pat, BP_CHAIN)->first->type == BP_STRING) {
+        *rest = When(pat, BP_CHAIN)->second;
+        return When(pat, BP_CHAIN)->first;
+    }
+    return NULL;
+}
+
 //
 // Given two patterns, return a new pattern for the first pattern followed by
 // the second. If either pattern is NULL, return the other.
@@ -163,6 +364,21 @@ public bp_pat_t *chain_together(bp_pat_t *first, bp_pat_t *second)
     if (first->type == BP_STRING && first->max_matchlen == 0) return second;
     if (second->type == BP_STRING && second->max_matchlen == 0) return first;
 
+    // Adjacent string literals (e.g. "foo" `: "bar") are fused into a single
+    // literal, which is faster to match and to scan for:
+    bp_pat_t *rest;
+    if (first->type == BP_STRING) {
+        bp_pat_t *str = leading_string(second, &rest);
+        if (str) {
+            // The parser continues after the end of the chain, so it has to
+            // span all of `second` (even if `rest` ends inside parentheses)
+            bp_pat_t *fused = chain_together(fuse_strings(first, str), rest);
+            fused->start = first->start;
+            fused->end = second->end;
+            return fused;
+        }
+    }
+
     if (first->type == BP_DEFINITIONS && second->type == BP_DEFINITIONS) {
         return Pattern(BP_CHAIN, first->start, second->end, second->min_matchlen, second->max_matchlen, .first=first, .second=second);
     }
@@ -172,6 +388,100 @@ public bp_pat_t *chain_together(bp_pat_t *first, bp_pat_t *second)
     return Pattern(BP_CHAIN, first->start, second->end, minlen, maxlen, .first=first, .second=second);
 }
 
+//
+// If the pattern matches a single byte from a set of bytes (a byte set, a
+// range, or a one-byte string), add those bytes to the bitmaps and return
+// true, otherwise return false.
+//
+__attribute__((nonnull))
+static bool add_to_byteset(bp_pat_t *pat, uint64_t bits[4], uint64_t nocase_bits[4])
+{
+#define ADD_BYTE(b, c) (b)[(unsigned char)(c) >> 6] |= (uint64_t)1 << ((unsigned char)(c) & 63)
+    if (pat->type == BP_BYTESET) {
+        for (int i = 0; i < 4; i++) {
+            bits[i] |= When(pat, BP_BYTESET)->bits[i];
+            nocase_bits[i] |= When(pat, BP_BYTESET)->nocase_bits[i];
+        }
+    } else if (pat->type == BP_RANGE) {
+        // Ranges are always case-sensitive
+        for (unsigned int c = When(pat, BP_RANGE)->low; c <= When(pat, BP_RANGE)->high; c++) {
+            ADD_BYTE(bits, c);
+            ADD_BYTE(nocase_bits, c);
+        }
+    } else if (pat->type == BP_STRING && pat->min_matchlen == 1 && pat->max_matchlen == 1) {
+        unsigned char c = (unsigned char)When(pat, BP_STRING)->string[0];
+        ADD_BYTE(bits, c);
+        ADD_BYTE(nocase_bits, tolower(c));
+        ADD_BYTE(nocase_bits, toupper(c));
+    } else {
+        return false;
+    }
+    return true;
+#undef ADD_BYTE
+}
+
+//
+// Add the bytes that a match of the pattern can start with to the bitmap
+// (both cases of letters, so it works with and without case sensitivity) and
+// return true if every match is non-empty and starts with one of them.
+// Otherwise, return false. References aren't followed, since they're looked up
+// when matching.
+//
+__attribute__((nonnull))
+static bool add_first_bytes(bp_pat_t *pat, uint64_t bits[4])
+{
+#define ADD_BYTE(c) bits[(unsigned char)(c) >> 6] |= (uint64_t)1 << ((unsigned char)(c) & 63)
+    switch (pat->type) {
+    case BP_STRING: {
+        if (pat->min_matchlen == 0) return false;
+        unsigned char c = (unsigned char)When(pat, BP_STRING)->string[0];
+        ADD_BYTE(c);
+        ADD_BYTE(tolower(c));
+        ADD_BYTE(toupper(c));
+        return true;
+    }
+    case BP_BYTESET: case BP_RANGE:
+        return add_to_byteset(pat, bits, bits);
+    case BP_ANYCHAR:
+        for (int c = 0; c < 256; c++)
+            if (c != '\n') ADD_BYTE(c);
+        return true;
+    case BP_ID_START: case BP_ID_CONTINUE:
+        for (int c = 0; c < 256; c++)
+            if (isalpha(c) || c == '_' || c >= 0x80 || (pat->type == BP_ID_CONTINUE && isdigit(c)))
+                ADD_BYTE(c);
+        return true;
+    case BP_NODENT:
+        ADD_BYTE('\n');
+        return true;
+    case BP_OTHERWISE:
+        for (int i = 0; i < 4; i++)
+            bits[i] |= When(pat, BP_OTHERWISE)->first_bytes[i];
+        return add_first_bytes(When(pat, BP_OTHERWISE)->second, bits);
+    case BP_CHAIN: {
+        auto chain = When(pat, BP_CHAIN);
+        if (chain->first->type == BP_DEFINITIONS || chain->first->max_matchlen == 0)
+            return add_first_bytes(chain->second, bits);
+        return add_first_bytes(chain->first, bits);
+    }
+    case BP_REPEAT:
+        return When(pat, BP_REPEAT)->min > 0 && add_first_bytes(When(pat, BP_REPEAT)->repeat_pat, bits);
+    case BP_CAPTURE:
+        return add_first_bytes(When(pat, BP_CAPTURE)->pat, bits);
+    case BP_TAGGED:
+        return When(pat, BP_TAGGED)->pat && add_first_bytes(When(pat, BP_TAGGED)->pat, bits);
+    case BP_REPLACE:
+        return When(pat, BP_REPLACE)->pat && add_first_bytes(When(pat, BP_REPLACE)->pat, bits);
+    case BP_MATCH:
+        return add_first_bytes(When(pat, BP_MATCH)->pat, bits);
+    case BP_NOT_MATCH:
+        return add_first_bytes(When(pat, BP_NOT_MATCH)->pat, bits);
+    default:
+        return false;
+    }
+#undef ADD_BYTE
+}
+
 //
 // Given two patterns, return a new pattern for matching either the first
 // pattern or the second. If either pattern is NULL, return the other.
@@ -180,10 +490,60 @@ public bp_pat_t *either_pat(bp_pat_t *first, bp_pat_t *second)
 {
     if (first == NULL) return second;
     if (second == NULL) return first;
+
+    // Choices between single bytes (e.g. `a-z,A-Z,_) are merged into a byte
+    // set that can be matched with a single lookup:
+    uint64_t bits[4] = {0}, nocase_bits[4] = {0};
+    if (add_to_byteset(first, bits, nocase_bits) && add_to_byteset(second, bits, nocase_bits)) {
+        bp_pat_t *set = Pattern(BP_BYTESET, first->start, second->end, 1, 1, .bits={0});
+        memcpy(When(set, BP_BYTESET)->bits, bits, sizeof(bits));
+        memcpy(When(set, BP_BYTESET)->nocase_bits, nocase_bits, sizeof(nocase_bits));
+        return set;
+    }
+
+    // Alternatives that start with the same string (e.g. "foo"/"fob") share
+    // that prefix: "fo" ("o"/"b"). Since a string literal always matches the
+    // same way, this doesn't change what the choice matches.
+    bp_pat_t *rest1, *rest2;
+    bp_pat_t *str1 = leading_string(first, &rest1), *str2 = leading_string(second, &rest2);
+    if (str1 && str2) {
+        size_t len1 = str1->min_matchlen, len2 = str2->min_matchlen, common = 0;
+        const char *s1 = When(str1, BP_STRING)->string, *s2 = When(str2, BP_STRING)->string;
+        while (common < len1 && common < len2 && s1[common] == s2[common])
+            ++common;
+        if (common > 0) {
+            bp_pat_t *empty = Pattern(BP_STRING, first->start, second->end, 0, 0, .string="");
+            bp_pat_t *after1 = chain_together(substring(str1, common, len1), rest1);
+            bp_pat_t *after2 = chain_together(substring(str2, common, len2), rest2);
+            bp_pat_t *factored = chain_together(substring(str1, 0, common),
+                                                either_pat(after1 ? after1 : empty, after2 ? after2 : empty));
+            // The parser continues after the end of the choice, so it has to
+            // span both alternatives (even if the last one is only the prefix):
+            factored->start = first->start;
+            factored->end = second->end;
+            return factored;
+        }
+    }
+
+    // Since choices are ordered but associative, the first pattern can also be
+    // merged with the first of a series of choices: a/(b/c) == (a/b)/c
+    if (second->type == BP_OTHERWISE) {
+        bp_pat_t *next = When(second, BP_OTHERWISE)->first;
+        uint64_t scratch[4] = {0}, nocase_scratch[4] = {0};
+        bool bytes = add_to_byteset(first, scratch, nocase_scratch) && add_to_byteset(next, scratch, nocase_scratch);
+        bp_pat_t *next_str = str1 ? leading_string(next, &rest2) : NULL;
+        if (bytes || (next_str && When(str1, BP_STRING)->string[0] == When(next_str, BP_STRING)->string[0]
+                      && str1->min_matchlen > 0 && next_str->min_matchlen > 0))
+            return either_pat(either_pat(first, next), When(second, BP_OTHERWISE)->second);
+    }
     size_t minlen = first->min_matchlen < second->min_matchlen ? first->min_matchlen : second->min_matchlen;
     ssize_t maxlen = (UNBOUNDED(first) || UNBOUNDED(second)) ? (ssize_t)-1 : 
         (first->max_matchlen > second->max_matchlen ? first->max_matchlen : second->max_matchlen);
-    return Pattern(BP_OTHERWISE, first->start, second->end, minlen, maxlen, .first=first, .second=second);
+    bp_pat_t *choice = Pattern(BP_OTHERWISE, first->start, second->end, minlen, maxlen, .first=first, .second=second);
+    uint64_t *first_bytes = When(choice, BP_OTHERWISE)->first_bytes;
+    if (!add_first_bytes(first, first_bytes))
+        memset(first_bytes, 0xFF, sizeof(uint64_t[4]));
+    return choice;
 }
 
 //
@@ -207,7 +567,8 @@ static bp_pat_t *_bp_definition(const char *start, const char *end)
     }
     bp_pat_t *next_def = _bp_definition(after_spaces(str, true, end), end);
     return Pattern(BP_DEFINITIONS, start, next_def ? next_def->end : str, 0, -1,
-                   .name=start, .namelen=namelen, .meaning=def, .next_def=next_def);
+                   .name=start, .namelen=namelen, .name_id=intern_name(start, namelen),
+                   .meaning=def, .next_def=next_def);
 }
 
 //
@@ -289,7 +650,7 @@ static bp_pat_t *_bp_simplepattern(const char *str, const char *end, bool inside
                 all = either_pat(all, pat);
             } else {
                 size_t len = (size_t)(str - c1_loc);
-                bp_pat_t *pat = Pattern(BP_STRING, start, str, len, (ssize_t)len, .string=strndup(c1_loc, len));
+                bp_pat_t *pat = Pattern(BP_STRING, start, str, len, (ssize_t)len, .string=copy_string(c1_loc, len));
                 all = either_pat(all, pat);
             }
         } while (*str++ == ',');
@@ -356,7 +717,7 @@ static bp_pat_t *_bp_simplepattern(const char *str, const char *end, bool inside
         size_t len = (size_t)(str - litstart);
         str = next_char(str, end);
         if (c == '}') ++start; // Don't include the "}" in the pattern source range
-        return Pattern(BP_STRING, start, str, len, (ssize_t)len, .string=strndup(litstart, len));
+        return Pattern(BP_STRING, start, str, len, (ssize_t)len, .string=copy_string(litstart, len));
     }
     // Not <pat>
     case '!': {
@@ -484,7 +845,8 @@ static bp_pat_t *_bp_simplepattern(const char *str, const char *end, bool inside
             parse_err(str, str, "There should be a valid pattern here to capture after the '@'");
 
         return Pattern(BP_CAPTURE, start, pat->end, pat->min_matchlen, pat->max_matchlen,
-                       .pat = pat, .name = name, .namelen = namelen, .backreffable = backreffable);
+                       .pat = pat, .name = name, .namelen = namelen, .backreffable = backreffable,
+                       .name_id = name ? intern_name(name, namelen) : 0);
     }
     // Start of file/line
     case '^': {
@@ -505,7 +867,7 @@ static bp_pat_t *_bp_simplepattern(const char *str, const char *end, bool inside
         if (!isalpha(c) && c != '_') return NULL;
         str = after_name(start, end);
         size_t namelen = (size_t)(str - start);
-        return Pattern(BP_REF, start, str, 0, -1, .name=start, .len=namelen);
+        return Pattern(BP_REF, start, str, 0, -1, .name=start, .len=namelen, .name_id=intern_name(start, namelen));
     }
     }
 }
@@ -514,7 +876,7 @@ static bp_pat_t *_bp_simplepattern(const char *str, const char *end, bool inside
 // Similar to bp_simplepattern, except that the pattern begins with an implicit
 // '}' open quote that can be closed with '{'
 //
-public maybe_pat_t bp_stringpattern(const char *str, const char *end)
+static maybe_pat_t _bp_stringpattern(const char *str, const char *end)
 {
     __TRY_PATTERN__
     if (!end) end = str + strlen(str);
@@ -522,7 +884,7 @@ public maybe_pat_t bp_stringpattern(const char *str, const char *end)
     while (str < end && *str != '{')
         str = next_char(str, end);
     size_t len = (size_t)(str - start);
-    bp_pat_t *pat = len > 0 ? Pattern(BP_STRING, start, str, len, (ssize_t)len, .string=strndup(start, len)) : NULL;
+    bp_pat_t *pat = len > 0 ? Pattern(BP_STRING, start, str, len, (ssize_t)len, .string=copy_string(start, len)) : NULL;
     str += 1;
     if (str < end) {
         bp_pat_t *interp = bp_pattern_nl(str, end, true);
@@ -571,7 +933,7 @@ static bp_pat_t *bp_simplepattern(const char *str, const char *end)
 // Given a pattern and a replacement string, compile the two into a BP
 // replace pattern.
 //
-public maybe_pat_t bp_replacement(bp_pat_t *replacepat, const char *replacement, const char *end)
+static maybe_pat_t _bp_replacement(bp_pat_t *replacepat, const char *replacement, const char *end)
 {
     const char *p = replacement;
     if (!end) end = replacement + strlen(replacement);
@@ -585,8 +947,7 @@ public maybe_pat_t bp_replacement(bp_pat_t *replacepat, const char *replacement,
     }
     __END_TRY_PATTERN__
     size_t rlen = (size_t)(p-replacement);
-    char *rcpy = new(char[rlen + 1]);
-    memcpy(rcpy, replacement, rlen);
+    char *rcpy = copy_string(replacement, rlen);
     bp_pat_t *pat = Pattern(BP_REPLACE, replacepat->start, replacepat->end, replacepat->min_matchlen, replacepat->max_matchlen,
                          .pat=replacepat, .text=rcpy, .len=rlen);
     return (maybe_pat_t){.success = true, .value.pat = pat};
@@ -607,13 +968,13 @@ static bp_pat_t *bp_pattern_nl(const char *str, const char *end, bool allow_nl)
 //
 public bp_pat_t *bp_raw_literal(const char *str, size_t len)
 {
-    return Pattern(BP_STRING, str, &str[len], len, (ssize_t)len, .string=strndup(str, len));
+    return Pattern(BP_STRING, str, &str[len], len, (ssize_t)len, .string=copy_string(str, len));
 }
 
 //
 // Compile a string representing a BP pattern into a pattern object.
 //
-public maybe_pat_t bp_pattern(const char *str, const char *end)
+static maybe_pat_t _bp_pattern(const char *str, const char *end)
 {
     str = after_spaces(str, true, end);
     if (!end) end = str + strlen(str);
@@ -628,49 +989,236 @@ public maybe_pat_t bp_pattern(const char *str, const char *end)
         return (maybe_pat_t){.success = false, .value.error.start = str, .value.error.end = end, .value.error.msg = "Failed to parse this pattern"};
 }
 
+//
+// Compile a string representing a BP pattern into a pattern object (in a new
+// arena, unless a pattern is already being compiled).
+//
+public maybe_pat_t bp_pattern(const char *str, const char *end)
+{
+    bool started = begin_compiling();
+    return finish_compiling(started, _bp_pattern(str, end));
+}
+
+//
+// Compile a string pattern (text with interpolated patterns) into a pattern
+// object (in a new arena, unless a pattern is already being compiled).
+//
+public maybe_pat_t bp_stringpattern(const char *str, const char *end)
+{
+    bool started = begin_compiling();
+    return finish_compiling(started, _bp_stringpattern(str, end));
+}
+
+//
+// Compile a pattern and a replacement string into a BP replace pattern (in a
+// new arena, unless a pattern is already being compiled).
+//
+public maybe_pat_t bp_replacement(bp_pat_t *replacepat, const char *replacement, const char *end)
+{
+    bool started = begin_compiling();
+    return finish_compiling(started, _bp_replacement(replacepat, replacement, end));
+}
+
+//
+// Free an arena and all of the patterns in it, then set the input pointer to
+// NULL.
+//
+public void free_pat_arena(bp_pat_arena_t **at_arena)
+{
+    bp_pat_arena_t *arena = *at_arena;
+    for (pat_block_t *block = arena->blocks, *next; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    if (arena->home) *(arena->home) = arena->next;
+    if (arena->next) arena->next->home = arena->home;
+    if (arena == default_arena) default_arena = NULL;
+    delete(at_arena);
+}
+
+//
+// Free all of the patterns allocated on this thread.
+//
 public void free_all_pats(void)
 {
-    while (allocated_pats) {
-        bp_pat_t *tofree = allocated_pats;
-        allocated_pats = tofree->next;
-        delete(&tofree);
+    while (arenas) {
+        bp_pat_arena_t *arena = arenas;
+        free_pat_arena(&arena);
     }
 }
 
-public void delete_pat(bp_pat_t **at_pat, bool recursive)
+//
+// Look up a rule by the ID of its name from definitions.
+//
+public bp_pat_t *lookup_def(bp_pat_t *defs, uint32_t name_id)
+{
+    while (defs) {
+        if (defs->type == BP_CHAIN) {
+            auto chain = When(defs, BP_CHAIN);
+            bp_pat_t *second = lookup_def(chain->second, name_id);
+            if (second) return second;
+            defs = chain->first;
+        } else if (defs->type == BP_DEFINITIONS) {
+            auto def = When(defs, BP_DEFINITIONS);
+            if (def->name_id == name_id)
+                return def->meaning;
+            defs = def->next_def;
+        } else {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// The most rules that can_have_type() keeps track of
+#define MAX_RULES_CHECKED 64
+
+//
+// Return whether a pattern's match trees could have a match for a pattern of
+// one of the given types (a bitmask of `1 << type`), following references to
+// the given definitions. If it's not clear, this returns true.
+//
+static bool can_have_type(bp_pat_t *pat, bp_pat_t *defs, uint64_t types, uint32_t checked[MAX_RULES_CHECKED], size_t *nchecked)
+{
+    if (!pat) return false;
+    if (types & ((uint64_t)1 << pat->type)) return true;
+#define CHECK(p) can_have_type(p, defs, types, checked, nchecked)
+    switch (pat->type) {
+    case BP_NOT: return CHECK(When(pat, BP_NOT)->pat);
+    case BP_UPTO: return CHECK(When(pat, BP_UPTO)->target) || CHECK(When(pat, BP_UPTO)->skip);
+    case BP_UPTO_STRICT: return CHECK(When(pat, BP_UPTO_STRICT)->target) || CHECK(When(pat, BP_UPTO_STRICT)->skip);
+    case BP_REPEAT: return CHECK(When(pat, BP_REPEAT)->repeat_pat) || CHECK(When(pat, BP_REPEAT)->sep);
+    case BP_BEFORE: return CHECK(When(pat, BP_BEFORE)->pat);
+    case BP_AFTER: return CHECK(When(pat, BP_AFTER)->pat);
+    case BP_CAPTURE: return CHECK(When(pat, BP_CAPTURE)->pat);
+    case BP_TAGGED: return CHECK(When(pat, BP_TAGGED)->pat);
+    case BP_OTHERWISE: return CHECK(When(pat, BP_OTHERWISE)->first) || CHECK(When(pat, BP_OTHERWISE)->second);
+    case BP_CHAIN: return CHECK(When(pat, BP_CHAIN)->first) || CHECK(When(pat, BP_CHAIN)->second);
+    case BP_MATCH: return CHECK(When(pat, BP_MATCH)->pat) || CHECK(When(pat, BP_MATCH)->must_match);
+    case BP_NOT_MATCH: return CHECK(When(pat, BP_NOT_MATCH)->pat) || CHECK(When(pat, BP_NOT_MATCH)->must_not_match);
+    case BP_REPLACE: return CHECK(When(pat, BP_REPLACE)->pat);
+    case BP_DEFINITIONS:
+        // Definitions inside of a pattern can be used by the rest of it
+        return CHECK(When(pat, BP_DEFINITIONS)->meaning) || CHECK(When(pat, BP_DEFINITIONS)->next_def);
+    case BP_REF: {
+        uint32_t name_id = When(pat, BP_REF)->name_id;
+        for (size_t i = 0; i < *nchecked; i++)
+            if (checked[i] == name_id) return false;
+        if (*nchecked >= MAX_RULES_CHECKED) return true;
+        checked[(*nchecked)++] = name_id;
+        return CHECK(lookup_def(defs, name_id));
+    }
+    case BP_LEFTRECURSION: return true;
+    default: return false;
+    }
+#undef CHECK
+}
+
+//
+// Return whether a pattern's matches could have replacements in them (using
+// the given definitions), which means that printing a match needs its whole
+// match tree, not just where it starts and ends.
+//
+public bool has_replacements(bp_pat_t *pat, bp_pat_t *defs)
+{
+    uint32_t checked[MAX_RULES_CHECKED];
+    size_t nchecked = 0;
+    return can_have_type(pat, defs, (uint64_t)1 << BP_REPLACE, checked, &nchecked);
+}
+
+//
+// Return whether a pattern's matches could have captures (or tags) or
+// replacements in them (using the given definitions).
+//
+public bool has_captures(bp_pat_t *pat, bp_pat_t *defs)
 {
-    bp_pat_t *pat = *at_pat;
-    if (!pat) return;
+    uint32_t checked[MAX_RULES_CHECKED];
+    size_t nchecked = 0;
+    uint64_t types = ((uint64_t)1 << BP_CAPTURE) | ((uint64_t)1 << BP_TAGGED) | ((uint64_t)1 << BP_REPLACE);
+    return can_have_type(pat, defs, types, checked, &nchecked);
+}
 
-#define T(tag, ...) case tag: { auto _data = When(pat, tag); __VA_ARGS__; break; }
-#define F(field) delete_pat(&_data->field, true)
-    if (recursive) {
+//
+// Return whether a pattern could match text with a newline in it (using the
+// given definitions). If `lookarounds` is true, this also checks whether the
+// pattern could look at text past a newline (or depend on where the file
+// starts or ends). If it's not clear, this returns true.
+//
+static bool _can_match_newline(bp_pat_t *pat, bp_pat_t *defs, bool lookarounds, uint32_t checked[MAX_RULES_CHECKED], size_t *nchecked)
+{
+    if (!pat) return false;
+#define CHECK(p) _can_match_newline(p, defs, lookarounds, checked, nchecked)
+    if (lookarounds) {
         switch (pat->type) {
-        T(BP_DEFINITIONS, F(meaning), F(next_def))
-        T(BP_REPEAT, F(sep), F(repeat_pat))
-        T(BP_CHAIN, F(first), F(second))
-        T(BP_UPTO, F(target), F(skip))
-        T(BP_UPTO_STRICT, F(target), F(skip))
-        T(BP_OTHERWISE, F(first), F(second))
-        T(BP_MATCH, F(pat), F(must_match))
-        T(BP_NOT_MATCH, F(pat), F(must_not_match))
-        T(BP_REPLACE, F(pat))
-        T(BP_CAPTURE, F(pat))
-        T(BP_TAGGED, F(pat))
-        T(BP_NOT, F(pat))
-        T(BP_AFTER, F(pat))
-        T(BP_BEFORE, F(pat))
-        T(BP_LEFTRECURSION, F(fallback))
-        T(BP_STRING, if (_data->string) { free((char*)_data->string); _data->string = NULL; })
+        case BP_NOT: return CHECK(When(pat, BP_NOT)->pat);
+        case BP_BEFORE: return CHECK(When(pat, BP_BEFORE)->pat);
+        case BP_AFTER: return CHECK(When(pat, BP_AFTER)->pat);
+        case BP_START_OF_FILE: case BP_END_OF_FILE: return true;
         default: break;
         }
     }
-#undef F
-#undef T
+    switch (pat->type) {
+    case BP_ANYCHAR: case BP_ID_START: case BP_ID_CONTINUE: return false;
+    case BP_STRING: return memchr(When(pat, BP_STRING)->string, '\n', pat->min_matchlen) != NULL;
+    case BP_RANGE: return When(pat, BP_RANGE)->low <= '\n' && '\n' <= When(pat, BP_RANGE)->high;
+    case BP_BYTESET: {
+        auto set = When(pat, BP_BYTESET);
+        return ((set->bits[0] | set->nocase_bits[0]) >> '\n') & 1;
+    }
+    // Lookarounds and anchors don't match any text:
+    case BP_NOT: case BP_BEFORE: case BP_AFTER: case BP_CURDENT: case BP_WORD_BOUNDARY:
+    case BP_START_OF_FILE: case BP_START_OF_LINE: case BP_END_OF_FILE: case BP_END_OF_LINE:
+        return false;
+    // Only the text matched by `pat` is part of these patterns' matches:
+    case BP_MATCH: return CHECK(When(pat, BP_MATCH)->pat);
+    case BP_NOT_MATCH: return CHECK(When(pat, BP_NOT_MATCH)->pat);
+    // Without a target or skip, `..` stops at the end of the line:
+    case BP_UPTO: return CHECK(When(pat, BP_UPTO)->target) || CHECK(When(pat, BP_UPTO)->skip);
+    case BP_UPTO_STRICT: return CHECK(When(pat, BP_UPTO_STRICT)->target) || CHECK(When(pat, BP_UPTO_STRICT)->skip);
+    case BP_REPEAT: return CHECK(When(pat, BP_REPEAT)->repeat_pat) || CHECK(When(pat, BP_REPEAT)->sep);
+    case BP_CAPTURE: return CHECK(When(pat, BP_CAPTURE)->pat);
+    case BP_TAGGED: return CHECK(When(pat, BP_TAGGED)->pat);
+    case BP_OTHERWISE: return CHECK(When(pat, BP_OTHERWISE)->first) || CHECK(When(pat, BP_OTHERWISE)->second);
+    case BP_CHAIN: return CHECK(When(pat, BP_CHAIN)->first) || CHECK(When(pat, BP_CHAIN)->second);
+    case BP_REPLACE: return CHECK(When(pat, BP_REPLACE)->pat);
+    case BP_DEFINITIONS: return CHECK(When(pat, BP_DEFINITIONS)->meaning) || CHECK(When(pat, BP_DEFINITIONS)->next_def);
+    case BP_REF: {
+        uint32_t name_id = When(pat, BP_REF)->name_id;
+        for (size_t i = 0; i < *nchecked; i++)
+            if (checked[i] == name_id) return false;
+        bp_pat_t *def = lookup_def(defs, name_id);
+        // Names that aren't defined (e.g. backreferences) can't be checked:
+        if (!def || *nchecked >= MAX_RULES_CHECKED) return true;
+        checked[(*nchecked)++] = name_id;
+        return CHECK(def);
+    }
+    default: return true;
+    }
+#undef CHECK
+}
+
+//
+// Return whether a pattern could match text with a newline in it (using the
+// given definitions), which means its matches could span multiple lines.
+//
+public bool can_match_newline(bp_pat_t *pat, bp_pat_t *defs)
+{
+    uint32_t checked[MAX_RULES_CHECKED];
+    size_t nchecked = 0;
+    return _can_match_newline(pat, defs, false, checked, &nchecked);
+}
 
-    if (pat->home) *(pat->home) = pat->next;
-    if (pat->next) pat->next->home = pat->home;
-    delete(at_pat);
+//
+// Return whether matching a pattern could depend on any text outside of the
+// line where the match starts (using the given definitions), either because
+// it could match a newline or look past one. If not, editing a line can only
+// change the matches on that line.
+//
+public bool depends_on_other_lines(bp_pat_t *pat, bp_pat_t *defs)
+{
+    uint32_t checked[MAX_RULES_CHECKED];
+    size_t nchecked = 0;
+    return _can_match_newline(pat, defs, true, checked, &nchecked);
 }
 
 static int printf_pattern_size(const struct printf_info *info, size_t n, int argtypes[n], int sizes[n])
@@ -696,6 +1244,7 @@ static int printf_pattern(FILE *stream, const struct printf_info *info, const vo
         P(ID_CONTINUE)
         P(STRING, "(\"%s\")", data.string)
         P(RANGE, "('%c'-'%c')", data.low, data.high)
+        P(BYTESET, "(%.*s)", (int)(pat->end - pat->start), pat->start)
         P(NOT, "(%P)", data.pat)
         P(UPTO, "(%P, skip=%P)", data.target, data.skip)
         P(UPTO_STRICT, "(%P, skip=%P)", data.target, data.skip)
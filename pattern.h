@@ -41,17 +41,18 @@ enum bp_pattype_e {
     BP_DEFINITIONS   = 26,
     BP_TAGGED        = 27,
     BP_LEFTRECURSION = 28,
+    BP_BYTESET       = 29,
 };
 
 //
-// A struct reperesenting a BP virtual machine operation
+// A struct reperesenting a BP virtual machine operation. The fields used
+// while matching come first, and the location in the source text (which is
+// mostly used for error messages and debugging) comes last.
 //
 typedef struct bp_pat_s bp_pat_t;
 struct bp_pat_s {
-    bp_pat_t *next, **home;
     enum bp_pattype_e type;
     uint32_t id;
-    const char *start, *end;
     // The bounds of the match length (used for backtracking)
     uint32_t min_matchlen;
     int32_t max_matchlen; // -1 means unbounded length
@@ -62,7 +63,7 @@ struct bp_pat_s {
         struct {} BP_ANYCHAR;
         struct {} BP_ID_START;
         struct {} BP_ID_CONTINUE;
-        struct {const char *string; size_t len; } BP_STRING;
+        struct {const char *string; } BP_STRING;
         struct {unsigned char low, high; } BP_RANGE;
         struct {bp_pat_t *pat;} BP_NOT;
         struct {bp_pat_t *target, *skip;} BP_UPTO;
@@ -79,9 +80,13 @@ struct bp_pat_s {
             const char *name;
             uint16_t namelen;
             bool backreffable;
+            uint32_t name_id;
         } BP_CAPTURE;
         struct {
             bp_pat_t *first, *second;
+            // Bytes that a match of `first` can start with (or every byte if
+            // that isn't known), so it can be skipped when it can't match
+            uint64_t first_bytes[4];
         } BP_OTHERWISE;
         struct {
             bp_pat_t *first, *second;
@@ -96,6 +101,7 @@ struct bp_pat_s {
         struct {
             const char *name;
             uint32_t len;
+            uint32_t name_id;
         } BP_REF;
         struct {} BP_NODENT;
         struct {} BP_CURDENT;
@@ -107,6 +113,7 @@ struct bp_pat_s {
         struct {
             const char *name;
             uint32_t namelen;
+            uint32_t name_id;
             bp_pat_t *meaning, *next_def;
         } BP_DEFINITIONS;
         struct {
@@ -122,9 +129,18 @@ struct bp_pat_s {
             void *ctx;
             bool visited;
         } BP_LEFTRECURSION;
+        struct {
+            // Bitmaps of which bytes are in the set (one bit per byte value),
+            // and which bytes match when ignoring case:
+            uint64_t bits[4], nocase_bits[4];
+        } BP_BYTESET;
     } __tagged;
+    const char *start, *end;
 };
 
+// An arena that patterns (and the strings they own) are allocated from
+typedef struct bp_pat_arena_s bp_pat_arena_t;
+
 typedef struct leftrec_info_s {
     struct bp_match_s *match;
     const char *at;
@@ -135,6 +151,9 @@ typedef struct leftrec_info_s {
 
 typedef struct {
     bool success;
+    // The arena holding the compiled pattern, which can be freed with
+    // free_pat_arena() once the pattern is no longer needed.
+    bp_pat_arena_t *arena;
     union {
         bp_pat_t *pat;
         struct {
@@ -145,6 +164,8 @@ typedef struct {
 
 __attribute__((returns_nonnull))
 bp_pat_t *allocate_pat(bp_pat_t pat);
+__attribute__((nonnull))
+uint32_t intern_name(const char *name, size_t len);
 __attribute__((nonnull, returns_nonnull))
 bp_pat_t *bp_raw_literal(const char *str, size_t len);
 __attribute__((nonnull(1)))
@@ -156,8 +177,17 @@ bp_pat_t *either_pat(bp_pat_t *first, bp_pat_t *second);
 __attribute__((nonnull(1)))
 maybe_pat_t bp_pattern(const char *str, const char *end);
 void free_all_pats(void);
+bp_pat_t *lookup_def(bp_pat_t *defs, uint32_t name_id);
+__attribute__((nonnull(1)))
+bool has_replacements(bp_pat_t *pat, bp_pat_t *defs);
+__attribute__((nonnull(1)))
+bool has_captures(bp_pat_t *pat, bp_pat_t *defs);
+__attribute__((nonnull(1)))
+bool can_match_newline(bp_pat_t *pat, bp_pat_t *defs);
+__attribute__((nonnull(1)))
+bool depends_on_other_lines(bp_pat_t *pat, bp_pat_t *defs);
 __attribute__((nonnull))
-void delete_pat(bp_pat_t **at_pat, bool recursive);
+void free_pat_arena(bp_pat_arena_t **at_arena);
 int set_pattern_printf_specifier(char specifier);
 
 // vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
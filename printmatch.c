@@ -190,12 +190,21 @@ public void explain_match(bp_match_t *m)
     printf("\033[?7h"); // Re-enable line wrapping
 }
 
+//
+// Write a string (e.g. a color escape sequence) and return the number of bytes
+// written. This avoids the overhead of parsing a format string with fprintf().
+//
+static inline int fputs_len(FILE *out, const char *str)
+{
+    return (int)fwrite(str, sizeof(char), strlen(str), out);
+}
+
 static inline int fputc_safe(FILE *out, char c, print_options_t *opts)
 {
     int printed = fputc(c, out);
     if (c == '\n' && opts && opts->on_nl) {
         opts->on_nl(out);
-        if (opts->replace_color) printed += fprintf(out, "%s", opts->replace_color);
+        if (opts->replace_color) printed += fputs_len(out, opts->replace_color);
     }
     return printed;
 }
@@ -207,7 +216,7 @@ public int fprint_match(FILE *out, const char *file_start, bp_match_t *m, print_
         auto rep = When(m->pat, BP_REPLACE);
         const char *text = rep->text;
         const char *end = &text[rep->len];
-        if (opts && opts->replace_color) printed += fprintf(out, "%s", opts->replace_color);
+        if (opts && opts->replace_color) printed += fputs_len(out, opts->replace_color);
 
         // TODO: clean up the line numbering code
         for (const char *r = text; r < end; ) {
@@ -230,7 +239,7 @@ public int fprint_match(FILE *out, const char *file_start, bp_match_t *m, print_
 
                 if (cap != NULL) {
                     printed += fprint_match(out, file_start, cap, opts);
-                    if (opts && opts->replace_color) printed += fprintf(out, "%s", opts->replace_color);
+                    if (opts && opts->replace_color) printed += fputs_len(out, opts->replace_color);
                     r = next;
                     continue;
                 }
@@ -242,10 +251,20 @@ public int fprint_match(FILE *out, const char *file_start, bp_match_t *m, print_
             if (r == text) {
                 if (opts && opts->fprint_between) {
                     printed += opts->fprint_between(out, m->start, m->start, opts->match_color);
-                    if (opts->replace_color) printed += fprintf(out, "%s", opts->replace_color);
+                    if (opts->replace_color) printed += fputs_len(out, opts->replace_color);
                 }
             }
 
+            // Copy runs of characters that need no special handling all at once:
+            size_t run = 0;
+            while (r + run < end && r[run] != '@' && r[run] != '\\' && r[run] != '\n')
+                ++run;
+            if (run > 0) {
+                printed += (int)fwrite(r, sizeof(char), run, out);
+                r += run;
+                continue;
+            }
+
             if (*r == '\\') {
                 ++r;
                 if (*r == 'N') { // \N (nodent)
@@ -256,8 +275,9 @@ public int fprint_match(FILE *out, const char *file_start, bp_match_t *m, print_
                     const char *line_start = m->start;
                     while (line_start > file_start && line_start[-1] != '\n') --line_start;
                     printed += fputc_safe(out, '\n', opts);
-                    for (const char *p = line_start; p < m->start && (*p == ' ' || *p == '\t'); ++p)
-                        printed += fputc(*p, out);
+                    const char *indent_end = line_start;
+                    while (indent_end < m->start && (*indent_end == ' ' || *indent_end == '\t')) ++indent_end;
+                    printed += (int)fwrite(line_start, sizeof(char), (size_t)(indent_end - line_start), out);
                     continue;
                 }
                 printed += fputc_safe(out, unescapechar(r, &r, end), opts);
@@ -267,7 +287,7 @@ public int fprint_match(FILE *out, const char *file_start, bp_match_t *m, print_
             }
         }
     } else {
-        if (opts && opts->match_color) printed += fprintf(out, "%s", opts->match_color);
+        if (opts && opts->match_color) printed += fputs_len(out, opts->match_color);
         const char *prev = m->start;
         for (int i = 0; m->children && m->children[i]; i++) {
             bp_match_t *child = m->children[i];
@@ -280,7 +300,7 @@ public int fprint_match(FILE *out, const char *file_start, bp_match_t *m, print_
                 else printed += fwrite(prev, sizeof(char), (size_t)(child->start - prev), out);
             }
             printed += fprint_match(out, file_start, child, opts);
-            if (opts && opts->match_color) printed += fprintf(out, "%s", opts->match_color);
+            if (opts && opts->match_color) printed += fputs_len(out, opts->match_color);
             prev = child->end;
         }
         if (m->end > prev) {
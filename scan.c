@@ -0,0 +1,312 @@
+//
+// scan.c - Code for scanning text for string literals.
+//
+// A single literal is found with memmem() (or memcasemem() when ignoring
+// case), a set of single bytes is found with a bitmap (checking 16 bytes at a
+// time when the set is made of a few ranges of bytes), and multiple literals
+// are found with an Aho-Corasick automaton that is compiled into a full DFA.
+// To keep the transition table small, bytes that no literal uses are
+// collapsed into one shared "other" byte class (and when ignoring case, both
+// cases of a letter share a byte class).
+//
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scan.h"
+#include "utils.h"
+
+// Upper limit on the number of automaton states (the total length of all
+// literals), which keeps the transition table from getting huge.
+#define MAX_SCANNER_STATES 4096
+// Byte sets with up to this many ranges of bytes are scanned 16 bytes at a time
+#define MAX_BYTE_RANGES 8
+
+// 16 bytes that are operated on in parallel (using GCC vector extensions)
+typedef unsigned char bytes16_t __attribute__((vector_size(16)));
+typedef signed char mask16_t __attribute__((vector_size(16)));
+
+#define IN_BITMAP(bits, c) (((bits)[(c) >> 6] >> ((c) & 63)) & 1)
+
+static inline unsigned char fold(unsigned char c)
+{
+    return ('A' <= c && c <= 'Z') ? (c | 0x20) : c;
+}
+
+struct literal_scanner_s {
+    // When there's only a single literal, memmem()/memcasemem() is used instead
+    const char *literal;
+    size_t literal_len;
+    bool ignorecase;
+    // Length of the longest literal
+    size_t maxlen;
+    // When all of the literals are a single byte, a bitmap of those bytes is
+    // used instead of the automaton
+    bool single_bytes;
+    uint64_t bytes[4];
+    // The bitmap's bytes as ranges (or nranges = 0 if there are too many)
+    size_t nranges;
+    unsigned char range_low[MAX_BYTE_RANGES], range_width[MAX_BYTE_RANGES];
+    // Map from byte to byte class
+    uint16_t classes[256];
+    size_t nclasses;
+    // Transition table: next[state*nclasses + class]
+    uint32_t *next;
+    // For each state, the length of the longest literal ending there (or 0)
+    size_t *longest;
+};
+
+//
+// Work out which ranges of bytes are in a scanner's bitmap, if there are few
+// enough of them to check for all at once.
+//
+static void find_byte_ranges(literal_scanner_t *scanner)
+{
+    size_t nranges = 0;
+    for (int c = 0; c < 256; ) {
+        if (!IN_BITMAP(scanner->bytes, c)) {
+            ++c;
+            continue;
+        }
+        int low = c;
+        while (c < 256 && IN_BITMAP(scanner->bytes, c)) ++c;
+        if (nranges >= MAX_BYTE_RANGES) return;
+        scanner->range_low[nranges] = (unsigned char)low;
+        scanner->range_width[nranges] = (unsigned char)(c - 1 - low);
+        ++nranges;
+    }
+    scanner->nranges = nranges;
+}
+
+//
+// Return the first byte in [str, end) that is in a scanner's byte set, or
+// NULL if there is none. When the set is made of a few ranges, 16 bytes at a
+// time are checked for being in any of the ranges (a byte is in a range if
+// subtracting the range's low end wraps around to no more than its width).
+//
+static const char *scan_bytes(literal_scanner_t *scanner, const char *str, const char *end)
+{
+    const char *p = str;
+    if (scanner->nranges > 0) {
+        for (; p + 16 <= end; p += 16) {
+            bytes16_t chunk;
+            memcpy(&chunk, p, sizeof(chunk));
+            mask16_t found = {0};
+            for (size_t i = 0; i < scanner->nranges; i++)
+                found |= (chunk - scanner->range_low[i]) <= scanner->range_width[i];
+            uint64_t any[2];
+            memcpy(any, &found, sizeof(any));
+            if (any[0] | any[1]) break;
+        }
+    }
+    for (; p < end; ++p) {
+        if (IN_BITMAP(scanner->bytes, (unsigned char)*p))
+            return p;
+    }
+    return NULL;
+}
+
+//
+// Compile a set of string literals into a scanner, or return NULL if there
+// are too many literals to compile.
+//
+literal_scanner_t *new_scanner(const char *literals[], const size_t lengths[], size_t n, bool ignorecase)
+{
+    size_t total = 1;
+    for (size_t i = 0; i < n; i++) {
+        if (lengths[i] == 0) return NULL;
+        total += lengths[i];
+    }
+    if (n == 0 || total > MAX_SCANNER_STATES) return NULL;
+
+    literal_scanner_t *scanner = new(literal_scanner_t);
+    for (size_t i = 0; i < n; i++)
+        if (lengths[i] > scanner->maxlen) scanner->maxlen = lengths[i];
+
+    if (n == 1) {
+        scanner->literal = literals[0];
+        scanner->literal_len = lengths[0];
+        scanner->ignorecase = ignorecase;
+        return scanner;
+    }
+
+    if (scanner->maxlen == 1) {
+        scanner->single_bytes = true;
+        for (size_t i = 0; i < n; i++) {
+            unsigned char c = (unsigned char)literals[i][0];
+            scanner->bytes[c >> 6] |= (uint64_t)1 << (c & 63);
+            if (ignorecase) {
+                c = (unsigned char)(isupper(c) ? tolower(c) : toupper(c));
+                scanner->bytes[c >> 6] |= (uint64_t)1 << (c & 63);
+            }
+        }
+        find_byte_ranges(scanner);
+        return scanner;
+    }
+
+    // Class 0 is for bytes that don't appear in any literal
+    scanner->nclasses = 1;
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < lengths[i]; j++) {
+            unsigned char c = (unsigned char)literals[i][j];
+            if (ignorecase) c = (unsigned char)tolower(c);
+            if (scanner->classes[c]) continue;
+            scanner->classes[c] = (uint16_t)scanner->nclasses;
+            if (ignorecase) scanner->classes[toupper(c)] = (uint16_t)scanner->nclasses;
+            ++scanner->nclasses;
+        }
+    }
+
+    // Build the trie, using UINT32_MAX for missing transitions
+    size_t nc = scanner->nclasses;
+    uint32_t *next = new(uint32_t[total * nc]);
+    memset(next, 0xFF, sizeof(uint32_t[total * nc]));
+    size_t *longest = new(size_t[total]);
+    uint32_t nstates = 1;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t state = 0;
+        for (size_t j = 0; j < lengths[i]; j++) {
+            uint16_t cls = scanner->classes[(unsigned char)literals[i][j]];
+            if (next[state*nc + cls] == UINT32_MAX)
+                next[state*nc + cls] = nstates++;
+            state = next[state*nc + cls];
+        }
+        if (lengths[i] > longest[state]) longest[state] = lengths[i];
+    }
+
+    // Breadth-first traversal to fill in failure transitions. Since states
+    // are visited in order of depth, a state's failure state is finished
+    // before the state itself is.
+    uint32_t *fail = new(uint32_t[nstates]);
+    uint32_t *queue = new(uint32_t[nstates]);
+    size_t qstart = 0, qend = 0;
+    for (size_t cls = 0; cls < nc; cls++) {
+        if (next[cls] == UINT32_MAX) {
+            next[cls] = 0;
+        } else {
+            fail[next[cls]] = 0;
+            queue[qend++] = next[cls];
+        }
+    }
+    while (qstart < qend) {
+        uint32_t state = queue[qstart++];
+        if (longest[fail[state]] > longest[state])
+            longest[state] = longest[fail[state]];
+        for (size_t cls = 0; cls < nc; cls++) {
+            uint32_t *t = &next[state*nc + cls];
+            if (*t == UINT32_MAX) {
+                *t = next[fail[state]*nc + cls];
+            } else {
+                fail[*t] = next[fail[state]*nc + cls];
+                queue[qend++] = *t;
+            }
+        }
+    }
+    delete(&fail);
+    delete(&queue);
+
+    scanner->next = next;
+    scanner->longest = longest;
+    return scanner;
+}
+
+//
+// Return the leftmost position in [str, end) where one of the scanner's
+// literals begins, or NULL if there is none.
+//
+const char *scan_literals(literal_scanner_t *scanner, const char *str, const char *end)
+{
+    if (str >= end) return NULL;
+    if (scanner->literal)
+        return (scanner->ignorecase ? memcasemem : memmem)(str, (size_t)(end - str), scanner->literal, scanner->literal_len);
+
+    if (scanner->single_bytes)
+        return scan_bytes(scanner, str, end);
+
+    size_t nc = scanner->nclasses;
+    uint32_t state = 0;
+    const char *best = NULL;
+    for (const char *p = str; p < end; ++p) {
+        state = scanner->next[state*nc + scanner->classes[(unsigned char)*p]];
+        if (scanner->longest[state]) {
+            const char *start = p + 1 - scanner->longest[state];
+            if (!best || start < best) best = start;
+        }
+        // Any literal starting before `best` would have ended by now:
+        if (best && p + 1 >= best + scanner->maxlen)
+            return best;
+    }
+    return best;
+}
+
+//
+// Return the length of the scanner's longest literal.
+//
+size_t scanner_max_length(literal_scanner_t *scanner)
+{
+    return scanner->maxlen;
+}
+
+//
+// Return whether two strings of the given length are equal, ignoring ASCII
+// case differences. Unlike strncasecmp(), this doesn't stop at NUL bytes.
+//
+bool memcaseeq(const char *a, const char *b, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        if (fold((unsigned char)a[i]) != fold((unsigned char)b[i]))
+            return false;
+    return true;
+}
+
+//
+// A case-insensitive version of memmem(). Candidate positions are found by
+// checking 16 positions at a time for the first and last bytes of the needle,
+// matching either case of a letter by setting the 0x20 (lowercase) bit before
+// comparing. The rest of the needle is only compared at candidate positions.
+//
+void *memcasemem(const void *haystack, size_t haystack_len, const void *needle, size_t needle_len)
+{
+    const char *str = haystack, *lit = needle;
+    if (needle_len == 0) return (void*)str;
+    if (needle_len > haystack_len) return NULL;
+
+    unsigned char first = fold((unsigned char)lit[0]), last = fold((unsigned char)lit[needle_len-1]);
+    unsigned char first_bit = isalpha(first) ? 0x20 : 0, last_bit = isalpha(last) ? 0x20 : 0;
+    // Matches can only start in [str, stop):
+    const char *stop = &str[haystack_len - needle_len + 1];
+    const char *p = str;
+    for (; p + 16 <= stop; p += 16) {
+        bytes16_t starts, ends;
+        memcpy(&starts, p, sizeof(starts));
+        memcpy(&ends, p + needle_len - 1, sizeof(ends));
+        mask16_t candidates = ((starts | first_bit) == first) & ((ends | last_bit) == last);
+        uint64_t any[2];
+        memcpy(any, &candidates, sizeof(any));
+        if (!(any[0] | any[1])) continue;
+        for (int i = 0; i < 16; i++) {
+            if (candidates[i] && memcaseeq(p + i, lit, needle_len))
+                return (void*)(p + i);
+        }
+    }
+    for (; p < stop; p++) {
+        if (fold((unsigned char)*p) == first && memcaseeq(p, lit, needle_len))
+            return (void*)p;
+    }
+    return NULL;
+}
+
+//
+// Free the memory used by a scanner.
+//
+void destroy_scanner(literal_scanner_t **at_scanner)
+{
+    literal_scanner_t *scanner = *at_scanner;
+    if (scanner->next) delete(&scanner->next);
+    if (scanner->longest) delete(&scanner->longest);
+    delete(at_scanner);
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
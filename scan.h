@@ -0,0 +1,25 @@
+//
+// scan.h - Header file for scanning text for string literals.
+//
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A compiled set of string literals that can be searched for all at once
+typedef struct literal_scanner_s literal_scanner_t;
+
+__attribute__((nonnull))
+literal_scanner_t *new_scanner(const char *literals[], const size_t lengths[], size_t n, bool ignorecase);
+__attribute__((nonnull, pure))
+const char *scan_literals(literal_scanner_t *scanner, const char *str, const char *end);
+__attribute__((nonnull, pure))
+size_t scanner_max_length(literal_scanner_t *scanner);
+__attribute__((nonnull))
+void destroy_scanner(literal_scanner_t **at_scanner);
+__attribute__((nonnull, pure))
+bool memcaseeq(const char *a, const char *b, size_t len);
+__attribute__((nonnull, pure))
+void *memcasemem(const void *haystack, size_t haystack_len, const void *needle, size_t needle_len);
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
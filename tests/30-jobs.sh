@@ -0,0 +1,3 @@
+# Files can be searched in parallel with -j, but output stays in order
+# Example: bp -j 4 'foo' *.txt
+bp -j 3 -f file:line '{"foo"}' tests/01-literal.in tests/06-start-of-line.in tests/10-words.in
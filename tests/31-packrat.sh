@@ -0,0 +1,3 @@
+# With -p, rule matches are cached, so alternatives that share a prefix don't re-match it
+# Example: bp -p '{(call `;) / (call `{) / call}'
+bp -p '{call: id parens; sum: (sum _ `+ _ call) / call; ((sum `;) / (sum _ `{) / sum) => "[@0]"}'
@@ -0,0 +1,3 @@
+# Alternations of string literals are found by scanning for all of them at once
+# Example: bp '{"TODO" / "FIXME" / "XXX"}'
+bp -i '{("TODO" / "FIXME" / "fix" / "XXX") => "<@0>"}'
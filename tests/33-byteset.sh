@@ -0,0 +1,3 @@
+# Choices between single characters are combined into a set of bytes
+# Example: bp '{+`a-f,0-9,_}'
+bp '{3+`a-f,0-9,_ => "<@0>"}'
@@ -0,0 +1,3 @@
+# With --stream, matches are printed as soon as enough input has been read
+# Example: tail -f log.txt | bp --stream ERROR
+bp -M 8 -C 1 '{"id=" +`0-9}'
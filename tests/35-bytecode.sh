@@ -0,0 +1,3 @@
+# Patterns without captures are compiled to bytecode, including recursive rules
+# Example: bp '{parens _ "=>" _ 1-3 +`0-9 % ","}'
+bp '{parens _ "=>" _ 1-3 (string / +`0-9) % ","}'
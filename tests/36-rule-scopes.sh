@@ -0,0 +1,3 @@
+# Definitions can be shadowed by inner definitions, even in left-recursive rules
+# Example: bp '{num: +`0-9; (num: +`a-z; num) _ "=" _ num}'
+bp '{sum: sum _ "+" _ num / num; num: +`0-9; @(num: +`a-z; sum) _ "=" _ sum}'
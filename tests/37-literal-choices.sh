@@ -0,0 +1,9 @@
+# Choices between strings with a shared prefix still match in order
+# Example: bp '{"fo" / "foo" / "fob"}'
+bp '{@("for" "each" / "fo" @o=. / "f" "ox" / "do" / "d" `e-o) _ "=" _ `"}'
+# A choice whose last alternative is only the shared prefix still ends after that alternative
+bp '{("foo" / "fo") " = "}'
+# Fused literals still span everything they were fused from, so nothing after them gets dropped
+bp '{("q" ("ab" / "ac")) "d"}'
+bp '{("q" (`a / `a "b")) "c"}'
+bp '{..%("q" (`a / `a "b")) "c"}'
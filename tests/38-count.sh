@@ -0,0 +1,3 @@
+# Count the matches instead of printing them
+# Example: bp --count '{"TODO"}' *.c
+bp --count '{+`0-9 / "x"}'
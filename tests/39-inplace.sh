@@ -0,0 +1,7 @@
+# With -I, files are overwritten with the replaced text
+# Example: bp -I '{"foo"}' -r 'baz' file.txt replaces each "foo" in file.txt with "baz"
+tmp="$(mktemp)"
+cat >"$tmp"
+bp -I '{"foo"}' -r 'baz' "$tmp" >/dev/null
+cat "$tmp"
+rm -f "$tmp"
@@ -0,0 +1,9 @@
+# When searching directories, files listed in .gitignore or .ignore files are skipped
+# Example: bp '{"TODO"}' searches all files in the current directory that aren't ignored
+dir="$(mktemp -d)"
+mkdir -p "$dir/src" "$dir/build"
+while IFS=: read -r name text; do
+    printf '%s\n' "$text" >>"$dir/$name"
+done
+bp -f file:line '{"foo"}' "$dir" | sed "s|^$dir/||"
+rm -rf "$dir"
@@ -0,0 +1,5 @@
+# Start-of-line matches are found on every line, including empty ones
+# Example: bp '{^ => "> "}' quotes every line
+bp '{^ => "> "}'
+# Including a line start at the very end of the text, after the last newline
+bp '{$ ^ => "<>"}'
@@ -0,0 +1,3 @@
+# --profile prints how many times each rule was matched (times vary, so they're left out here)
+# Example: bp --profile -g c '{function-def}' prints which C grammar rules took the most time
+bp --profile '{sum: sum "+" num / num; num: +`0-9; "total=" sum}' 2>&1 >/dev/null | awk '{print $1, $2, $3, $4, $5}' | sort
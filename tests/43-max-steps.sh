@@ -0,0 +1,4 @@
+# --max-steps stops searches that take too many steps, with exit status 2
+# Example: bp --max-steps 1000000 '{"a" .. "b"}' gives up instead of taking quadratic time
+bp --max-steps 5000 '{"a" .. "b"}' 2>&1; echo "exit status: $?"
+bp --max-steps 5000 '{"aab"}'; echo "exit status: $?"
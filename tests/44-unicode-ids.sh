@@ -0,0 +1,3 @@
+# Identifiers can have non-ASCII characters in them
+# Example: bp '{id}' -r '[@0]' puts brackets around each identifier
+bp '{id}' -r '[@0]'
@@ -0,0 +1,9 @@
+# With --patterns-file, each pattern defined in a file is searched for in one go, and matches are labeled with its name
+# Example: bp --patterns-file lint.bp src/ checks every file in src/ for each lint rule in lint.bp
+dir="$(mktemp -d)"
+printf '%s\n' 'todo: "TODO" ..$' 'trailing-space: +` >$' 'assignment: id _ "=" !`=' >"$dir/lint.bp"
+cat >"$dir/code.c"
+printf 'nothing to see\n' >"$dir/other.c"
+bp --patterns-file "$dir/lint.bp" -f file:line "$dir/code.c" "$dir/other.c" | sed "s|^$dir/||"
+bp --patterns-file "$dir/lint.bp" --count "$dir/code.c"
+rm -rf "$dir"
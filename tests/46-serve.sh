@@ -0,0 +1,15 @@
+# With --serve, bp answers search requests (JSON lines) from stdin with results (JSON lines), keeping compiled patterns and loaded files between requests
+# Example: printf '{"id":1,"pattern":"TODO","files":["src"]}\n' | bp --serve prints one line per TODO and a "done" line
+dir="$(mktemp -d)"
+cat >"$dir/code.c"
+printf 'nothing to see\n' >"$dir/other.c"
+bp --serve <<END | sed "s|$dir/||g"
+{"id": 1, "pattern": "TODO", "files": ["$dir/code.c", "$dir/other.c"]}
+{"id": 2, "pattern": "{comment}", "grammars": ["c"], "files": ["$dir"], "mode": "count"}
+{"id": 3, "pattern": "TODO", "files": ["$dir"], "mode": "files"}
+{"id": 4, "pattern": "{undefined}", "files": ["$dir/code.c"]}
+{"id": 5, "pattern": "x", "files": ["$dir/missing.c"]}
+{"id": 6}
+{"id": 7, "pattern": "TODO", "files": ["$dir/code.c"], "max_steps": 1e3}
+END
+rm -rf "$dir"
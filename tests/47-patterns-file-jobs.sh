@@ -0,0 +1,10 @@
+# With --patterns-file and --jobs, a large file's search for each pattern is split between threads, with the same results as a single thread
+# Example: bp --patterns-file lint.bp -j4 --count big.c counts each lint rule's matches in big.c using 4 threads
+dir="$(mktemp -d)"
+cat >"$dir/lint.bp"
+# Big enough (over 4MB) to be searched by several threads at once:
+awk 'BEGIN { for (i = 0; i < 120000; i++) printf "int x%d = %d; // TODO: item %d  \n", i, i, i }' >"$dir/big.c"
+bp --patterns-file "$dir/lint.bp" -j4 --count "$dir/big.c"
+bp --patterns-file "$dir/lint.bp" -j4 -f file:line "$dir/big.c" | sed "s|^$dir/||" | sort | cksum
+bp --patterns-file "$dir/lint.bp" -j1 -f file:line "$dir/big.c" | sed "s|^$dir/||" | sort | cksum
+rm -rf "$dir"
@@ -0,0 +1,11 @@
+# With --jobs, a large file isn't split between threads when a literal in the pattern has a newline in it
+# Example: with a pattern like '{"a<newline>b"}', bp -j4 searches big.txt in one piece instead of splitting it
+dir="$(mktemp -d)"
+# Big enough (over 4MB) to be searched by several threads at once:
+awk 'BEGIN { for (i = 0; i < 400000; i++) printf "foo %d\n", i }' >"$dir/big.txt"
+pat='{"foo " +`0-9 "
+foo"}'
+bp -j4 --count "$pat" "$dir/big.txt"
+bp -j4 -f bare "$pat" "$dir/big.txt" | cksum
+bp -j1 -f bare "$pat" "$dir/big.txt" | cksum
+rm -rf "$dir"
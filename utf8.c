@@ -2,6 +2,7 @@
 // utf8.c - UTF8 helper functions
 //
 #include <ctype.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <unistd.h>
@@ -12,6 +13,18 @@
 #define ARRAY_LEN(a) (sizeof(a)/sizeof((a)[0]))
 #define likely(x) __builtin_expect((x), 1)
 #define unlikely(x) __builtin_expect((x), 0)
+#define IN_BITMAP(bits, c) (((bits)[(c) >> 6] >> ((c) & 63)) & 1)
+
+// ASCII identifier characters: `A-Z`, `a-z`, and `_` (plus `0-9` to continue)
+static const uint64_t ascii_idstart[2] = {0, 0x07FFFFFE87FFFFFE};
+static const uint64_t ascii_idcontinue[2] = {0x03FF000000000000, 0x07FFFFFE87FFFFFE};
+
+// Bitmaps of which codepoints in the Basic Multilingual Plane are identifier
+// characters, which are built from the tables below the first time they're
+// needed. Codepoints outside of the BMP are binary searched for in the tables.
+#define BMP_SIZE 0x10000
+static uint64_t bmp_idstart[BMP_SIZE/64], bmp_idcontinue[BMP_SIZE/64];
+static pthread_once_t bmp_once = PTHREAD_ONCE_INIT;
 
 static const uint32_t XID_Start[][2] = {
     {0x0041,0x005A}, {0x0061,0x007A}, {0x00AA,0x00AA}, {0x00B5,0x00B5}, {0x00BA,0x00BA}, {0x00C0,0x00D6}, {0x00D8,0x00F6}, {0x00F8,0x01BA},
@@ -248,7 +261,7 @@ static uint32_t get_codepoint(const char *str, const char *end)
 static bool find_in_ranges(uint32_t codepoint, const uint32_t ranges[][2], size_t nranges)
 {
     // Binary search:
-    int lo = 0, hi = nranges - 1;
+    int lo = 0, hi = (int)nranges - 1;
     while (lo <= hi) {
         int mid = (lo + hi) / 2;
         if (ranges[mid][0] <= codepoint && codepoint <= ranges[mid][1])
@@ -261,25 +274,54 @@ static bool find_in_ranges(uint32_t codepoint, const uint32_t ranges[][2], size_
     return false;
 }
 
+//
+// Set the bits for the BMP codepoints in a table of ranges.
+//
+static void add_bmp_ranges(uint64_t bitmap[], const uint32_t ranges[][2], size_t nranges)
+{
+    for (size_t i = 0; i < nranges && ranges[i][0] < BMP_SIZE; i++) {
+        for (uint32_t c = ranges[i][0]; c <= ranges[i][1] && c < BMP_SIZE; c++)
+            bitmap[c >> 6] |= (uint64_t)1 << (c & 63);
+    }
+}
+
+static void build_bmp_bitmaps(void)
+{
+    add_bmp_ranges(bmp_idstart, XID_Start, ARRAY_LEN(XID_Start));
+    add_bmp_ranges(bmp_idcontinue, XID_Start, ARRAY_LEN(XID_Start));
+    add_bmp_ranges(bmp_idcontinue, XID_Continue_only, ARRAY_LEN(XID_Continue_only));
+}
+
+//
+// Return whether a BMP codepoint is set in one of the BMP bitmaps.
+//
+static inline bool in_bmp(const uint64_t bitmap[], uint32_t codepoint)
+{
+    pthread_once(&bmp_once, build_bmp_bitmaps);
+    return IN_BITMAP(bitmap, codepoint);
+}
+
 public bool isidstart(const char *str, const char *end)
 {
     if (unlikely(str >= end)) return false;
-    else if (isalpha(*str) || *str == '_') return true;
-    else if (likely((*str & 0x80) == 0)) return false;
+    unsigned char c = (unsigned char)*str;
+    if (likely(c < 0x80)) return IN_BITMAP(ascii_idstart, c);
     uint32_t codepoint = get_codepoint(str, end);
-    return codepoint != (uint32_t)-1
-        && find_in_ranges(codepoint, XID_Start, ARRAY_LEN(XID_Start));
+    if (codepoint == (uint32_t)-1) return false;
+    else if (codepoint < BMP_SIZE) return in_bmp(bmp_idstart, codepoint);
+    return find_in_ranges(codepoint, XID_Start, ARRAY_LEN(XID_Start));
 }
 
 public bool isidcontinue(const char *str, const char *end)
 {
     if (unlikely(str >= end)) return false;
-    else if (isalnum(*str) || *str == '_') return true;
-    else if (likely((*str & 0x80) == 0)) return false;
+    unsigned char c = (unsigned char)*str;
+    if (likely(c < 0x80)) return IN_BITMAP(ascii_idcontinue, c);
     uint32_t codepoint = get_codepoint(str, end);
-    return codepoint != (uint32_t)-1
-        && (find_in_ranges(codepoint, XID_Start, ARRAY_LEN(XID_Start))
-            || find_in_ranges(codepoint, XID_Continue_only, ARRAY_LEN(XID_Continue_only)));
+    if (codepoint == (uint32_t)-1) return false;
+    else if (codepoint < BMP_SIZE) return in_bmp(bmp_idcontinue, codepoint);
+    return find_in_ranges(codepoint, XID_Start, ARRAY_LEN(XID_Start))
+        || find_in_ranges(codepoint, XID_Continue_only, ARRAY_LEN(XID_Continue_only));
 }
 
 // vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -0,0 +1,609 @@
+//
+// vm.c - Code for compiling patterns into bytecode and running it.
+//
+// Matching a pattern with match() walks the pattern tree recursively, looks
+// up rules by name, and builds a match object for every step. When only the
+// end of a match is needed, a pattern can instead be compiled into bytecode
+// for a backtracking virtual machine (in the style of LPeg's parsing machine):
+// rule references are resolved to addresses once, ordered choice and
+// lookahead use an explicit backtrack stack, and no match objects are made.
+// Patterns that need the full matcher (e.g. replacements, lookbehind,
+// backreferences, nested definitions, or left recursion) aren't compiled.
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pattern.h"
+#include "scan.h"
+#include "utf8.h"
+#include "utils.h"
+#include "vm.h"
+
+// Upper limit on the number of instructions in a program. Bounded
+// repetitions are compiled by unrolling them, so this keeps nested
+// repetitions from blowing up.
+#define MAX_PROGRAM_SIZE (1<<16)
+// Repetitions with more than this many required (or optional) copies of a
+// pattern are not compiled:
+#define MAX_UNROLL 8
+// Number of (direct mapped) slots for remembering rules that failed to match
+#define FAILURE_SLOTS (1<<12)
+
+#define NO_RULE UINT32_MAX
+#define IN_BYTESET(bits, c) (((bits)[(unsigned char)(c) >> 6] >> ((unsigned char)(c) & 63)) & 1)
+
+typedef enum {
+    OP_END, OP_FAIL,
+    // Tests that fail or move forward at the current position:
+    OP_ANYCHAR, OP_ID_START, OP_ID_CONTINUE, OP_STRING, OP_RANGE, OP_BYTESET,
+    OP_START_OF_FILE, OP_START_OF_LINE, OP_END_OF_FILE, OP_END_OF_LINE,
+    OP_WORD_BOUNDARY, OP_NODENT,
+    // Repetition of a byte set (`a` times at least, `b` times at most):
+    OP_SPAN,
+    // Steps of `..`:
+    OP_TO_END_OF_LINE, OP_ADVANCE, OP_JUMP_IF_END_OF_LINE,
+    // Skipping the first of two choices when it can't start with the next byte:
+    OP_JUMP_UNLESS_FIRST_BYTE,
+    // Control flow. Choices push a backtrack entry for continuing at `a`:
+    OP_JUMP, OP_CHOICE, OP_COMMIT, OP_LOOP_COMMIT, OP_PROGRESS_COMMIT,
+    OP_BACK_COMMIT, OP_FAIL_TWICE, OP_CALL, OP_RETURN,
+} opcode_e;
+
+typedef struct {
+    opcode_e op;
+    // Jump target (or minimum repetitions)
+    uint32_t a;
+    // Rule number for calls (or maximum repetitions)
+    int32_t b;
+    bp_pat_t *pat;
+} instr_t;
+
+// An entry on the stack, which is either a place to backtrack to (`rule` is
+// NO_RULE), or a rule call's return address.
+typedef struct {
+    uint32_t pc, rule;
+    const char *pos;
+} frame_t;
+
+typedef struct {
+    const char *pos;
+    uint32_t rule, search_id;
+} failure_t;
+
+struct bp_program_s {
+    instr_t *code;
+    frame_t *stack;
+    size_t stack_capacity;
+    // Rule calls that are known to fail during a search:
+    failure_t failures[FAILURE_SLOTS];
+};
+
+typedef struct {
+    instr_t *code;
+    size_t len, capacity;
+    bp_pat_t *defs;
+    bool keep_captures, failed;
+    // The definitions that have been referenced, and their addresses:
+    struct {
+        bp_pat_t *meaning;
+        uint32_t addr;
+    } *rules;
+    size_t nrules, rules_capacity;
+    // The rule being compiled, and which rules are called by other rules
+    // before consuming any input (for detecting left recursion):
+    uint32_t current_rule;
+    struct { uint32_t caller, callee; } *start_calls;
+    size_t nstart_calls, start_calls_capacity;
+} compiler_t;
+
+static void compile(compiler_t *c, bp_pat_t *pat, bool at_start);
+
+//
+// Append an instruction and return its address.
+//
+static uint32_t emit(compiler_t *c, instr_t instr)
+{
+    if (c->len >= MAX_PROGRAM_SIZE) {
+        c->failed = true;
+        return 0;
+    }
+    if (c->len >= c->capacity)
+        c->code = grow(c->code, c->capacity = (c->capacity == 0 ? 64 : 2*c->capacity));
+    c->code[c->len] = instr;
+    return (uint32_t)c->len++;
+}
+
+//
+// Set the jump target of an instruction to the next instruction's address.
+//
+static inline void patch(compiler_t *c, uint32_t addr)
+{
+    if (!c->failed) c->code[addr].a = (uint32_t)c->len;
+}
+
+//
+// Return the number of the rule for a definition, adding it to the list of
+// rules to compile if it's new.
+//
+static uint32_t get_rule(compiler_t *c, bp_pat_t *meaning)
+{
+    for (size_t i = 0; i < c->nrules; i++)
+        if (c->rules[i].meaning == meaning) return (uint32_t)i;
+    if (c->nrules >= c->rules_capacity)
+        c->rules = grow(c->rules, c->rules_capacity = (c->rules_capacity == 0 ? 16 : 2*c->rules_capacity));
+    c->rules[c->nrules].meaning = meaning;
+    c->rules[c->nrules].addr = 0;
+    return (uint32_t)c->nrules++;
+}
+
+//
+// Compile `count` repetitions of a pattern (with separators between them),
+// returning whether the end is still at the start of the current rule.
+//
+static bool compile_copies(compiler_t *c, bp_pat_t *repeating, bp_pat_t *sep, uint32_t count, bool sep_first, bool at_start)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        if (sep && (i > 0 || sep_first)) {
+            compile(c, sep, at_start);
+            at_start = at_start && sep->min_matchlen == 0;
+        }
+        compile(c, repeating, at_start);
+        at_start = at_start && repeating->min_matchlen == 0;
+    }
+    return at_start;
+}
+
+//
+// Compile a repetition. This has the same behavior as the BP_REPEAT case of
+// match(), including stopping once an iteration makes no progress.
+//
+static void compile_repeat(compiler_t *c, bp_pat_t *pat, bool at_start)
+{
+    auto repeat = When(pat, BP_REPEAT);
+    bp_pat_t *repeating = repeat->repeat_pat, *sep = repeat->sep;
+    bp_pat_t *set = repeating;
+    if (set->type == BP_REF)
+        set = lookup_def(c->defs, When(set, BP_REF)->name_id);
+    if (set && set->type == BP_BYTESET && !sep) {
+        emit(c, (instr_t){.op = OP_SPAN, .pat = set, .a = repeat->min, .b = repeat->max});
+        return;
+    }
+
+    if (repeat->max != -1 && (uint32_t)repeat->max < repeat->min) {
+        emit(c, (instr_t){.op = OP_FAIL});
+        return;
+    }
+    if (repeat->min > MAX_UNROLL || (repeat->max != -1 && (uint32_t)repeat->max - repeat->min > MAX_UNROLL)) {
+        c->failed = true;
+        return;
+    }
+
+    at_start = compile_copies(c, repeating, sep, repeat->min, false, at_start);
+    bool sep_first = repeat->min > 0;
+    if (repeat->max == -1) {
+        uint32_t first = NO_RULE;
+        if (sep && !sep_first) {
+            // The first optional copy doesn't have a separator:
+            first = emit(c, (instr_t){.op = OP_CHOICE});
+            compile(c, repeating, at_start);
+            emit(c, (instr_t){.op = OP_COMMIT, .a = (uint32_t)c->len + 1});
+            sep_first = true;
+        }
+        // LOOP_COMMIT jumps back to just after the choice, keeping its
+        // backtrack entry, unless no progress was made:
+        uint32_t choice = emit(c, (instr_t){.op = OP_CHOICE});
+        compile_copies(c, repeating, sep, 1, sep_first, at_start);
+        emit(c, (instr_t){.op = OP_LOOP_COMMIT, .a = choice + 1});
+        if (first != NO_RULE) patch(c, first);
+        patch(c, choice);
+    } else {
+        uint32_t choices[MAX_UNROLL];
+        uint32_t optional = (uint32_t)repeat->max - repeat->min;
+        for (uint32_t i = 0; i < optional; i++) {
+            choices[i] = emit(c, (instr_t){.op = OP_CHOICE});
+            compile_copies(c, repeating, sep, 1, sep_first || i > 0, at_start);
+            emit(c, (instr_t){.op = OP_COMMIT, .a = (uint32_t)c->len + 1});
+        }
+        for (uint32_t i = 0; i < optional; i++)
+            patch(c, choices[i]);
+    }
+}
+
+//
+// Compile `..` (or `.. % skip`, or `..=`). This has the same behavior as the
+// BP_UPTO case of match().
+//
+static void compile_upto(compiler_t *c, bp_pat_t *pat, bool at_start)
+{
+    bool strict = pat->type == BP_UPTO_STRICT;
+    bp_pat_t *target = strict ? When(pat, BP_UPTO_STRICT)->target : When(pat, BP_UPTO)->target;
+    bp_pat_t *skip = strict ? When(pat, BP_UPTO_STRICT)->skip : When(pat, BP_UPTO)->skip;
+    if (!target && !skip) {
+        emit(c, (instr_t){.op = OP_TO_END_OF_LINE});
+        return;
+    }
+
+    uint32_t loop = (uint32_t)c->len, done;
+    if (target) {
+        uint32_t choice = emit(c, (instr_t){.op = OP_CHOICE});
+        compile(c, target, at_start);
+        done = emit(c, (instr_t){.op = OP_BACK_COMMIT});
+        patch(c, choice);
+    } else {
+        done = emit(c, (instr_t){.op = OP_JUMP_IF_END_OF_LINE});
+    }
+    if (skip) {
+        uint32_t choice = emit(c, (instr_t){.op = OP_CHOICE});
+        compile(c, skip, at_start);
+        emit(c, (instr_t){.op = OP_PROGRESS_COMMIT, .a = loop});
+        patch(c, choice);
+    }
+    if (strict) {
+        emit(c, (instr_t){.op = OP_FAIL});
+    } else {
+        emit(c, (instr_t){.op = OP_ADVANCE});
+        emit(c, (instr_t){.op = OP_JUMP, .a = loop});
+    }
+    patch(c, done);
+}
+
+//
+// Compile a pattern. `at_start` is whether the pattern may be matched at the
+// position where the rule being compiled started matching.
+//
+static void compile(compiler_t *c, bp_pat_t *pat, bool at_start)
+{
+    if (c->failed) return;
+    switch (pat->type) {
+    case BP_ANYCHAR: emit(c, (instr_t){.op = OP_ANYCHAR}); break;
+    case BP_ID_START: emit(c, (instr_t){.op = OP_ID_START}); break;
+    case BP_ID_CONTINUE: emit(c, (instr_t){.op = OP_ID_CONTINUE}); break;
+    case BP_STRING: emit(c, (instr_t){.op = OP_STRING, .pat = pat}); break;
+    case BP_RANGE: emit(c, (instr_t){.op = OP_RANGE, .pat = pat}); break;
+    case BP_BYTESET: emit(c, (instr_t){.op = OP_BYTESET, .pat = pat}); break;
+    case BP_START_OF_FILE: emit(c, (instr_t){.op = OP_START_OF_FILE}); break;
+    case BP_START_OF_LINE: emit(c, (instr_t){.op = OP_START_OF_LINE}); break;
+    case BP_END_OF_FILE: emit(c, (instr_t){.op = OP_END_OF_FILE}); break;
+    case BP_END_OF_LINE: emit(c, (instr_t){.op = OP_END_OF_LINE}); break;
+    case BP_WORD_BOUNDARY: emit(c, (instr_t){.op = OP_WORD_BOUNDARY}); break;
+    case BP_NODENT: emit(c, (instr_t){.op = OP_NODENT}); break;
+    case BP_NOT: {
+        uint32_t choice = emit(c, (instr_t){.op = OP_CHOICE});
+        compile(c, When(pat, BP_NOT)->pat, at_start);
+        emit(c, (instr_t){.op = OP_FAIL_TWICE});
+        patch(c, choice);
+        break;
+    }
+    case BP_BEFORE: {
+        uint32_t choice = emit(c, (instr_t){.op = OP_CHOICE});
+        compile(c, When(pat, BP_BEFORE)->pat, at_start);
+        uint32_t commit = emit(c, (instr_t){.op = OP_BACK_COMMIT});
+        patch(c, choice);
+        emit(c, (instr_t){.op = OP_FAIL});
+        patch(c, commit);
+        break;
+    }
+    case BP_UPTO: case BP_UPTO_STRICT: compile_upto(c, pat, at_start); break;
+    case BP_REPEAT: compile_repeat(c, pat, at_start); break;
+    case BP_OTHERWISE: {
+        auto choice = When(pat, BP_OTHERWISE);
+        bool any_byte = true;
+        for (int i = 0; i < 4; i++)
+            any_byte = any_byte && choice->first_bytes[i] == UINT64_MAX;
+        uint32_t skip = any_byte ? 0 : emit(c, (instr_t){.op = OP_JUMP_UNLESS_FIRST_BYTE, .pat = pat});
+        uint32_t backtrack = emit(c, (instr_t){.op = OP_CHOICE});
+        compile(c, choice->first, at_start);
+        uint32_t commit = emit(c, (instr_t){.op = OP_COMMIT});
+        patch(c, backtrack);
+        if (!any_byte) patch(c, skip);
+        compile(c, choice->second, at_start);
+        patch(c, commit);
+        break;
+    }
+    case BP_CHAIN: {
+        auto chain = When(pat, BP_CHAIN);
+        // Definitions that are only in scope for part of a pattern, and
+        // backreferences, are handled by the full matcher:
+        if (chain->first->type == BP_DEFINITIONS
+            || (chain->first->type == BP_CAPTURE && When(chain->first, BP_CAPTURE)->backreffable)) {
+            c->failed = true;
+            break;
+        }
+        compile(c, chain->first, at_start);
+        compile(c, chain->second, at_start && chain->first->min_matchlen == 0);
+        break;
+    }
+    case BP_CAPTURE: case BP_TAGGED: {
+        // Captures only matter for match trees, so they can be matched as
+        // the pattern they capture if the caller doesn't need them:
+        bp_pat_t *captured = pat->type == BP_CAPTURE ? When(pat, BP_CAPTURE)->pat : When(pat, BP_TAGGED)->pat;
+        if (c->keep_captures) c->failed = true;
+        else if (captured) compile(c, captured, at_start);
+        break;
+    }
+    case BP_REF: {
+        auto ref = When(pat, BP_REF);
+        bp_pat_t *def = lookup_def(c->defs, ref->name_id);
+        if (!def) {
+            // Unknown rules are reported by the full matcher:
+            c->failed = true;
+            break;
+        }
+        uint32_t rule = get_rule(c, def);
+        if (at_start && c->current_rule != NO_RULE) {
+            if (c->nstart_calls >= c->start_calls_capacity)
+                c->start_calls = grow(c->start_calls, c->start_calls_capacity = (c->start_calls_capacity == 0 ? 16 : 2*c->start_calls_capacity));
+            c->start_calls[c->nstart_calls].caller = c->current_rule;
+            c->start_calls[c->nstart_calls].callee = rule;
+            ++c->nstart_calls;
+        }
+        emit(c, (instr_t){.op = OP_CALL, .b = (int32_t)rule});
+        break;
+    }
+    default: c->failed = true; break;
+    }
+}
+
+//
+// Return whether a rule can call itself without consuming any input (i.e. it
+// is left recursive). `state` is 0 for unvisited rules, 1 for rules that are
+// currently being visited, and 2 for rules that are known to be okay.
+//
+static bool is_left_recursive(compiler_t *c, uint32_t rule, char *state)
+{
+    if (state[rule] == 1) return true;
+    if (state[rule] == 2) return false;
+    state[rule] = 1;
+    for (size_t i = 0; i < c->nstart_calls; i++) {
+        if (c->start_calls[i].caller == rule && is_left_recursive(c, c->start_calls[i].callee, state))
+            return true;
+    }
+    state[rule] = 2;
+    return false;
+}
+
+//
+// Compile a pattern and the rules it uses from the given definitions, or
+// return NULL if the pattern can't be compiled. If `keep_captures` is false,
+// captures and tags are compiled as if they were the patterns they capture.
+//
+bp_program_t *compile_program(bp_pat_t *pat, bp_pat_t *defs, bool keep_captures)
+{
+    compiler_t c = {.defs = defs, .keep_captures = keep_captures, .current_rule = NO_RULE};
+    compile(&c, pat, false);
+    emit(&c, (instr_t){.op = OP_END});
+    // Rules are compiled after the main pattern (new rules may be added to
+    // the list while compiling):
+    for (size_t r = 0; r < c.nrules && !c.failed; r++) {
+        c.rules[r].addr = (uint32_t)c.len;
+        c.current_rule = (uint32_t)r;
+        compile(&c, c.rules[r].meaning, true);
+        emit(&c, (instr_t){.op = OP_RETURN});
+    }
+
+    if (!c.failed && c.nrules > 0) {
+        char *state = new(char[c.nrules]);
+        for (size_t r = 0; r < c.nrules && !c.failed; r++)
+            if (is_left_recursive(&c, (uint32_t)r, state)) c.failed = true;
+        delete(&state);
+    }
+
+    bp_program_t *prog = NULL;
+    if (!c.failed) {
+        for (size_t i = 0; i < c.len; i++)
+            if (c.code[i].op == OP_CALL) c.code[i].a = c.rules[c.code[i].b].addr;
+        prog = new(bp_program_t);
+        prog->code = c.code;
+        c.code = NULL;
+    }
+    if (c.code) delete(&c.code);
+    if (c.rules) delete(&c.rules);
+    if (c.start_calls) delete(&c.start_calls);
+    return prog;
+}
+
+//
+// Slot for remembering that a rule failed at a position
+//
+static inline failure_t *failure_slot(bp_program_t *prog, const char *pos, uint32_t rule)
+{
+    return &prog->failures[(((uintptr_t)pos * 31) ^ (rule * 0x9E3779B1u)) & (FAILURE_SLOTS-1)];
+}
+
+//
+// Put a frame on the stack at the given index, growing the stack if needed.
+//
+static inline void push(bp_program_t *prog, size_t sp, frame_t frame)
+{
+    if (sp >= prog->stack_capacity)
+        prog->stack = grow(prog->stack, prog->stack_capacity = (prog->stack_capacity == 0 ? 64 : 2*prog->stack_capacity));
+    prog->stack[sp] = frame;
+}
+
+//
+// Use up one step of a step budget (if there is one), returning false if
+// there were no steps left.
+//
+static inline bool take_step(size_t *steps_left)
+{
+    if (!steps_left) return true;
+    if (*steps_left == 0) return false;
+    --*steps_left;
+    return true;
+}
+
+//
+// Run a program at the given position, returning where the match ends, or
+// NULL if there is no match. `search_id` identifies the text being searched,
+// so rule failures from an earlier search aren't reused. If `steps_left`
+// isn't NULL, each rule call and backtrack uses up a step, and the program
+// gives up (returning NULL and leaving `*steps_left` at 0) when there are
+// none left.
+//
+const char *run_program(bp_program_t *prog, const char *start, const char *end, const char *str, bool ignorecase, uint32_t search_id, size_t *steps_left)
+{
+    const instr_t *code = prog->code;
+    size_t sp = 0;
+    for (uint32_t pc = 0; ; ) {
+        const instr_t *in = &code[pc];
+        switch (in->op) {
+        case OP_END: return str;
+        case OP_FAIL: goto fail;
+        case OP_ANYCHAR:
+            if (str >= end || *str == '\n') goto fail;
+            str = next_char(str, end);
+            ++pc; continue;
+        case OP_ID_START:
+            if (str >= end || !isidstart(str, end)) goto fail;
+            str = next_char(str, end);
+            ++pc; continue;
+        case OP_ID_CONTINUE:
+            if (str >= end || !isidcontinue(str, end)) goto fail;
+            str = next_char(str, end);
+            ++pc; continue;
+        case OP_STRING: {
+            size_t len = in->pat->min_matchlen;
+            if (&str[len] > end) goto fail;
+            if (ignorecase ? !memcaseeq(str, When(in->pat, BP_STRING)->string, len)
+                : memcmp(str, When(in->pat, BP_STRING)->string, len) != 0)
+                goto fail;
+            str += len;
+            ++pc; continue;
+        }
+        case OP_RANGE: {
+            auto range = When(in->pat, BP_RANGE);
+            if (str >= end || (unsigned char)*str < range->low || (unsigned char)*str > range->high) goto fail;
+            ++str;
+            ++pc; continue;
+        }
+        case OP_BYTESET: {
+            auto set = When(in->pat, BP_BYTESET);
+            if (str >= end || !IN_BYTESET(ignorecase ? set->nocase_bits : set->bits, *str)) goto fail;
+            ++str;
+            ++pc; continue;
+        }
+        case OP_START_OF_FILE:
+            if (str != start) goto fail;
+            ++pc; continue;
+        case OP_START_OF_LINE:
+            if (str != start && str[-1] != '\n') goto fail;
+            ++pc; continue;
+        case OP_END_OF_FILE:
+            if (str != end && !(str == end-1 && *str == '\n')) goto fail;
+            ++pc; continue;
+        case OP_END_OF_LINE:
+            if (str != end && *str != '\n') goto fail;
+            ++pc; continue;
+        case OP_WORD_BOUNDARY:
+            if (str != start && isidcontinue(str, end) == isidcontinue(prev_char(start, str), end)) goto fail;
+            ++pc; continue;
+        case OP_NODENT: {
+            if (*str != '\n') goto fail;
+            const char *p = str;
+            while (p > start && p[-1] != '\n') --p;
+            // Current indentation:
+            char denter = *p;
+            int dents = 0;
+            if (denter == ' ' || denter == '\t') {
+                for (; *p == denter && p < end; ++p) ++dents;
+            }
+            // Subsequent indentation:
+            while (*str == '\n') ++str;
+            for (int i = 0; i < dents; i++)
+                if (&str[i] >= end || str[i] != denter) goto fail;
+            str = &str[dents];
+            ++pc; continue;
+        }
+        case OP_SPAN: {
+            auto set = When(in->pat, BP_BYTESET);
+            const uint64_t *bits = ignorecase ? set->nocase_bits : set->bits;
+            size_t reps = 0;
+            for (; (in->b == -1 || reps < (size_t)in->b) && str < end && IN_BYTESET(bits, *str); ++reps)
+                ++str;
+            if (reps < in->a) goto fail;
+            ++pc; continue;
+        }
+        case OP_TO_END_OF_LINE:
+            while (str < end && *str != '\n') ++str;
+            ++pc; continue;
+        case OP_ADVANCE:
+            if (str >= end || *str == '\n') goto fail;
+            str = next_char(str, end);
+            ++pc; continue;
+        case OP_JUMP_IF_END_OF_LINE:
+            pc = (str == end || *str == '\n') ? in->a : pc + 1;
+            continue;
+        case OP_JUMP_UNLESS_FIRST_BYTE:
+            pc = (str < end && !IN_BYTESET(When(in->pat, BP_OTHERWISE)->first_bytes, *str)) ? in->a : pc + 1;
+            continue;
+        case OP_JUMP:
+            pc = in->a; continue;
+        case OP_CHOICE:
+            push(prog, sp++, (frame_t){.pc = in->a, .rule = NO_RULE, .pos = str});
+            ++pc; continue;
+        case OP_CALL: {
+            if (!take_step(steps_left)) return NULL;
+            failure_t *failure = failure_slot(prog, str, (uint32_t)in->b);
+            if (failure->pos == str && failure->rule == (uint32_t)in->b && failure->search_id == search_id)
+                goto fail;
+            push(prog, sp++, (frame_t){.pc = pc + 1, .rule = (uint32_t)in->b, .pos = str});
+            pc = in->a; continue;
+        }
+        case OP_RETURN:
+            pc = prog->stack[--sp].pc; continue;
+        case OP_COMMIT:
+            --sp;
+            pc = in->a; continue;
+        case OP_LOOP_COMMIT: {
+            frame_t *top = &prog->stack[sp-1];
+            if (str == top->pos) { // No progress, so stop looping
+                --sp;
+                pc = top->pc;
+            } else {
+                top->pos = str;
+                pc = in->a;
+            }
+            continue;
+        }
+        case OP_PROGRESS_COMMIT:
+            if (str == prog->stack[--sp].pos) goto fail;
+            pc = in->a; continue;
+        case OP_BACK_COMMIT:
+            str = prog->stack[--sp].pos;
+            pc = in->a; continue;
+        case OP_FAIL_TWICE:
+            --sp;
+            goto fail;
+        }
+
+      fail:
+        // Unwind to the most recent backtrack entry. Any rule calls that are
+        // unwound along the way failed, so remember that.
+        if (!take_step(steps_left)) return NULL;
+        for (;;) {
+            if (sp == 0) return NULL;
+            frame_t *top = &prog->stack[--sp];
+            if (top->rule == NO_RULE) {
+                str = top->pos;
+                pc = top->pc;
+                break;
+            }
+            *failure_slot(prog, top->pos, top->rule) = (failure_t){.pos = top->pos, .rule = top->rule, .search_id = search_id};
+        }
+    }
+}
+
+//
+// Free the memory used by a program.
+//
+void destroy_program(bp_program_t **at_prog)
+{
+    bp_program_t *prog = *at_prog;
+    if (prog->code) delete(&prog->code);
+    if (prog->stack) delete(&prog->stack);
+    delete(at_prog);
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
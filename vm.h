@@ -0,0 +1,22 @@
+//
+// vm.h - Header file for compiling patterns into bytecode.
+//
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pattern.h"
+
+// A pattern (and the definitions it uses) compiled into bytecode
+typedef struct bp_program_s bp_program_t;
+
+__attribute__((nonnull(1)))
+bp_program_t *compile_program(bp_pat_t *pat, bp_pat_t *defs, bool keep_captures);
+__attribute__((nonnull(1,2,3,4)))
+const char *run_program(bp_program_t *prog, const char *start, const char *end, const char *str, bool ignorecase, uint32_t search_id, size_t *steps_left);
+__attribute__((nonnull))
+void destroy_program(bp_program_t **at_prog);
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0